@@ -0,0 +1,10 @@
+-- SPDX-License-Identifier: GPL-3.0-or-later
+
+-- 每次连接/登录都要查的列，之前全是全表扫描
+-- whitelist.name、tempban.uid、tempmute.uid 是主键，本来就有索引
+-- pWinRateView按(id, mode)聚合时用的是pWinRate主键(id, mode, role)的前缀，也不用另建
+
+CREATE INDEX IF NOT EXISTS idx_banip_ip ON banip(ip);
+CREATE INDEX IF NOT EXISTS idx_banuuid_uuid ON banuuid(uuid);
+CREATE INDEX IF NOT EXISTS idx_uuidinfo_uuid ON uuidinfo(uuid);
+CREATE INDEX IF NOT EXISTS idx_userinfo_name ON userinfo(name);
@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "core/ahocorasick.h"
+
+AhoCorasick::AhoCorasick(const std::vector<std::string> &patterns) {
+  std::array<bool, 256> used {};
+  for (auto &p : patterns) {
+    for (auto c : p) used[(uint8_t)c] = true;
+  }
+
+  if (std::all_of(used.begin(), used.end(), [](bool b) { return b; })) {
+    // 256种字节全出现了，没有“其他”，直接一字节一类
+    for (int i = 0; i < 256; i++) m_byte_class[i] = i;
+    m_class_count = 256;
+  } else {
+    for (int i = 0; i < 256; i++) {
+      if (used[i]) m_byte_class[i] = m_class_count++;
+    }
+  }
+
+  // 先建trie，0表示没有边（根节点不会是别人的孩子）
+  auto K = m_class_count;
+  m_next.assign(K, 0);
+  m_accept.assign(1, false);
+  for (auto &p : patterns) {
+    if (p.empty()) continue;
+    m_pattern_count++;
+
+    uint32_t s = 0;
+    for (auto c : p) {
+      auto cls = m_byte_class[(uint8_t)c];
+      if (m_next[s * K + cls] == 0) {
+        m_next[s * K + cls] = m_accept.size();
+        m_accept.push_back(false);
+        m_next.resize(m_next.size() + K, 0);
+      }
+      s = m_next[s * K + cls];
+    }
+    m_accept[s] = true;
+  }
+
+  // BFS补全失配边，顺便把fail链上的accept传下来
+  std::vector<uint32_t> fail(m_accept.size(), 0);
+  std::deque<uint32_t> queue;
+  for (size_t c = 0; c < K; c++) {
+    if (auto t = m_next[c]; t != 0) queue.push_back(t);
+  }
+  while (!queue.empty()) {
+    auto s = queue.front();
+    queue.pop_front();
+    if (m_accept[fail[s]]) m_accept[s] = true;
+
+    for (size_t c = 0; c < K; c++) {
+      auto &t = m_next[s * K + c];
+      if (t != 0) {
+        fail[t] = m_next[fail[s] * K + c];
+        queue.push_back(t);
+      } else {
+        t = m_next[fail[s] * K + c];
+      }
+    }
+  }
+}
+
+bool AhoCorasick::matches(const std::string_view &text) const {
+  if (m_pattern_count == 0) return false;
+
+  auto K = m_class_count;
+  const auto *next = m_next.data();
+  uint32_t s = 0;
+  for (auto c : text) {
+    s = next[s * K + m_byte_class[(uint8_t)c]];
+    if (m_accept[s]) return true;
+  }
+  return false;
+}
+
+size_t AhoCorasick::patternCount() const {
+  return m_pattern_count;
+}
+
+size_t AhoCorasick::stateCount() const {
+  return m_accept.size();
+}
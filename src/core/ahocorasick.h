@@ -0,0 +1,31 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+// 多模式串匹配，一遍扫完输入就能知道有没有命中任何一个模式串
+// 直接在UTF-8字节上建自动机：UTF-8是自同步的，合法的模式串只会在字符边界上命中，
+// 所以中文和按码点匹配的结果完全一样，不用先解码
+// 建好之后只读，可以多线程同时用
+class AhoCorasick {
+public:
+  AhoCorasick() = default;
+  explicit AhoCorasick(const std::vector<std::string> &patterns);
+  AhoCorasick(AhoCorasick &) = delete;
+  AhoCorasick(AhoCorasick &&) = delete;
+
+  // 是否包含任意一个模式串；空串模式会被忽略
+  bool matches(const std::string_view &text) const;
+
+  size_t patternCount() const;
+  size_t stateCount() const;
+
+private:
+  // 只有模式串里出现过的字节有自己的编号，其余都归到0号，压缩状态表
+  std::array<uint8_t, 256> m_byte_class {};
+  size_t m_class_count = 1;
+
+  // 完全展开的DFA：m_next[state * m_class_count + class]
+  std::vector<uint32_t> m_next;
+  std::vector<bool> m_accept;
+  size_t m_pattern_count = 0;
+};
@@ -5,7 +5,38 @@
 #include <spdlog/spdlog.h>
 #include "util.h"
 
-Sqlite3::Sqlite3(const char *filename, const char *initSql) {
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+static std::atomic<uint64_t> next_uid = 1;
+std::atomic<int> Sqlite3::reader_pool_size = 4;
+
+static void applyPragmas(sqlite3 *db, bool readonly) {
+  // 写连接负责切到WAL，journal_mode是持久化在文件里的，读连接不用再设
+  const char *sql = readonly ?
+    "PRAGMA mmap_size=268435456;"
+    "PRAGMA cache_size=-8192;"
+    "PRAGMA busy_timeout=5000;"
+    :
+    "PRAGMA auto_vacuum=INCREMENTAL;"  // 只对新建的库生效
+    "PRAGMA journal_mode=WAL;"
+    "PRAGMA synchronous=NORMAL;"
+    "PRAGMA mmap_size=268435456;"
+    "PRAGMA cache_size=-16384;"
+    "PRAGMA temp_store=MEMORY;"
+    "PRAGMA busy_timeout=5000;";
+
+  char *err_msg = nullptr;
+  if (sqlite3_exec(db, sql, nullptr, nullptr, &err_msg) != SQLITE_OK) {
+    spdlog::warn("cannot apply sqlite pragmas: {}", err_msg ? err_msg : "");
+    sqlite3_free(err_msg);
+  }
+}
+
+Sqlite3::Sqlite3(const char *filename, const char *initSql, const char *migrationDir) :
+  filename { filename }, uid { next_uid++ }
+{
   std::ifstream file { initSql, std::ios_base::in };
   if (!file.is_open()) {
     spdlog::error("cannot open {}. Quit now.", initSql);
@@ -25,6 +56,8 @@ Sqlite3::Sqlite3(const char *filename, const char *initSql) {
     std::exit(1);
   }
 
+  applyPragmas(db, false);
+
   rc = sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err_msg);
   if (rc != SQLITE_OK) {
     spdlog::error("sqlite error: {}", err_msg);
@@ -32,16 +65,261 @@ Sqlite3::Sqlite3(const char *filename, const char *initSql) {
     sqlite3_close(db);
     std::exit(1);
   }
+
+  if (migrationDir) migrate(migrationDir);
+}
+
+void Sqlite3::migrate(const char *dir) {
+  namespace fs = std::filesystem;
+
+  exec("CREATE TABLE IF NOT EXISTS schema_version ("
+       "version INTEGER PRIMARY KEY, name TEXT, appliedAt INTEGER);");
+  int current = schemaVersion();
+
+  std::vector<std::pair<int, fs::path>> scripts;
+  std::error_code ec;
+  for (auto &entry : fs::directory_iterator(dir, ec)) {
+    auto name = entry.path().filename().string();
+    if (entry.path().extension() != ".sql" || name.empty() || !isdigit(name[0])) continue;
+    int version = atoi(name.c_str());
+    if (version > current) scripts.emplace_back(version, entry.path());
+  }
+  if (ec) {
+    spdlog::warn("cannot read migration directory {}: {}", dir, ec.message());
+    return;
+  }
+  std::sort(scripts.begin(), scripts.end());
+
+  for (auto &[version, path] : scripts) {
+    std::ifstream file { path };
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    auto sql = "BEGIN;" + buffer.str() + ";";
+
+    // 脚本和版本号在同一个事务里，失败就整个回滚，下次启动重来
+    char *err_msg = nullptr;
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err_msg) != SQLITE_OK ||
+        !execute("INSERT INTO schema_version (version, name, appliedAt) VALUES (?, ?, ?);",
+                 { version, path.filename().string(), (int64_t)time(nullptr) }) ||
+        sqlite3_exec(db, "COMMIT;", nullptr, nullptr, &err_msg) != SQLITE_OK) {
+      spdlog::error("migration {} failed: {}", path.string(),
+                    err_msg ? err_msg : sqlite3_errmsg(db));
+      sqlite3_free(err_msg);
+      sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+      std::exit(1);
+    }
+
+    spdlog::info("Applied database migration {}", path.filename().string());
+  }
+
+  // 表结构变了，让sqlite重新收集一下统计信息
+  if (!scripts.empty()) exec("PRAGMA optimize;");
+}
+
+Sqlite3::Sqlite3(const std::string &filename, ReadOnlyTag) :
+  filename { filename }, readonly { true }, uid { next_uid++ }
+{
+  int rc = sqlite3_open_v2(filename.c_str(), &db,
+                           SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr);
+  if (rc != SQLITE_OK) {
+    // 打不开就算了，reader()会退回到写连接
+    spdlog::error("Cannot open read-only connection to {}: {}",
+                  filename, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    db = nullptr;
+    return;
+  }
+
+  applyPragmas(db, true);
 }
 
 Sqlite3::~Sqlite3() {
   // spdlog::debug("[MEMORY] sqlite3 destructed");
+  readers.clear();
+  for (auto &[_, stmt] : stmt_cache) {
+    sqlite3_finalize(stmt);
+  }
+  if (db && !readonly) {
+    // 关服时把WAL合并回主文件，别留个大wal文件
+    sqlite3_exec(db, "PRAGMA wal_checkpoint(TRUNCATE);", nullptr, nullptr, nullptr);
+  }
   sqlite3_close(db);
 }
 
+Sqlite3 &Sqlite3::reader() {
+  if (readonly) return *this;
+
+  thread_local std::unordered_map<uint64_t, Sqlite3 *> assigned;
+  if (auto it = assigned.find(uid); it != assigned.end()) {
+    return *it->second;
+  }
+
+  Sqlite3 *ret = this;
+  {
+    std::lock_guard<std::mutex> locker { reader_lock };
+    size_t pool_size = std::max(reader_pool_size.load(), 0);
+    if (readers.size() < pool_size) {
+      auto conn = std::unique_ptr<Sqlite3>(new Sqlite3(filename, ReadOnlyTag {}));
+      if (conn->db) {
+        ret = conn.get();
+        readers.push_back(std::move(conn));
+      }
+    } else if (!readers.empty()) {
+      ret = readers[next_reader++ % readers.size()].get();
+    }
+  }
+
+  assigned[uid] = ret;
+  return *ret;
+}
+
+void Sqlite3::setReaderPoolSize(int n) {
+  reader_pool_size = std::max(n, 0);
+}
+
+int Sqlite3::readerPoolSize() {
+  return reader_pool_size;
+}
+
+// ===== checkString =====
+// 原来是 ['";#* /\\?<>|:]+|(--)|(/\*)|(\*/)|(--\+) 的regex_search
+// '/'和'*'本身就在字符集里，所以其实只有"禁用字符"和"--"两种情况
+// 合法的UTF-8里多字节字符的每个字节都>=0x80，不会和这些ASCII字符混淆，
+// 于是可以逐字节（或者一次16/32字节）扫，顺便把UTF-8校验也做了
+
+static constexpr auto forbidden_table = [] {
+  std::array<bool, 256> t {};
+  for (auto c : std::string_view { "'\";#* /\\?<>|:" }) t[(uint8_t)c] = true;
+  return t;
+}();
+
+namespace {
+struct ScanState {
+  bool prev_dash = false;
+  // UTF-8：还差几个后续字节，以及下一个后续字节的合法范围（排除超长编码和代理区）
+  int need = 0;
+  uint8_t lo = 0x80, hi = 0xBF;
+};
+}
+
+static inline bool utf8Step(ScanState &st, uint8_t c) {
+  if (st.need > 0) {
+    if (c < st.lo || c > st.hi) return false;
+    st.need--;
+    st.lo = 0x80; st.hi = 0xBF;
+    return true;
+  }
+
+  if (c < 0x80) return true;
+  if (c >= 0xC2 && c <= 0xDF) { st.need = 1; }
+  else if (c == 0xE0) { st.need = 2; st.lo = 0xA0; }
+  else if (c == 0xED) { st.need = 2; st.hi = 0x9F; }
+  else if (c >= 0xE1 && c <= 0xEF) { st.need = 2; }
+  else if (c == 0xF0) { st.need = 3; st.lo = 0x90; }
+  else if (c >= 0xF1 && c <= 0xF3) { st.need = 3; }
+  else if (c == 0xF4) { st.need = 3; st.hi = 0x8F; }
+  else return false;
+  return true;
+}
+
+static bool scanScalar(ScanState &st, const uint8_t *p, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    auto c = p[i];
+    if (forbidden_table[c]) return false;
+    bool dash = c == '-';
+    if (dash && st.prev_dash) return false;
+    st.prev_dash = dash;
+    if (!utf8Step(st, c)) return false;
+  }
+  return true;
+}
+
+// 向量版本只负责判断有没有禁用字符和"--"；块里有非ASCII字节（或者上一块留了半个字符）
+// 时再逐字节过一遍UTF-8，纯ASCII的块直接跳过
+static inline bool scanBlockTail(ScanState &st, const uint8_t *p, int width,
+                                 uint32_t dash, uint32_t high) {
+  if ((dash & (dash >> 1)) || (st.prev_dash && (dash & 1))) return false;
+  st.prev_dash = (dash >> (width - 1)) & 1;
+
+  if (high == 0 && st.need == 0) return true;
+  for (int i = 0; i < width; i++) {
+    if (!utf8Step(st, p[i])) return false;
+  }
+  return true;
+}
+
+#if defined(__SSE2__)
+static bool scanSse2(const uint8_t *p, size_t n) {
+  ScanState st;
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    auto v = _mm_loadu_si128((const __m128i *)(p + i));
+    auto bad = _mm_setzero_si128();
+    for (auto c : std::string_view { "'\";#* /\\?<>|:" }) {
+      bad = _mm_or_si128(bad, _mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+    }
+    if (_mm_movemask_epi8(bad)) return false;
+
+    uint32_t dash = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('-')));
+    uint32_t high = _mm_movemask_epi8(v);
+    if (!scanBlockTail(st, p + i, 16, dash, high)) return false;
+  }
+  return scanScalar(st, p + i, n - i) && st.need == 0;
+}
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// 用高低半字节查表（pshufb）代替13次比较：
+// 禁用字符按高半字节分成四组 0x2?, 0x3?, 0x5?, 0x7?，每组占一个bit
+__attribute__((target("avx2")))
+static bool scanAvx2(const uint8_t *p, size_t n) {
+  const auto lo_tbl = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+    /* 0 */ 1, 0, /* 2 */ 1, /* 3 */ 1, 0, 0, 0, /* 7 */ 1,
+    0, 0, /* A */ 1 | 2, /* B */ 2, /* C */ 2 | 4 | 8, 0, /* E */ 2, /* F */ 1 | 2));
+  const auto hi_tbl = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+    0, 0, /* 2 */ 1, /* 3 */ 2, 0, /* 5 */ 4, 0, /* 7 */ 8,
+    0, 0, 0, 0, 0, 0, 0, 0));
+  const auto nibble = _mm256_set1_epi8(0x0F);
+  const auto minus = _mm256_set1_epi8('-');
+
+  ScanState st;
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    auto v = _mm256_loadu_si256((const __m256i *)(p + i));
+    auto lo = _mm256_shuffle_epi8(lo_tbl, _mm256_and_si256(v, nibble));
+    auto hi = _mm256_shuffle_epi8(hi_tbl, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    auto hit = _mm256_and_si256(lo, hi);
+    if (!_mm256_testz_si256(hit, hit)) return false;
+
+    uint32_t dash = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, minus));
+    uint32_t high = _mm256_movemask_epi8(v);
+    if (!scanBlockTail(st, p + i, 32, dash, high)) return false;
+  }
+  return scanScalar(st, p + i, n - i) && st.need == 0;
+}
+#endif
+
+static bool scanPlain(const uint8_t *p, size_t n) {
+  ScanState st;
+  return scanScalar(st, p, n) && st.need == 0;
+}
+
 bool Sqlite3::checkString(const std::string_view &sv) {
-  static const std::regex exp(R"(['\";#* /\\?<>|:]+|(--)|(/\*)|(\*/)|(--\+))");
-  return !std::regex_search(sv.begin(), sv.end(), exp);
+  using ScanFn = bool (*)(const uint8_t *, size_t);
+  static const ScanFn scan = [] () -> ScanFn {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2")) return scanAvx2;
+#endif
+#if defined(__SSE2__)
+    return scanSse2;
+#else
+    return scanPlain;
+#endif
+  }();
+
+  // 名字之类的一般很短，凑不满一个向量就不绕弯了
+  if (sv.size() < 16) return scanPlain((const uint8_t *)sv.data(), sv.size());
+  return scan((const uint8_t *)sv.data(), sv.size());
 }
 
 // callback for handling SELECT expression
@@ -54,9 +332,16 @@ static int callback(void *arr, int argc, char **argv, char **cols) {
   return 0;
 }
 
+bool Sqlite3::reentered(std::string_view sql) const {
+  if (callback_thread.load(std::memory_order_relaxed) != std::this_thread::get_id()) return false;
+  spdlog::error("statement \"{}\" issued from a row callback on the same connection, ignored", sql);
+  return true;
+}
+
 Sqlite3::QueryResult Sqlite3::select(const std::string &sql) {
   QueryResult arr;
   char *err = NULL;
+  if (reentered(sql)) return arr;
   std::lock_guard<std::mutex> locker { select_lock };
   sqlite3_exec(db, sql.c_str(), callback, (void *)&arr, &err);
   if (err) {
@@ -67,11 +352,147 @@ Sqlite3::QueryResult Sqlite3::select(const std::string &sql) {
 }
 
 void Sqlite3::exec(const std::string &sql) {
+  if (reentered(sql)) return;
   std::lock_guard<std::mutex> locker { select_lock };
   auto bytes = sql.c_str();
   sqlite3_exec(db, bytes, nullptr, nullptr, nullptr);
 }
 
+bool Sqlite3::Row::isNull(int col) const {
+  return sqlite3_column_type(stmt, col) == SQLITE_NULL;
+}
+
+int64_t Sqlite3::Row::getInt(int col) const {
+  return sqlite3_column_int64(stmt, col);
+}
+
+std::string_view Sqlite3::Row::getText(int col) const {
+  auto text = (const char *)sqlite3_column_text(stmt, col);
+  if (!text) return {};
+  return { text, (size_t)sqlite3_column_bytes(stmt, col) };
+}
+
+std::string_view Sqlite3::Row::getBlob(int col) const {
+  auto blob = (const char *)sqlite3_column_blob(stmt, col);
+  if (!blob) return {};
+  return { blob, (size_t)sqlite3_column_bytes(stmt, col) };
+}
+
+// 调用者持有select_lock
+sqlite3_stmt *Sqlite3::prepare(std::string_view sql) {
+  std::string key { sql };
+  if (auto it = stmt_cache.find(key); it != stmt_cache.end()) {
+    return it->second;
+  }
+
+  sqlite3_stmt *stmt = nullptr;
+  int rc = sqlite3_prepare_v3(db, sql.data(), sql.size(),
+                              SQLITE_PREPARE_PERSISTENT, &stmt, nullptr);
+  if (rc != SQLITE_OK) {
+    spdlog::error("cannot prepare statement \"{}\": {}", sql, sqlite3_errmsg(db));
+    return nullptr;
+  }
+
+  stmt_cache[std::move(key)] = stmt;
+  return stmt;
+}
+
+bool Sqlite3::run(std::string_view sql, std::initializer_list<Param> params,
+                  const RowCallback *onRow) {
+  if (reentered(sql)) return false;
+  std::lock_guard<std::mutex> locker { select_lock };
+  auto stmt = prepare(sql);
+  if (!stmt) return false;
+
+  int i = 1;
+  for (auto &param : params) {
+    std::visit([&](auto &&v) {
+      using T = std::decay_t<decltype(v)>;
+      if constexpr (std::is_same_v<T, std::nullptr_t>) {
+        sqlite3_bind_null(stmt, i);
+      } else if constexpr (std::is_same_v<T, int64_t>) {
+        sqlite3_bind_int64(stmt, i, v);
+      } else if constexpr (std::is_same_v<T, std::string_view>) {
+        // 执行完立刻reset，不需要让sqlite拷贝一份
+        sqlite3_bind_text(stmt, i, v.data(), v.size(), SQLITE_STATIC);
+      } else if constexpr (std::is_same_v<T, Blob>) {
+        sqlite3_bind_blob(stmt, i, v.data.data(), v.data.size(), SQLITE_STATIC);
+      }
+    }, param);
+    i++;
+  }
+
+  bool ok = true;
+  int rc;
+  if (onRow) callback_thread.store(std::this_thread::get_id(), std::memory_order_relaxed);
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if (onRow) (*onRow)(Row { stmt });
+  }
+  if (onRow) callback_thread.store({}, std::memory_order_relaxed);
+  if (rc != SQLITE_DONE) {
+    spdlog::error("error occured in statement \"{}\": {}", sql, sqlite3_errmsg(db));
+    ok = false;
+  }
+
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return ok;
+}
+
+bool Sqlite3::query(std::string_view sql, std::initializer_list<Param> params,
+                    const RowCallback &onRow) {
+  return run(sql, params, &onRow);
+}
+
+bool Sqlite3::execute(std::string_view sql, std::initializer_list<Param> params) {
+  return run(sql, params, nullptr);
+}
+
+int64_t Sqlite3::lastInsertRowId() {
+  return sqlite3_last_insert_rowid(db);
+}
+
+int64_t Sqlite3::pragmaInt(const char *sql) {
+  int64_t ret = 0;
+  query(sql, {}, [&](const Row &row) { ret = row.getInt(0); });
+  return ret;
+}
+
+int Sqlite3::schemaVersion() {
+  // 没有配置迁移脚本的库没有这张表
+  if (pragmaInt("SELECT COUNT() FROM sqlite_master "
+                "WHERE type='table' AND name='schema_version';") == 0) {
+    return 0;
+  }
+  return pragmaInt("SELECT IFNULL(MAX(version), 0) FROM schema_version;");
+}
+
+void Sqlite3::analyze() {
+  exec("ANALYZE;");
+}
+
+bool Sqlite3::incrementalVacuumEnabled() {
+  // 2 = INCREMENTAL
+  return pragmaInt("PRAGMA auto_vacuum;") == 2;
+}
+
+int64_t Sqlite3::incrementalVacuum(int pages) {
+  if (!incrementalVacuumEnabled()) return -1;
+
+  if (pages > 0) {
+    exec(fmt::format("PRAGMA incremental_vacuum({});", pages));
+  } else {
+    exec("PRAGMA incremental_vacuum;");
+  }
+  return pragmaInt("PRAGMA freelist_count;");
+}
+
+bool Sqlite3::enableIncrementalVacuum() {
+  exec("PRAGMA auto_vacuum=INCREMENTAL;");
+  exec("VACUUM;");
+  return incrementalVacuumEnabled();
+}
+
 std::uint64_t Sqlite3::getMemUsage() {
   return sqlite3_memory_used();
 }
@@ -6,26 +6,97 @@
 // 主要是lua和sqlite
 
 struct sqlite3;
+struct sqlite3_stmt;
 
 class Sqlite3 {
 public:
+  // migrationDir: 里面放 <版本号>_<说明>.sql，按版本号顺序执行没执行过的
   Sqlite3(const char *filename = "./server/users.db",
-          const char *initSql = "./server/init.sql");
+          const char *initSql = "./server/init.sql",
+          const char *migrationDir = nullptr);
   Sqlite3(Sqlite3 &) = delete;
   Sqlite3(Sqlite3 &&) = delete;
   ~Sqlite3();
 
+  // 能不能直接拼进SQL：不含引号、注释符等危险字符，且是合法的UTF-8
   static bool checkString(const std::string_view &str);
 
   typedef std::vector<std::map<std::string, std::string>> QueryResult;
   QueryResult select(const std::string &sql);
   void exec(const std::string &sql);
 
+  // 预编译语句版本：sql里用?占位，同一条sql只prepare一次，之后一直复用
+  // 结果不再拼成map，在回调里按列号直接取类型化的值
+  class Row {
+  public:
+    bool isNull(int col) const;
+    int64_t getInt(int col) const;
+    // 返回的view只在回调期间有效
+    std::string_view getText(int col) const;
+    std::string_view getBlob(int col) const;
+
+  private:
+    friend class Sqlite3;
+    explicit Row(sqlite3_stmt *stmt) : stmt { stmt } {}
+    sqlite3_stmt *stmt;
+  };
+
+  struct Blob { std::string_view data; };
+  using Param = std::variant<std::nullptr_t, int64_t, std::string_view, Blob>;
+  // 回调期间一直持有这个连接的锁，所以回调里不能再用同一个连接（query/execute/select/exec都不行），
+  // 要根据结果再查再写的，先把要用的值存下来，query返回之后再做；误用时报错返回false，不会死锁
+  using RowCallback = std::function<void(const Row &)>;
+
+  bool query(std::string_view sql, std::initializer_list<Param> params,
+             const RowCallback &onRow);
+  bool execute(std::string_view sql, std::initializer_list<Param> params = {});
+
+  int64_t lastInsertRowId();
+
+  // WAL模式下的只读连接池，每个线程固定用池子里的一个连接，读的时候不用等写连接
+  // 连接在第一次用到时才打开；线程比池子大的时候几个线程共用一个
+  // 池子大小为0时直接返回自己
+  Sqlite3 &reader();
+  static void setReaderPoolSize(int n);
+  static int readerPoolSize();
+
+  // 维护用，都会锁住写连接一段时间，读连接不受影响
+  int schemaVersion();
+  void analyze();
+  bool incrementalVacuumEnabled();
+  // pages为0表示全部释放；返回释放后还剩多少空闲页，没开启增量vacuum时返回-1
+  int64_t incrementalVacuum(int pages = 0);
+  // 老库要整个VACUUM一次才能切到增量模式，不能在事务里调用
+  bool enableIncrementalVacuum();
+
   std::uint64_t getMemUsage();
 
 private:
+  struct ReadOnlyTag {};
+  Sqlite3(const std::string &filename, ReadOnlyTag);
+
+  void migrate(const char *dir);
+  int64_t pragmaInt(const char *sql);
+
   sqlite3 *db;
   std::mutex select_lock;
+  // 正在跑RowCallback的线程，用来发现回调里又用了同一个连接
+  std::atomic<std::thread::id> callback_thread;
+  bool reentered(std::string_view sql) const;
+
+  std::string filename;
+  bool readonly = false;
+  uint64_t uid; // 给thread_local的缓存当key，不用地址免得析构后地址被复用
+
+  std::mutex reader_lock;
+  std::vector<std::unique_ptr<Sqlite3>> readers;
+  size_t next_reader = 0;
+  static std::atomic<int> reader_pool_size;
+
+  std::unordered_map<std::string, sqlite3_stmt *> stmt_cache;
+  sqlite3_stmt *prepare(std::string_view sql);
+  bool run(std::string_view sql, std::initializer_list<Param> params,
+           const RowCallback *onRow);
 };
 
 class Cbor {
@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "core/cpu_topology.h"
+
+#include <sched.h>
+
+namespace fs = std::filesystem;
+
+// 解析 "0-3,8,10-11" 这种格式
+static std::vector<int> parseCpuList(const std::string &str) {
+  std::vector<int> ret;
+  std::stringstream ss(str);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty() || !isdigit(range[0])) continue;
+    auto dash = range.find('-');
+    int from = atoi(range.c_str());
+    int to = dash == std::string::npos ? from : atoi(range.c_str() + dash + 1);
+    for (int i = from; i <= to; i++) ret.push_back(i);
+  }
+  return ret;
+}
+
+static std::string readFirstLine(const fs::path &path) {
+  std::ifstream file(path);
+  std::string line;
+  if (file.is_open()) std::getline(file, line);
+  return line;
+}
+
+static int readInt(const fs::path &path, int def) {
+  auto line = readFirstLine(path);
+  return line.empty() ? def : atoi(line.c_str());
+}
+
+std::vector<CpuCore> detectCpuTopology() {
+  const fs::path sys_cpu = "/sys/devices/system/cpu";
+  const fs::path sys_node = "/sys/devices/system/node";
+
+  auto online = parseCpuList(readFirstLine(sys_cpu / "online"));
+  if (online.empty()) {
+    auto n = std::thread::hardware_concurrency();
+    for (unsigned i = 0; i < n; i++) online.push_back(i);
+  }
+
+  std::map<int, int> cpu_node;
+  std::error_code ec;
+  for (auto &entry : fs::directory_iterator(sys_node, ec)) {
+    auto name = entry.path().filename().string();
+    if (name.rfind("node", 0) != 0 || name.size() <= 4 || !isdigit(name[4])) continue;
+    int node = atoi(name.c_str() + 4);
+    for (auto cpu : parseCpuList(readFirstLine(entry.path() / "cpulist"))) {
+      cpu_node[cpu] = node;
+    }
+  }
+
+  // key: (node, package, core_id)
+  std::map<std::tuple<int, int, int>, CpuCore> cores;
+  for (auto cpu : online) {
+    auto topo = sys_cpu / fmt::format("cpu{}", cpu) / "topology";
+    int package = readInt(topo / "physical_package_id", 0);
+    int core_id = readInt(topo / "core_id", cpu);
+    int node = cpu_node.contains(cpu) ? cpu_node[cpu] : 0;
+
+    auto &core = cores[{ node, package, core_id }];
+    core.node = node;
+    core.package = package;
+    core.core_id = core_id;
+    core.cpus.push_back(cpu);
+  }
+
+  std::vector<CpuCore> ret;
+  for (auto &[_, core] : cores) ret.push_back(std::move(core));
+  return ret;
+}
+
+std::string formatCpuList(const std::vector<int> &cpus) {
+  std::string ret;
+  for (auto cpu : cpus) {
+    if (!ret.empty()) ret += ',';
+    ret += std::to_string(cpu);
+  }
+  return ret;
+}
+
+bool setCpuAffinity(pid_t tid, const std::vector<int> &cpus) {
+  if (cpus.empty()) return false;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (auto cpu : cpus) CPU_SET(cpu, &set);
+
+  if (::sched_setaffinity(tid, sizeof(set), &set) != 0) {
+    spdlog::warn("sched_setaffinity({}) failed: {}", formatCpuList(cpus), strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+void CpuPartition::setup(int reservedCores) {
+  std::lock_guard<std::mutex> lock { m_mutex };
+
+  auto cores = detectCpuTopology();
+  m_reserved.clear();
+  m_workers.clear();
+  m_load.clear();
+  m_enabled = false;
+
+  if (reservedCores < 1) reservedCores = 1;
+  if ((int)cores.size() <= reservedCores) {
+    spdlog::warn("Only {} physical core(s) detected, CPU affinity is disabled.", cores.size());
+    return;
+  }
+
+  for (int i = 0; i < (int)cores.size(); i++) {
+    if (i < reservedCores) {
+      m_reserved.insert(m_reserved.end(), cores[i].cpus.begin(), cores[i].cpus.end());
+    } else {
+      m_workers.push_back(cores[i]);
+    }
+  }
+  m_load.assign(m_workers.size(), 0);
+  m_enabled = true;
+
+  spdlog::info("CPU affinity enabled: main thread on [{}], {} core(s) for RoomThreads.",
+               formatCpuList(m_reserved), m_workers.size());
+}
+
+bool CpuPartition::enabled() const {
+  return m_enabled;
+}
+
+const std::vector<int> &CpuPartition::reservedCpus() const {
+  return m_reserved;
+}
+
+int CpuPartition::acquireWorkerCore() {
+  std::lock_guard<std::mutex> lock { m_mutex };
+  if (!m_enabled) return -1;
+
+  auto it = std::min_element(m_load.begin(), m_load.end());
+  (*it)++;
+  return it - m_load.begin();
+}
+
+void CpuPartition::releaseWorkerCore(int idx) {
+  std::lock_guard<std::mutex> lock { m_mutex };
+  if (idx < 0 || idx >= (int)m_load.size()) return;
+  if (m_load[idx] > 0) m_load[idx]--;
+}
+
+std::vector<int> CpuPartition::workerCpus(int idx) const {
+  std::lock_guard<std::mutex> lock { m_mutex };
+  if (idx < 0 || idx >= (int)m_workers.size()) return {};
+  return m_workers[idx].cpus;
+}
@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+// 从sysfs读出来的一个物理核心，cpus是它的所有逻辑CPU（超线程兄弟）
+struct CpuCore {
+  int node = 0;      // NUMA节点
+  int package = 0;
+  int core_id = 0;
+  std::vector<int> cpus;
+};
+
+// 按 NUMA节点 -> package -> core_id 排好序；读不到sysfs时每个逻辑CPU算一个核
+std::vector<CpuCore> detectCpuTopology();
+
+std::string formatCpuList(const std::vector<int> &cpus);
+
+// tid为0表示当前线程
+bool setCpuAffinity(pid_t tid, const std::vector<int> &cpus);
+
+// 把核心分成两部分：前reservedCores个给主线程（网络、shell等），
+// 剩下的分给RoomThread，每个RoomThread和它的Lua子进程绑在同一个核（或超线程对）上
+class CpuPartition {
+public:
+  CpuPartition() = default;
+  CpuPartition(CpuPartition &) = delete;
+  CpuPartition(CpuPartition &&) = delete;
+
+  void setup(int reservedCores);
+  bool enabled() const;
+
+  const std::vector<int> &reservedCpus() const;
+
+  // 挑当前负载最小的工作核心，返回下标；未启用时返回-1
+  int acquireWorkerCore();
+  void releaseWorkerCore(int idx);
+  std::vector<int> workerCpus(int idx) const;
+
+private:
+  bool m_enabled = false;
+  std::vector<int> m_reserved;
+  std::vector<CpuCore> m_workers;
+  std::vector<int> m_load;
+  mutable std::mutex m_mutex;
+};
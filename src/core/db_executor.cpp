@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "core/db_executor.h"
+
+namespace asio = boost::asio;
+
+DbExecutor::DbExecutor(Sqlite3 &db, io_context &completion_ctx) :
+  m_db { db }, m_completion_ctx { completion_ctx },
+  m_ctx {}, m_work { asio::make_work_guard(m_ctx) }
+{
+  m_thread = std::thread([this] { m_ctx.run(); });
+}
+
+DbExecutor::~DbExecutor() {
+  // 已经post的查询和写入都会先跑完
+  m_work.reset();
+  m_thread.join();
+}
+
+DbExecutor::QueryResult DbExecutor::selectSync(const std::string &sql) {
+  if (runningInThisThread()) {
+    return m_db.select(sql);
+  }
+
+  // 没有还没提交的写入时直接用本线程的只读连接，不用排在写入后面
+  // 否则还是得去DB线程排队，保证能读到之前的写入
+  if (m_committed.load(std::memory_order_acquire) ==
+      m_posted.load(std::memory_order_acquire)) {
+    return m_db.reader().select(sql);
+  }
+
+  auto f = asio::post(m_ctx, asio::use_future([&] { return m_db.select(sql); }));
+  return f.get();
+}
+
+void DbExecutor::exec(std::string sql) {
+  post([sql = std::move(sql)](Sqlite3 &db) { db.exec(sql); });
+}
+
+void DbExecutor::post(std::function<void(Sqlite3 &)> job) {
+  std::lock_guard<std::mutex> lock { m_pending_mutex };
+  m_pending.push_back(std::move(job));
+  m_posted.fetch_add(1, std::memory_order_release);
+  if (m_flush_scheduled) return;
+
+  m_flush_scheduled = true;
+  asio::post(m_ctx, [this] { flush(); });
+}
+
+void DbExecutor::flushSync() {
+  if (runningInThisThread()) {
+    flush();
+    return;
+  }
+
+  asio::post(m_ctx, asio::use_future([this] { flush(); })).wait();
+}
+
+void DbExecutor::flush() {
+  std::vector<std::function<void(Sqlite3 &)>> batch;
+  {
+    std::lock_guard<std::mutex> lock { m_pending_mutex };
+    batch.swap(m_pending);
+    m_flush_scheduled = false;
+  }
+
+  if (batch.empty()) return;
+  if (batch.size() == 1) {
+    batch[0](m_db);
+  } else {
+    // 一批写入放进一个事务，省掉每条语句一次fsync
+    m_db.exec("BEGIN;");
+    for (auto &job : batch) {
+      job(m_db);
+    }
+    m_db.exec("COMMIT;");
+  }
+
+  m_committed.fetch_add(batch.size(), std::memory_order_release);
+}
+
+bool DbExecutor::runningInThisThread() const {
+  return m_thread.get_id() == std::this_thread::get_id();
+}
+
+Sqlite3 &DbExecutor::database() {
+  return m_db;
+}
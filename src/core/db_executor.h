@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include "core/c-wrapper.h"
+
+// 数据库专用线程，所有读写都在这个线程上进行，主线程和RoomThread不再直接碰磁盘
+// - select: 异步查询，支持回调和use_awaitable；回调默认回到主线程执行
+// - selectSync: 给RPC处理函数这种没法异步的地方用，阻塞调用者；
+//   没有待提交的写入时走调用线程自己的WAL只读连接，不经过DB线程
+// - readSync: 同上，但跑的是一段用预编译语句的只读逻辑
+// - exec/post: 写入不等结果，攒一批在同一个事务里提交
+// - run: 在DB线程上跑一段用预编译语句的逻辑，把它的返回值交回来
+// 同一线程先exec后select，select一定能看到之前的写入
+class DbExecutor {
+public:
+  using io_context = boost::asio::io_context;
+  using QueryResult = Sqlite3::QueryResult;
+
+  DbExecutor(Sqlite3 &db, io_context &completion_ctx);
+  DbExecutor(DbExecutor &) = delete;
+  DbExecutor(DbExecutor &&) = delete;
+  ~DbExecutor();
+
+  template <typename CompletionToken>
+  auto select(std::string sql, CompletionToken &&token) {
+    namespace asio = boost::asio;
+    return asio::async_initiate<CompletionToken, void(QueryResult)>(
+      [this](auto handler, std::string sql) {
+        auto ex = asio::get_associated_executor(handler, m_completion_ctx.get_executor());
+        asio::post(m_ctx, [this, sql = std::move(sql), handler = std::move(handler), ex]() mutable {
+          auto result = m_db.select(sql);
+          asio::dispatch(ex, [handler = std::move(handler), result = std::move(result)]() mutable {
+            std::move(handler)(std::move(result));
+          });
+        });
+      }, token, std::move(sql));
+  }
+
+  // f的签名为 R(Sqlite3 &)，handler签名为 void(R)
+  template <typename F, typename CompletionToken>
+  auto run(F &&f, CompletionToken &&token) {
+    namespace asio = boost::asio;
+    using R = std::invoke_result_t<F &, Sqlite3 &>;
+    return asio::async_initiate<CompletionToken, void(R)>(
+      [this](auto handler, auto f) {
+        auto ex = asio::get_associated_executor(handler, m_completion_ctx.get_executor());
+        asio::post(m_ctx, [this, f = std::move(f), handler = std::move(handler), ex]() mutable {
+          auto result = f(m_db);
+          asio::dispatch(ex, [handler = std::move(handler), result = std::move(result)]() mutable {
+            std::move(handler)(std::move(result));
+          });
+        });
+      }, token, std::forward<F>(f));
+  }
+
+  QueryResult selectSync(const std::string &sql);
+
+  // 预编译语句版的selectSync，f的签名为 R(Sqlite3 &)，只能读
+  template <typename F>
+  auto readSync(F &&f) {
+    namespace asio = boost::asio;
+    if (runningInThisThread()) return f(m_db);
+    if (m_committed.load(std::memory_order_acquire) ==
+        m_posted.load(std::memory_order_acquire)) {
+      return f(m_db.reader());
+    }
+    return asio::post(m_ctx, asio::use_future([&] { return f(m_db); })).get();
+  }
+
+  void exec(std::string sql);
+  void post(std::function<void(Sqlite3 &)> job);
+
+  // 等待目前为止提交的所有写入落盘
+  void flushSync();
+
+  bool runningInThisThread() const;
+  Sqlite3 &database();
+
+private:
+  Sqlite3 &m_db;
+  io_context &m_completion_ctx;
+
+  io_context m_ctx;
+  boost::asio::executor_work_guard<io_context::executor_type> m_work;
+  std::thread m_thread;
+
+  std::mutex m_pending_mutex;
+  std::vector<std::function<void(Sqlite3 &)>> m_pending;
+  bool m_flush_scheduled = false;
+  std::atomic<uint64_t> m_posted = 0;
+  std::atomic<uint64_t> m_committed = 0;
+
+  void flush();
+};
@@ -0,0 +1,325 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "core/file_hash_cache.h"
+#include "core/packman.h"
+#include "core/util.h"
+#include <openssl/md5.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+namespace asio = boost::asio;
+
+static constexpr const char *cachePath = "server/md5cache";
+static constexpr const char *packagesDir = "packages";
+
+// 和原来分三遍的顺序一致：先全部lua，再qml，最后js
+static constexpr std::string_view extensions[] = { ".lua", ".qml", ".js" };
+
+static const std::set<std::string> builtinPkgs = {
+  "standard", "standard_cards", "maneuvering", "test"
+};
+
+// Read file content, normalize \r\n → \n, compute MD5
+static std::string computeFileMD5(const std::string &fname) {
+  std::ifstream file(fname, std::ios::binary);
+  if (!file.is_open()) {
+    return std::string(32, '0'); // Return 32-char zero hash if fail
+  }
+
+  std::string data { std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+
+  // Normalize line endings: \r\n → \n
+  std::string normalized;
+  normalized.reserve(data.size());
+  for (size_t i = 0; i < data.size(); ++i) {
+    if (data[i] == '\r' && i + 1 < data.size() && data[i+1] == '\n') {
+      continue; // skip \r, keep \n
+    }
+    normalized.push_back(data[i]);
+  }
+
+  unsigned char digest[MD5_DIGEST_LENGTH];
+  MD5(reinterpret_cast<const unsigned char*>(normalized.data()), normalized.size(), digest);
+
+  return toHex({ (char*)digest, MD5_DIGEST_LENGTH });
+}
+
+FileHashCache &FileHashCache::instance() {
+  static FileHashCache cache;
+  return cache;
+}
+
+FileHashCache::FileHashCache() {
+  loadCache();
+
+#ifdef __linux__
+  m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (m_inotify_fd < 0) {
+    spdlog::warn("inotify unavailable, packages will be rescanned on every md5 refresh");
+  } else {
+    watchDir(packagesDir);
+  }
+#endif
+}
+
+FileHashCache::~FileHashCache() {
+#ifdef __linux__
+  if (m_inotify_fd >= 0) close(m_inotify_fd);
+#endif
+}
+
+const FileHashCache::Stats &FileHashCache::lastStats() const {
+  return m_stats;
+}
+
+const std::vector<LuaSource> &FileHashCache::luaFiles() const {
+  return m_lua_files;
+}
+
+// 每行：size \t mtime \t md5 \t path
+void FileHashCache::loadCache() {
+  std::ifstream file(cachePath);
+  if (!file.is_open()) return;
+
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream ss(line);
+    FileInfo info;
+    std::string path;
+    if (ss >> info.size >> info.mtime >> info.md5 && ss.get() == '\t' &&
+        std::getline(ss, path) && info.md5.size() == 32) {
+      m_hashes[path] = std::move(info);
+    }
+  }
+}
+
+void FileHashCache::saveCache() {
+  if (!fs::is_directory("server")) return;
+
+  // 先写临时文件再换过去，写一半崩了也不会留下坏的缓存
+  auto tmp = std::string(cachePath) + ".tmp";
+  {
+    std::ofstream file(tmp, std::ios::out | std::ios::trunc);
+    if (!file.is_open()) return;
+    for (auto &[path, info] : m_hashes) {
+      file << info.size << '\t' << info.mtime << '\t' << info.md5 << '\t' << path << '\n';
+    }
+  }
+  std::error_code ec;
+  fs::rename(tmp, cachePath, ec);
+  if (!ec) m_hashes_changed = false;
+}
+
+void FileHashCache::watchDir(const std::string &dir) {
+#ifdef __linux__
+  if (m_inotify_fd < 0) return;
+
+  constexpr uint32_t mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE |
+    IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+  int wd = inotify_add_watch(m_inotify_fd, dir.c_str(), mask);
+  if (wd < 0) {
+    // 多半是max_user_watches不够，那就退回每次都遍历
+    spdlog::warn("inotify_add_watch({}) failed: {}; falling back to full rescans",
+                 dir, strerror(errno));
+    close(m_inotify_fd);
+    m_inotify_fd = -1;
+    m_watches.clear();
+    m_all_dirty = true;
+    return;
+  }
+  m_watches[wd] = dir;
+#endif
+}
+
+void FileHashCache::drainEvents() {
+#ifdef __linux__
+  if (m_inotify_fd < 0) return;
+
+  alignas(inotify_event) char buf[16384];
+  for (;;) {
+    auto n = read(m_inotify_fd, buf, sizeof(buf));
+    if (n <= 0) break;
+
+    for (char *ptr = buf; ptr < buf + n;) {
+      auto ev = reinterpret_cast<inotify_event *>(ptr);
+      ptr += sizeof(inotify_event) + ev->len;
+
+      if (ev->mask & IN_Q_OVERFLOW) {
+        m_all_dirty = true;
+        continue;
+      }
+
+      auto it = m_watches.find(ev->wd);
+      if (it == m_watches.end()) continue;
+      auto dir = it->second;
+      if (ev->mask & IN_IGNORED) m_watches.erase(it);
+
+      // 找出是哪个包动了：packages/下的直接子项就是包本身
+      if (dir == packagesDir) {
+        if (ev->len > 0) m_dirty_packs.insert(ev->name);
+      } else {
+        auto rel = fs::path(dir).lexically_relative(packagesDir);
+        if (!rel.empty()) m_dirty_packs.insert(rel.begin()->string());
+      }
+    }
+  }
+#endif
+}
+
+void FileHashCache::walkDir(const fs::path &dir, Listing &listing, HashJobs &jobs) {
+  watchDir(dir.string());
+
+  // Sort by filename (lexicographical, like Qt QDir::Name)
+  std::vector<fs::directory_entry> entries;
+  std::error_code ec;
+  for (const auto &entry : fs::directory_iterator(dir, ec)) {
+    entries.push_back(entry);
+  }
+  std::sort(entries.begin(), entries.end(), [](const fs::directory_entry &a, const fs::directory_entry &b) {
+    return a.path().filename() < b.path().filename();
+  });
+
+  for (const auto &entry : entries) {
+    if (entry.is_directory(ec)) {
+      walkDir(entry.path(), listing, jobs);
+      continue;
+    }
+    if (!entry.is_regular_file(ec)) continue;
+
+    auto filename = entry.path().filename().string();
+    int ext = std::find_if(std::begin(extensions), std::end(extensions),
+                           [&](auto e) { return filename.ends_with(e); }) - std::begin(extensions);
+    if (ext == (int)std::size(extensions)) continue;
+
+    auto path = entry.path().string();
+    listing.files.emplace_back(path, ext);
+
+    FileInfo info {
+      entry.file_size(ec),
+      (int64_t)entry.last_write_time(ec).time_since_epoch().count(),
+      {},
+    };
+    auto it = m_hashes.find(path);
+    if (it == m_hashes.end() || it->second.size != info.size || it->second.mtime != info.mtime) {
+      jobs.emplace_back(path, std::move(info));
+    }
+  }
+}
+
+void FileHashCache::walk(const std::string &pack, HashJobs &jobs) {
+  auto &listing = m_listings[pack];
+  listing.files.clear();
+  walkDir(fs::path(packagesDir) / pack, listing, jobs);
+  m_stats.walked++;
+
+  // 这个包里已经没有了的文件从缓存里清掉
+  std::set<std::string_view> seen;
+  for (auto &[path, _] : listing.files) seen.insert(path);
+  auto prefix = (fs::path(packagesDir) / pack).string() + '/';
+  for (auto it = m_hashes.lower_bound(prefix); it != m_hashes.end() && it->first.starts_with(prefix);) {
+    if (!seen.contains(it->first)) {
+      it = m_hashes.erase(it);
+      m_hashes_changed = true;
+    } else {
+      ++it;
+    }
+  }
+}
+
+void FileHashCache::hashFiles(HashJobs &jobs) {
+  if (jobs.empty()) return;
+
+  auto hash = [&jobs](size_t i) { jobs[i].second.md5 = computeFileMD5(jobs[i].first); };
+  if (jobs.size() < 8) {
+    for (size_t i = 0; i < jobs.size(); i++) hash(i);
+  } else {
+    auto n = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 16);
+    asio::thread_pool pool(std::min(n, jobs.size() / 4));
+    for (size_t i = 0; i < jobs.size(); i++) {
+      asio::post(pool, [&hash, i] { hash(i); });
+    }
+    pool.join();
+  }
+
+  for (auto &[path, info] : jobs) {
+    m_hashes[path] = std::move(info);
+  }
+  m_hashes_changed = true;
+}
+
+std::string FileHashCache::flist() {
+  m_stats = {};
+  drainEvents();
+
+  std::vector<std::string> packs;
+  std::error_code ec;
+  if (fs::is_directory(packagesDir, ec)) {
+    for (const auto &entry : fs::directory_iterator(packagesDir, ec)) {
+      if (entry.is_directory(ec)) packs.push_back(entry.path().filename().string());
+    }
+  }
+  std::sort(packs.begin(), packs.end());
+
+  // 已经删掉了的包
+  for (auto it = m_listings.begin(); it != m_listings.end();) {
+    if (!std::binary_search(packs.begin(), packs.end(), it->first)) {
+      it = m_listings.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  // Skip .disabled directories and disabled packs
+  auto &disabled = PackMan::instance().getDisabledPacks();
+  std::erase_if(packs, [&](const std::string &name) {
+    return name.ends_with(".disabled") ||
+      std::find(disabled.begin(), disabled.end(), name) != disabled.end();
+  });
+  // 内置包不进flist，但Lua那边照样要加载，字节码也得有
+  auto listed = packs;
+  std::erase_if(listed, [](const std::string &name) { return builtinPkgs.contains(name); });
+
+  HashJobs jobs;
+  for (auto &pack : packs) {
+    if (m_all_dirty || m_dirty_packs.contains(pack) || !m_listings.contains(pack)) {
+      walk(pack, jobs);
+      m_dirty_packs.erase(pack);
+    }
+  }
+  m_all_dirty = m_inotify_fd < 0;
+  m_stats.hashed = jobs.size();
+  hashFiles(jobs);
+
+  std::string ret;
+  for (int ext = 0; ext < (int)std::size(extensions); ext++) {
+    for (auto &pack : listed) {
+      for (auto &[path, e] : m_listings[pack].files) {
+        if (e != ext) continue;
+        ret += path;
+        ret += '=';
+        ret += m_hashes[path].md5;
+        ret += ';';
+      }
+    }
+  }
+
+  m_lua_files.clear();
+  for (auto &pack : packs) {
+    for (auto &[path, e] : m_listings[pack].files) {
+      if (e != 0) continue;
+      auto &info = m_hashes[path];
+      m_lua_files.push_back({ path, info.md5, info.size, info.mtime });
+    }
+  }
+
+  m_stats.files = 0;
+  for (auto &pack : listed) m_stats.files += m_listings[pack].files.size();
+  m_stats.inotify = m_inotify_fd >= 0;
+
+  if (m_hashes_changed) saveCache();
+  return ret;
+}
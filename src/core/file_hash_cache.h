@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include "core/lua_bytecode.h"
+
+// 生成flist.txt内容用的文件MD5缓存
+// - 每个文件的MD5按(路径, 大小, mtime)缓存，存在server/md5cache里，重启后也不用全部重算
+// - packages/下每个包只遍历一次，.lua/.qml/.js一起收集；输出顺序和原来按扩展名分三遍的一样
+// - 要重算的文件丢给线程池并行算
+// - Linux下用inotify盯着packages/，没动过的包连目录都不用再遍历
+// 不加锁：启动时在主线程用，之后只在shell线程经Server::refreshMd5用，那里串行化
+class FileHashCache {
+public:
+  static FileHashCache &instance();
+  ~FileHashCache();
+
+  FileHashCache(FileHashCache &) = delete;
+  FileHashCache(FileHashCache &&) = delete;
+
+  // 即 "path=md5;" 拼起来，已经跳过了禁用的包和内置包（内置包还是会遍历，见luaFiles）
+  std::string flist();
+
+  struct Stats {
+    size_t files = 0;     // 本次输出的文件数
+    size_t hashed = 0;    // 本次真正读盘算了MD5的文件数
+    size_t walked = 0;    // 本次重新遍历的包数
+    bool inotify = false;
+  };
+  const Stats &lastStats() const;
+  // 上次flist()遍历到的.lua文件及其MD5、大小和mtime，预编译字节码用；内置包的也在里面
+  const std::vector<LuaSource> &luaFiles() const;
+
+private:
+  FileHashCache();
+
+  struct FileInfo {
+    uintmax_t size;
+    int64_t mtime;
+    std::string md5;
+  };
+  // 有序，方便按包名前缀清理
+  std::map<std::string, FileInfo> m_hashes;
+  bool m_hashes_changed = false;
+
+  // 包名 -> 上次遍历出的文件（已排好序），以及各自是哪种扩展名
+  struct Listing {
+    std::vector<std::pair<std::string, int>> files;
+  };
+  std::map<std::string, Listing> m_listings;
+  std::set<std::string> m_dirty_packs;
+  bool m_all_dirty = true;
+
+  int m_inotify_fd = -1;
+  std::unordered_map<int, std::string> m_watches;   // wd -> 目录
+
+  Stats m_stats;
+  std::vector<LuaSource> m_lua_files;
+
+  void loadCache();
+  void saveCache();
+
+  void watchDir(const std::string &dir);
+  void drainEvents();
+
+  using HashJobs = std::vector<std::pair<std::string, FileInfo>>;
+  void walk(const std::string &pack, HashJobs &jobs);
+  void walkDir(const std::filesystem::path &dir, Listing &listing, HashJobs &jobs);
+  void hashFiles(HashJobs &jobs);
+};
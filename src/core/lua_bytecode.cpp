@@ -0,0 +1,237 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "core/lua_bytecode.h"
+#include "core/util.h"
+#include <openssl/md5.h>
+
+namespace fs = std::filesystem;
+
+static constexpr const char *cacheDir = "server/luacache";
+static constexpr const char *indexName = "index.lua";
+static constexpr const char *loaderName = "loader.lua";
+
+// 从stdin逐行读 "源文件\t目标文件"；先写临时文件再改名，编一半被打断也不会留下坏的
+static constexpr const char *compilerScript =
+  "for line in io.lines() do "
+    "local src, dst = line:match(\"^(.-)\\t(.*)$\") "
+    "local fn = src and loadfile(src) "
+    "if fn then "
+      "local out = io.open(dst .. \".tmp\", \"wb\") "
+      "if out then "
+        "out:write(string.dump(fn)) "
+        "out:close() "
+        "os.rename(dst .. \".tmp\", dst) "
+      "end "
+    "end "
+  "end";
+
+// Lua子进程启动时经LUA_INIT_5_4先跑这个，换掉loadfile、dofile，再给require加一个searcher
+// index里是绝对路径，相对路径按子进程的工作目录（FK_LUA_CWD）来补全
+// 起子进程前luaBytecodeDir已经按大小和mtime核对过；子进程跑起来之后才改的文件，这里再比一次大小
+static constexpr const char *loaderScript = R"lua(-- generated by freekill-asio, do not edit
+local dir, cwd = os.getenv("FK_LUA_BYTECODE"), os.getenv("FK_LUA_CWD")
+if not dir or not cwd then return end
+local ok, index = pcall(dofile, dir .. "/index.lua")
+if not ok or type(index) ~= "table" then return end
+
+local function normalize(path)
+  if path:sub(1, 1) ~= "/" then path = cwd .. "/" .. path end
+  local parts = {}
+  for part in path:gmatch("[^/]+") do
+    if part == ".." then
+      parts[#parts] = nil
+    elseif part ~= "." then
+      parts[#parts + 1] = part
+    end
+  end
+  return "/" .. table.concat(parts, "/")
+end
+
+local function lookup(filename)
+  local entry = index[normalize(filename)]
+  if not entry then return nil end
+  local f = io.open(filename, "rb")
+  if not f then return nil end
+  local size = f:seek("end")
+  f:close()
+  if size ~= entry[2] then return nil end
+  return dir .. "/" .. entry[1]
+end
+
+local rawLoadfile, rawDofile = loadfile, dofile
+
+-- env要原样转发：显式传nil和不传在loadfile里不是一回事
+loadfile = function(filename, mode, ...)
+  if filename and (mode == nil or mode:find("b", 1, true)) then
+    local bc = lookup(filename)
+    local fn = bc and rawLoadfile(bc, "b", ...)
+    if fn then return fn end
+  end
+  return rawLoadfile(filename, mode, ...)
+end
+
+dofile = function(filename)
+  if filename == nil then return rawDofile() end
+  local fn = assert(loadfile(filename))
+  return fn()
+end
+
+table.insert(package.searchers, 2, function(name)
+  local filename = package.searchpath(name, package.path)
+  local bc = filename and lookup(filename)
+  local fn = bc and rawLoadfile(bc, "b")
+  if fn then return fn, filename end
+end)
+)lua";
+
+// 内容没变就不动，变了的话先写临时文件再换过去
+static void writeFile(const fs::path &path, const std::string &content) {
+  std::string old;
+  if (std::ifstream f { path }; f) {
+    old.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+  }
+  if (old == content) return;
+
+  std::error_code ec;
+  auto tmp = path.string() + ".tmp";
+  {
+    std::ofstream f(tmp, std::ios::out | std::ios::trunc);
+    f << content;
+  }
+  fs::rename(tmp, path, ec);
+}
+
+struct IndexEntry {
+  std::string path;   // 绝对路径
+  std::string key;
+  uintmax_t size;
+  int64_t mtime;
+};
+
+// 最近一次写出的index；更新缓存和起Lua子进程不一定在同一个线程
+static std::mutex indexMutex;
+static std::vector<IndexEntry> indexEntries;
+static bool indexReady = false;
+
+static std::string cacheKey(const std::string &path, const std::string &md5) {
+  auto str = path + '=' + md5;
+  unsigned char digest[MD5_DIGEST_LENGTH];
+  MD5((const unsigned char *)str.data(), str.size(), digest);
+  return toHex({ (char *)digest, MD5_DIGEST_LENGTH }) + ".luac";
+}
+
+static std::string luaQuote(const std::string &str) {
+  std::string ret = "\"";
+  for (char c : str) {
+    if (c == '"' || c == '\\') ret += '\\';
+    if (c == '\n') {
+      ret += "\\n";
+      continue;
+    }
+    ret += c;
+  }
+  return ret + '"';
+}
+
+// 绝对路径 -> { 字节码文件名, 源文件大小, mtime }
+static std::string formatIndex(const std::vector<IndexEntry> &entries) {
+  std::string index = "return {\n";
+  for (auto &[path, key, size, mtime] : entries) {
+    index += fmt::format("  [{}] = {{ \"{}\", {}, {} }},\n", luaQuote(path), key, size, mtime);
+  }
+  index += "}\n";
+  return index;
+}
+
+// 一个lua5.4进程编完所有文件；lua5.4本来就是必需的，不另外依赖luac
+static void compile(const std::vector<std::pair<std::string, std::string>> &jobs) {
+  auto cmd = fmt::format("lua5.4 -e '{}'", compilerScript);
+  FILE *pipe = popen(cmd.c_str(), "w");
+  if (!pipe) {
+    spdlog::warn("Cannot run lua5.4 to compile Lua bytecode: {}", strerror(errno));
+    return;
+  }
+  for (auto &[src, dst] : jobs) {
+    fmt::print(pipe, "{}\t{}\n", src, dst);
+  }
+  pclose(pipe);
+}
+
+void updateLuaBytecode(const std::vector<LuaSource> &files) {
+  if (!fs::is_directory("server")) return;
+
+  std::error_code ec;
+  fs::create_directories(cacheDir, ec);
+  if (ec) {
+    spdlog::warn("Cannot create {}: {}", cacheDir, ec.message());
+    return;
+  }
+
+  std::set<std::string> existing;
+  for (const auto &entry : fs::directory_iterator(cacheDir, ec)) {
+    auto name = entry.path().filename().string();
+    if (name.ends_with(".luac")) existing.insert(name);
+  }
+
+  // 大小和mtime用FileHashCache算md5时记下的，和md5对得上
+  std::vector<IndexEntry> entries;
+  std::vector<std::pair<std::string, std::string>> jobs;
+  for (auto &[path, md5, size, mtime] : files) {
+    // 路径里有换行的话一行一个的协议就乱了，这种文件不管
+    if (path.find('\n') != std::string::npos) continue;
+    auto key = cacheKey(path, md5);
+    if (!existing.contains(key)) jobs.emplace_back(path, fmt::format("{}/{}", cacheDir, key));
+    entries.push_back({ fs::absolute(path, ec).lexically_normal().string(), std::move(key), size, mtime });
+  }
+
+  if (!jobs.empty()) {
+    compile(jobs);
+    for (auto &[_, dst] : jobs) {
+      if (fs::exists(dst, ec)) existing.insert(fs::path(dst).filename().string());
+    }
+  }
+
+  size_t total = entries.size();
+  std::erase_if(entries, [&](const IndexEntry &e) { return !existing.contains(e.key); });
+  std::set<std::string> used;
+  for (auto &e : entries) used.insert(e.key);
+  size_t compiled = entries.size();
+
+  {
+    std::lock_guard<std::mutex> lock { indexMutex };
+    // loader先写，子进程看到index的时候loader一定已经在了
+    writeFile(fs::path(cacheDir) / loaderName, loaderScript);
+    writeFile(fs::path(cacheDir) / indexName, formatIndex(entries));
+    indexEntries = std::move(entries);
+    indexReady = true;
+  }
+
+  // 已经没人用的字节码
+  for (auto &name : existing) {
+    if (!used.contains(name)) fs::remove(fs::path(cacheDir) / name, ec);
+  }
+
+  spdlog::debug("Lua bytecode: {}/{} file(s) cached, {} compiled this time",
+                compiled, total, jobs.size());
+}
+
+std::string luaBytecodeDir() {
+  std::lock_guard<std::mutex> lock { indexMutex };
+  std::error_code ec;
+  // loader没了的话LUA_INIT会让子进程直接起不来
+  if (!indexReady || !fs::exists(fs::path(cacheDir) / loaderName, ec)) return {};
+
+  // 刷新md5之后又改过的源文件字节码已经过时，剔掉之后子进程就读源码
+  auto stale = std::erase_if(indexEntries, [&](const IndexEntry &e) {
+    auto size = fs::file_size(e.path, ec);
+    if (ec) return true;
+    auto mtime = fs::last_write_time(e.path, ec);
+    return ec || size != e.size || (int64_t)mtime.time_since_epoch().count() != e.mtime;
+  });
+  if (stale > 0) {
+    spdlog::debug("Lua bytecode: {} source file(s) changed since last refresh", stale);
+    writeFile(fs::path(cacheDir) / indexName, formatIndex(indexEntries));
+  }
+
+  return fs::absolute(cacheDir, ec).string();
+}
@@ -0,0 +1,22 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+// 包里的Lua预编译成字节码，Lua子进程启动时直接load字节码，省掉词法和语法分析
+// - 在calcFileMD5里顺带更新，只编译内容或路径变了的文件；内置包也算
+// - 缓存在server/luacache/下，文件名取MD5("路径=内容MD5")；index.lua返回 绝对路径 -> {文件名, 源文件大小} 的表
+// - 同目录下的loader.lua由RpcLua经LUA_INIT_5_4装进子进程，loadfile、dofile、require都先查index
+// - 每次起子进程前按(大小, mtime)核对一遍源文件，对不上的从index里去掉；子进程里再核对一次大小
+// - 借lua5.4的string.dump来编译，和不带-s的luac一样保留调试信息，报错照样有行号
+// - 编译失败（比如语法错误）的不进索引，子进程那边照常读源码，报错也和原来一样
+struct LuaSource {
+  std::string path;
+  std::string md5;
+  uintmax_t size;
+  int64_t mtime;    // 和FileHashCache一样，取last_write_time的原始计数
+};
+void updateLuaBytecode(const std::vector<LuaSource> &files);
+
+// 缓存目录的绝对路径，通过FK_LUA_BYTECODE传给Lua子进程；本次启动还没更新过缓存时为空
+// 顺带核对index里的源文件，改过的先剔除再返回；可以在任意线程调用
+std::string luaBytecodeDir();
@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+// 多生产者单消费者队列，环形缓冲区部分是无锁的（Vyukov的有界队列）
+// 环满了之后退化到带锁的溢出队列，直到消费者把溢出部分吃完为止
+// 溢出期间所有生产者都写溢出队列，所以同一个生产者的元素不会乱序
+template <typename T, size_t N>
+class MpscQueue {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "N must be power of 2");
+
+public:
+  MpscQueue() {
+    m_cells = std::make_unique<Cell[]>(N);
+    for (size_t i = 0; i < N; i++) {
+      m_cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+  MpscQueue(MpscQueue &) = delete;
+  MpscQueue(MpscQueue &&) = delete;
+
+  // 任意线程
+  void push(T &&value) {
+    if (!m_overflow_active.load(std::memory_order_acquire) && tryPush(value)) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock { m_overflow_mutex };
+    m_overflow.push_back(std::move(value));
+    m_overflow_active.store(true, std::memory_order_release);
+  }
+
+  // 只能由消费者线程调用
+  bool pop(T &out) {
+    auto &cell = m_cells[m_dequeue_pos & (N - 1)];
+    auto seq = cell.seq.load(std::memory_order_acquire);
+    if (seq == m_dequeue_pos + 1) {
+      out = std::move(cell.data);
+      cell.seq.store(m_dequeue_pos + N, std::memory_order_release);
+      m_dequeue_pos++;
+      return true;
+    }
+
+    if (!m_overflow_active.load(std::memory_order_acquire)) return false;
+
+    std::lock_guard<std::mutex> lock { m_overflow_mutex };
+    if (m_overflow.empty()) {
+      m_overflow_active.store(false, std::memory_order_release);
+      return false;
+    }
+    out = std::move(m_overflow.front());
+    m_overflow.pop_front();
+    if (m_overflow.empty()) {
+      m_overflow_active.store(false, std::memory_order_release);
+    }
+    return true;
+  }
+
+private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    T data;
+  };
+
+  bool tryPush(T &value) {
+    auto pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    Cell *cell;
+    for (;;) {
+      cell = &m_cells[pos & (N - 1)];
+      auto seq = cell->seq.load(std::memory_order_acquire);
+      auto diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false; // 满了
+      } else {
+        pos = m_enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+
+    cell->data = std::move(value);
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  std::unique_ptr<Cell[]> m_cells;
+  alignas(64) std::atomic<size_t> m_enqueue_pos { 0 };
+  alignas(64) size_t m_dequeue_pos = 0;
+
+  std::atomic<bool> m_overflow_active { false };
+  std::mutex m_overflow_mutex;
+  std::deque<T> m_overflow;
+};
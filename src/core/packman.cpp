@@ -6,8 +6,39 @@
 #include "core/packman.h"
 #include "core/c-wrapper.h"
 
+namespace asio = boost::asio;
+using namespace std::chrono_literals;
+
 static std::unique_ptr<PackMan> pacman_instance = nullptr;
 
+// 同时clone/fetch几个仓库，主要是等网络，不必按CPU核数来
+static constexpr size_t maxParallelJobs = 6;
+
+struct PackMan::Job {
+  std::string name;
+  std::string url;      // 只有下载新包时用
+  std::string old_head;
+  int err = 0;
+  bool done = false;    // 由runJobs里的锁保护
+  Progress progress;
+};
+
+static std::string trimUrl(const char *u) {
+  auto url = std::string { u };
+  while (!url.empty() && url.back() == '/') {
+    url.pop_back();
+  }
+  return url;
+}
+
+static std::string packNameFromUrl(const std::string &url) {
+  auto fileName = url.substr(url.find_last_of('/') + 1);
+  if (fileName.size() > 4 && fileName.substr(fileName.size() - 4) == ".git") {
+    fileName = fileName.substr(0, fileName.size() - 4);
+  }
+  return fileName;
+}
+
 PackMan &PackMan::instance() {
   if (!pacman_instance) {
     pacman_instance = std::unique_ptr<PackMan>(new PackMan);
@@ -52,7 +83,7 @@ const std::string &PackMan::summary() const {
   return m_summary;
 }
 
-void PackMan::refreshSummary() {
+std::string PackMan::buildSummary() {
   auto data = db->select("SELECT name, url, hash FROM packages WHERE enabled = 1;");
   u_char buf[10]; size_t buflen;
 
@@ -89,7 +120,11 @@ void PackMan::refreshSummary() {
     ret += url;
   }
 
-  m_summary = ret;
+  return ret;
+}
+
+void PackMan::setSummary(std::string summary) {
+  m_summary = std::move(summary);
 }
 
 
@@ -135,31 +170,53 @@ void PackMan::loadSummary(const QString &jsonData, bool useThread) {
 */
 
 int PackMan::downloadNewPack(const char *u) {
+  return downloadNewPacks({ u }) == 1 ? 0 : -1;
+}
+
+int PackMan::downloadNewPacks(const std::vector<std::string> &urls) {
   static constexpr const char *sql_select = "SELECT name FROM packages \
     WHERE name = '{}';";
   static constexpr const char *sql_update = "INSERT INTO packages (name,url,hash,enabled) \
     VALUES ('{}','{}','{}',1);";
 
-  int err = clone(u);
-  if (err < 0)
-    return err;
-
-  auto url = std::string { u };
-  while (!url.empty() && url.back() == '/') {
-    url.pop_back();
+  // 同名的只下一次，不然几个线程会往同一个目录里clone
+  std::vector<std::pair<std::string, std::string>> todo;
+  std::set<std::string> names;
+  for (auto &u : urls) {
+    auto url = trimUrl(u.c_str());
+    auto name = packNameFromUrl(url);
+    if (names.insert(name).second) {
+      todo.emplace_back(std::move(name), std::move(url));
+    } else {
+      spdlog::warn("Skipping {}: package '{}' is already in this batch.", url, name);
+    }
   }
 
-  auto fileName = url.substr(url.find_last_of('/') + 1);
-  if (fileName.size() > 4 && fileName.substr(fileName.size() - 4) == ".git") {
-    fileName = fileName.substr(0, fileName.size() - 4);
+  std::vector<Job> jobs(todo.size());
+  for (size_t i = 0; i < todo.size(); i++) {
+    std::tie(jobs[i].name, jobs[i].url) = std::move(todo[i]);
   }
 
-  auto result = db->select(fmt::format(sql_select, fileName));
-  if (result.empty()) {
-    db->exec(fmt::format(sql_update, fileName, url, head(fileName.c_str())));
+  runJobs(jobs, [this](Job &job) {
+    return clone(job.url.c_str(), &job.progress);
+  });
+
+  int ok = 0;
+  db->exec("BEGIN;");
+  for (auto &job : jobs) {
+    if (job.err < 0) continue;
+    ok++;
+    auto result = db->select(fmt::format(sql_select, job.name));
+    if (result.empty()) {
+      db->exec(fmt::format(sql_update, job.name, job.url, head(job.name.c_str())));
+    }
   }
+  db->exec("COMMIT;");
 
-  return err;
+  if (jobs.size() > 1) {
+    spdlog::info("Installed {} package(s), {} failed.", ok, jobs.size() - ok);
+  }
+  return ok;
 }
 
 void PackMan::enablePack(const char *pack) {
@@ -202,24 +259,53 @@ int PackMan::updatePack(const char *pack, const char *hash) {
 }
 
 int PackMan::upgradePack(const char *pack) {
-  int err;
-  // 先status 检查dirty 后面全是带--force的操作
-  err = status(pack);
-  if (err != 0)
-    return err;
-  err = pull(pack);
-  if (err < 0)
-    return err;
-  // 至此upgrade命令把包升到了FETCH_HEAD的commit
-  // 我们稍微操作一下，让HEAD指向最新的master
-  // 这样以后就能开新分支干活了
-  err = checkout_branch(pack, "master");
-  if (err < 0)
-    return err;
+  return upgradePacks({ pack }) == 1 ? 0 : -1;
+}
 
-  db->exec(fmt::format("UPDATE packages SET hash = '{}' WHERE name = '{}';",
-                  head(pack), pack));
-  return 0;
+int PackMan::upgradePacks(const std::vector<std::string> &packs) {
+  std::vector<Job> jobs(packs.size());
+  for (size_t i = 0; i < packs.size(); i++) {
+    jobs[i].name = packs[i];
+  }
+
+  // 联网的部分并发跑
+  runJobs(jobs, [this](Job &job) {
+    auto name = job.name.c_str();
+    // 先status 检查dirty 后面全是带--force的操作
+    int err = status(name);
+    if (err != 0)
+      return err;
+    job.old_head = head(name);
+    return fetch(name, &job.progress);
+  });
+
+  // checkout都是本地操作，全部下完之后依次做；写库也只在这个线程
+  int ok = 0, upgraded = 0;
+  db->exec("BEGIN;");
+  for (auto &job : jobs) {
+    if (job.err != 0)
+      continue;
+    auto name = job.name.c_str();
+    // 至此upgrade命令把包升到了FETCH_HEAD的commit
+    // 我们稍微操作一下，让HEAD指向最新的master
+    // 这样以后就能开新分支干活了
+    if (checkoutFetchHead(name) < 0 || checkout_branch(name, "master") < 0)
+      continue;
+
+    auto hash = head(name);
+    db->exec(fmt::format("UPDATE packages SET hash = '{}' WHERE name = '{}';",
+                    hash, name));
+    ok++;
+    if (hash != job.old_head) {
+      upgraded++;
+      spdlog::info("{}: {} -> {}", job.name, job.old_head.substr(0, 8), hash.substr(0, 8));
+    }
+  }
+  db->exec("COMMIT;");
+
+  spdlog::info("Upgraded {} package(s), {} already up to date, {} failed.",
+               upgraded, ok - upgraded, jobs.size() - ok);
+  return ok;
 }
 
 void PackMan::removePack(const char *pack) {
@@ -246,11 +332,54 @@ void PackMan::forceCheckoutMaster(const char *pack) {
 }
 
 void PackMan::syncCommitHashToDatabase() {
-  for (auto e : db->select("SELECT name FROM packages;")) {
+  int changed = 0;
+  db->exec("BEGIN;");
+  for (auto e : db->select("SELECT name, hash FROM packages;")) {
     auto pack = e["name"];
+    auto hash = head(pack.c_str());
+    if (hash == e["hash"]) continue;
     db->exec(fmt::format("UPDATE packages SET hash = '{}' WHERE name = '{}';",
-             head(pack.c_str()), pack));
+             hash, pack));
+    changed++;
   }
+  db->exec("COMMIT;");
+  spdlog::info("{} package hash(es) updated.", changed);
+}
+
+void PackMan::runJobs(std::vector<Job> &jobs, const std::function<int(Job &)> &work) {
+  if (jobs.empty()) return;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t finished = 0;
+
+  asio::thread_pool pool(std::min(jobs.size(), maxParallelJobs));
+  for (auto &job : jobs) {
+    asio::post(pool, [&, job = &job] {
+      // libgit2的错误信息是线程局部的，失败的话work里已经打过日志了
+      int err = work(*job);
+      std::lock_guard<std::mutex> lock { mutex };
+      job->err = err;
+      job->done = true;
+      finished++;
+      spdlog::info("[{}/{}] {}: {}", finished, jobs.size(), job->name,
+                   err == 0 ? "done" : fmt::format("failed ({})", err));
+      cv.notify_one();
+    });
+  }
+
+  std::unique_lock<std::mutex> lock { mutex };
+  while (!cv.wait_for(lock, 2s, [&] { return finished == jobs.size(); })) {
+    std::string running;
+    for (auto &job : jobs) {
+      if (job.done || job.progress.total == 0) continue;
+      running += fmt::format(" {} {}/{}", job.name, job.progress.received.load(),
+                             job.progress.total.load());
+    }
+    if (!running.empty()) spdlog::info("Receiving objects:{}", running);
+  }
+  lock.unlock();
+  pool.join();
 }
 
 #define GIT_FAIL                                                               \
@@ -265,6 +394,13 @@ void PackMan::syncCommitHashToDatabase() {
 
 static int transfer_progress_cb(const git_indexer_progress *stats,
                                 void *payload) {
+  if (payload) {
+    auto progress = static_cast<PackMan::Progress *>(payload);
+    progress->received = stats->received_objects;
+    progress->total = stats->total_objects;
+    return 0;
+  }
+
   if (stats->received_objects == stats->total_objects) {
     printf("Resolving deltas %u/%u\r", stats->indexed_deltas,
            stats->total_deltas);
@@ -277,23 +413,25 @@ static int transfer_progress_cb(const git_indexer_progress *stats,
   return 0;
 }
 
-int PackMan::clone(const char *u) {
-  git_repository *repo = NULL;
-  auto url = std::string { u };
-  while (!url.empty() && url.back() == '/') {
-    url.pop_back();
-  }
+// 新装的包默认浅克隆，只要最新一个commit；要历史的话自己git fetch --unshallow
+// libgit2 1.7之前没有浅克隆，照旧完整clone
+#if LIBGIT2_VER_MAJOR > 1 || (LIBGIT2_VER_MAJOR == 1 && LIBGIT2_VER_MINOR >= 7)
+#define FK_GIT_SHALLOW
+#endif
 
-  auto fileName = url.substr(url.find_last_of('/') + 1);
-  if (fileName.size() > 4 && fileName.substr(fileName.size() - 4) == ".git") {
-    fileName = fileName.substr(0, fileName.size() - 4);
-  }
-  auto clonePath = std::filesystem::path("packages") / fileName;
+int PackMan::clone(const char *u, Progress *progress) {
+  git_repository *repo = NULL;
+  auto url = trimUrl(u);
+  auto clonePath = std::filesystem::path("packages") / packNameFromUrl(url);
 
   git_clone_options opt;
   git_clone_init_options(&opt, GIT_CLONE_OPTIONS_VERSION);
   opt.fetch_opts.proxy_opts.version = 1;
   opt.fetch_opts.callbacks.transfer_progress = transfer_progress_cb;
+  opt.fetch_opts.callbacks.payload = progress;
+#ifdef FK_GIT_SHALLOW
+  opt.fetch_opts.depth = 1;
+#endif
   int err = git_clone(&repo, url.c_str(), clonePath.string().c_str(), &opt);
   if (err < 0) {
     std::error_code ec;
@@ -302,7 +440,7 @@ int PackMan::clone(const char *u) {
       spdlog::error("Failed to remove directory: {}", ec.message());
     }
     GIT_FAIL;
-  } else {
+  } else if (!progress) {
     printf("\n");
   }
 
@@ -311,8 +449,8 @@ int PackMan::clone(const char *u) {
   return err;
 }
 
-// git fetch && git checkout FETCH_HEAD -f
-int PackMan::pull(const char *name) {
+// git fetch origin
+int PackMan::fetch(const char *name, Progress *progress) {
   git_repository *repo = NULL;
   int err;
   git_remote *remote = NULL;
@@ -321,35 +459,62 @@ int PackMan::pull(const char *name) {
   git_fetch_init_options(&opt, GIT_FETCH_OPTIONS_VERSION);
   opt.proxy_opts.version = 1;
   opt.callbacks.transfer_progress = transfer_progress_cb;
-
-  git_checkout_options opt2 = GIT_CHECKOUT_OPTIONS_INIT;
-  opt2.checkout_strategy = GIT_CHECKOUT_FORCE;
+  opt.callbacks.payload = progress;
 
   err = git_repository_open(&repo, path.c_str());
   GIT_CHK_CLEAN;
 
-  // first git fetch origin
+#ifdef FK_GIT_SHALLOW
+  // 浅克隆的包继续浅着拉，完整clone的不动
+  if (git_repository_is_shallow(repo) == 1)
+    opt.depth = 1;
+#endif
+
   err = git_remote_lookup(&remote, repo, "origin");
   GIT_CHK_CLEAN;
 
   err = git_remote_fetch(remote, NULL, &opt, NULL);
   GIT_CHK_CLEAN;
 
-  // then git checkout FETCH_HEAD
-  err = git_repository_set_head(repo, "FETCH_HEAD");
+  if (!progress)
+    printf("\n");
+
+clean:
+  git_remote_free(remote);
+  git_repository_free(repo);
+  return err;
+}
+
+// git checkout FETCH_HEAD -f
+int PackMan::checkoutFetchHead(const char *name) {
+  git_repository *repo = NULL;
+  int err;
+  auto path = fmt::format("packages/{}", name);
+  git_checkout_options opt = GIT_CHECKOUT_OPTIONS_INIT;
+  opt.checkout_strategy = GIT_CHECKOUT_FORCE;
+
+  err = git_repository_open(&repo, path.c_str());
   GIT_CHK_CLEAN;
 
-  err = git_checkout_head(repo, &opt2);
+  err = git_repository_set_head(repo, "FETCH_HEAD");
   GIT_CHK_CLEAN;
 
-  printf("\n");
+  err = git_checkout_head(repo, &opt);
+  GIT_CHK_CLEAN;
 
 clean:
-  git_remote_free(remote);
   git_repository_free(repo);
   return err;
 }
 
+// git fetch && git checkout FETCH_HEAD -f
+int PackMan::pull(const char *name) {
+  int err = fetch(name);
+  if (err < 0)
+    return err;
+  return checkoutFetchHead(name);
+}
+
 int PackMan::checkout(const char *name, const char *hash) {
   git_repository *repo = NULL;
   int err;
@@ -490,3 +655,4 @@ clean:
 
 #undef GIT_FAIL
 #undef GIT_CHK_CLEAN
+#undef FK_GIT_SHALLOW
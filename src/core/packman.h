@@ -15,16 +15,23 @@ public:
 
   std::vector<std::string> &getDisabledPacks();
   const std::string &summary() const;
-  void refreshSummary();
+  // 查库拼出新的摘要，不碰m_summary，哪个线程都能调；换上去用setSummary，只在主线程
+  std::string buildSummary();
+  void setSummary(std::string summary);
   /*
   // server用不到loadSummary，但还是先留着
   void loadSummary(const QString &, bool useThread = false);
   */
   int downloadNewPack(const char *url);
+  // 批量版本：clone/fetch丢到线程池里几个仓库同时跑，定时打印进度
+  // 全部下完之后再在调用线程里依次checkout、一个事务写库；返回成功的个数
+  // 调用方最后refreshMd5一次就行
+  int downloadNewPacks(const std::vector<std::string> &urls);
   void enablePack(const char *pack);
   void disablePack(const char *pack);
   int updatePack(const char *pack, const char *hash);
   int upgradePack(const char *pack);
+  int upgradePacks(const std::vector<std::string> &packs);
   void removePack(const char *pack);
   Sqlite3::QueryResult listPackages();
 
@@ -34,6 +41,12 @@ public:
   // 适用于自己手动git pull包后使用
   void syncCommitHashToDatabase();
 
+  // clone/fetch的进度，libgit2在工作线程里回调更新，打印进度的线程来读
+  struct Progress {
+    std::atomic<unsigned> received = 0;
+    std::atomic<unsigned> total = 0;
+  };
+
 private:
   PackMan();
 
@@ -42,10 +55,18 @@ private:
 
   std::string m_summary;
 
-  int clone(const char *url);
-  int pull(const char *name);
+  // progress为空时和原来一样直接往终端打进度
+  int clone(const char *url, Progress *progress = nullptr);
+  int fetch(const char *name, Progress *progress = nullptr);
+  int checkoutFetchHead(const char *name);
+  int pull(const char *name); // fetch + checkoutFetchHead
   int checkout(const char *name, const char *hash);
   int checkout_branch(const char *name, const char *branch);
+  // 批量操作里的一项，只在packman.cpp里用
+  struct Job;
+  // work在线程池里跑，不能碰db；调用线程等着并定时打印进度
+  void runJobs(std::vector<Job> &jobs, const std::function<int(Job &)> &work);
+
   int status(const char *name); // return 1 if the workdir is modified
   std::string head(const char *name); // get commit hash of HEAD
 };
@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+// 带代数的槽位表：插入时分配一个int句柄，句柄 = (代数 << IndexBits) | 槽位下标
+// 查找就是取下标、比一下句柄，没有哈希也不会抛异常；槽位被复用时代数+1，旧句柄自然失效
+//
+// 写（插入/删除）只能在一个线程（主线程）做，读可以在任意线程（RoomThread里的RPC）同时进行：
+// - 槽位按块分配，块一旦分配就不再移动或释放，读者拿到的块指针一直有效
+// - 槽里的值是atomic<shared_ptr>，读者拿到的是一份引用，对象等最后一个引用放掉才析构
+// - 句柄在值之前清掉、在值之后写上，读者前后各比一次句柄，中途被换掉了就当没找到
+//
+// 句柄从1开始，0永远无效；刚释放的槽位先排队，攒够MinFree个才复用，尽量让句柄晚点重复
+template <typename T, int IndexBits = 16>
+class SlotMap {
+  static_assert(IndexBits > 10 && IndexBits < 31);
+
+  static constexpr uint32_t ChunkBits = 10;
+  static constexpr uint32_t ChunkSize = 1u << ChunkBits;
+  static constexpr uint32_t MaxSlots = 1u << IndexBits;
+  static constexpr uint32_t MaxChunks = MaxSlots / ChunkSize;
+  static constexpr uint32_t IndexMask = MaxSlots - 1;
+  static constexpr uint32_t GenMask = (1u << (31 - IndexBits)) - 1;
+  static constexpr size_t MinFree = 1024;
+
+  struct Slot {
+    std::atomic<int> handle = 0;
+    std::atomic<std::shared_ptr<T>> value;
+    uint32_t gen = 0;   // 只有写线程用
+  };
+  struct Chunk {
+    std::array<Slot, ChunkSize> slots;
+  };
+
+public:
+  SlotMap() = default;
+  SlotMap(SlotMap &) = delete;
+  SlotMap(SlotMap &&) = delete;
+  ~SlotMap() {
+    for (auto &c : m_chunks) delete c.load();
+  }
+
+  // make(handle)返回要放进去的对象，可以在里面把句柄记到对象上；槽位用光了返回0
+  template <typename F>
+  int emplace(F &&make) {
+    uint32_t idx;
+    if (!m_free.empty() && (m_free.size() >= MinFree || m_used == MaxSlots)) {
+      idx = m_free.front();
+      m_free.pop_front();
+    } else if (m_used < MaxSlots) {
+      idx = m_used++;
+      if (idx == 0) idx = m_used++;   // 0号不用，保证句柄非0
+      auto &chunk = m_chunks[idx >> ChunkBits];
+      if (!chunk.load(std::memory_order_relaxed)) {
+        chunk.store(new Chunk, std::memory_order_release);
+      }
+    } else {
+      return 0;
+    }
+
+    auto &slot = slotAt(idx);
+    int handle = (int)((slot.gen << IndexBits) | idx);
+    slot.value.store(make(handle));
+    slot.handle.store(handle);
+    m_size++;
+    return handle;
+  }
+
+  int insert(std::shared_ptr<T> value) {
+    return emplace([&](int) { return std::move(value); });
+  }
+
+  // 句柄已经失效的话什么都不做
+  void erase(int handle) {
+    auto slot = findSlot(handle);
+    if (!slot) return;
+
+    slot->handle.store(0);
+    slot->value.store(nullptr);
+    slot->gen = (slot->gen + 1) & GenMask;
+    m_free.push_back(handle & IndexMask);
+    m_size--;
+  }
+
+  // 任意线程可用
+  std::shared_ptr<T> find(int handle) const {
+    auto slot = findSlot(handle);
+    if (!slot) return nullptr;
+
+    auto ret = slot->value.load();
+    if (slot->handle.load() != handle) return nullptr;
+    return ret;
+  }
+
+  bool contains(int handle) const { return find(handle) != nullptr; }
+
+  size_t size() const { return m_size; }
+
+  // 按槽位顺序遍历，解引用得到 pair<句柄, shared_ptr>；遍历中途增删是安全的
+  class const_iterator {
+  public:
+    using value_type = std::pair<int, std::shared_ptr<T>>;
+
+    const value_type &operator*() const { return m_cur; }
+    const value_type *operator->() const { return &m_cur; }
+    const_iterator &operator++() { m_idx++; seek(); return *this; }
+    bool operator==(const const_iterator &o) const { return m_idx == o.m_idx; }
+
+  private:
+    friend class SlotMap;
+    const_iterator(const SlotMap *map, uint32_t idx) : m_map { map }, m_idx { idx } { seek(); }
+
+    void seek() {
+      for (; m_idx < MaxSlots; m_idx++) {
+        auto chunk = m_map->m_chunks[m_idx >> ChunkBits].load(std::memory_order_acquire);
+        if (!chunk) { m_idx = MaxSlots; break; }
+
+        auto &slot = chunk->slots[m_idx & (ChunkSize - 1)];
+        int handle = slot.handle.load();
+        if (handle == 0) continue;
+        auto value = m_map->find(handle);
+        if (!value) continue;
+        m_cur = { handle, std::move(value) };
+        return;
+      }
+      m_cur = {};
+    }
+
+    const SlotMap *m_map;
+    uint32_t m_idx;
+    value_type m_cur;
+  };
+
+  const_iterator begin() const { return { this, 1 }; }
+  const_iterator end() const { return { this, MaxSlots }; }
+
+private:
+  std::array<std::atomic<Chunk *>, MaxChunks> m_chunks {};
+
+  // 以下只有写线程用
+  uint32_t m_used = 0;
+  std::deque<uint32_t> m_free;
+  std::atomic<size_t> m_size = 0;
+
+  Slot &slotAt(uint32_t idx) const {
+    auto chunk = m_chunks[idx >> ChunkBits].load(std::memory_order_acquire);
+    return chunk->slots[idx & (ChunkSize - 1)];
+  }
+
+  Slot *findSlot(int handle) const {
+    if (handle <= 0) return nullptr;
+    uint32_t idx = handle & IndexMask;
+    auto chunk = m_chunks[idx >> ChunkBits].load(std::memory_order_acquire);
+    if (!chunk) return nullptr;
+    auto &slot = chunk->slots[idx & (ChunkSize - 1)];
+    if (slot.handle.load() != handle) return nullptr;
+    return &slot;
+  }
+};
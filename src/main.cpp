@@ -3,6 +3,7 @@
 #include "core/packman.h"
 #include "server/server.h"
 #include "server/admin/shell.h"
+#include "server/rpc-lua/rpc-tracer.h"
 
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <spdlog/sinks/rotating_file_sink.h>
@@ -57,6 +58,10 @@ static void show_usage(const char *prog) {
     "  -v, --version           Display version information.\n"
     "  -h, --help              Show this help message.\n"
     "  -p, --port <port>       Specify a port number to listen on.\n"
+    "  -d, --decode-trace <file>\n"
+    "                          Print an RPC trace dumped by `rpctrace dump`.\n"
+    "  -r, --db-readers <n>    Number of read-only database connections per\n"
+    "                          database (default 4, 0 to disable).\n"
     "\n"
     "See more at our documentation: \n"
     "<https://fkbook-all-in-one.readthedocs.io/zh-cn/latest/server/index.html>.\n",
@@ -82,6 +87,7 @@ static void print_version() {
 
 struct cmdConfig {
   uint16_t port = 9527;
+  int exit_code = 0;    // parse_opt返回false时进程的退出码
 };
 
 static bool parse_opt(int argc, char **argv, cmdConfig &cfg) {
@@ -89,11 +95,13 @@ static bool parse_opt(int argc, char **argv, cmdConfig &cfg) {
     {"version", no_argument, nullptr, 'v'},
     {"help", no_argument, nullptr, 'h'},
     {"port", required_argument, nullptr, 'p'},
+    {"decode-trace", required_argument, nullptr, 'd'},
+    {"db-readers", required_argument, nullptr, 'r'},
     {nullptr, 0, nullptr, 0}
   };
 
   int opt;
-  while ((opt = getopt_long(argc, argv, "vhp:", longOptions, nullptr)) != -1) {
+  while ((opt = getopt_long(argc, argv, "vhp:d:r:", longOptions, nullptr)) != -1) {
     switch (opt) {
       case 'v':
         print_version();
@@ -111,8 +119,15 @@ static bool parse_opt(int argc, char **argv, cmdConfig &cfg) {
         cfg.port = (uint16_t)port;
         break;
       }
+      case 'd':
+        if (!RpcTracer::decode(optarg)) cfg.exit_code = 1;
+        return false;
+      case 'r':
+        Sqlite3::setReaderPoolSize(std::atoi(optarg));
+        break;
       default:
         show_usage(argv[0]);
+        cfg.exit_code = 1;
         return false;
     }
   }
@@ -124,7 +139,7 @@ int main(int argc, char *argv[]) {
   cmdConfig cfg;
 
   if (!parse_opt(argc, argv, cfg)) {
-    return 0;
+    return cfg.exit_code;
   }
 
   initLogger();
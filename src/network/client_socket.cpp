@@ -69,10 +69,11 @@ void ClientSocket::disconnectFromHost() {
 }
 
 void ClientSocket::send(const std::shared_ptr<std::string> msg) {
+  // 写完之前msg不能析构，群发时这份数据还是大家共用的
   asio::async_write(
     m_socket,
     asio::const_buffer { msg->data(), msg->size() },
-    detached
+    [msg](const boost::system::error_code &, size_t) {}
   );
 }
 
@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "network/notify_log.h"
+
+uint64_t NotifyLog::nextSeq() const {
+  return m_last_seq + 1;
+}
+
+void NotifyLog::append(std::shared_ptr<std::string> frame) {
+  m_bytes += frame->size();
+  m_frames.push_back(std::move(frame));
+  m_last_seq++;
+
+  while (m_frames.size() > maxFrames || (m_bytes > maxBytes && m_frames.size() > 1)) {
+    m_bytes -= m_frames.front()->size();
+    m_frames.pop_front();
+  }
+}
+
+bool NotifyLog::since(uint64_t lastSeen, std::vector<std::shared_ptr<std::string>> &out) const {
+  auto firstSeq = m_last_seq - m_frames.size() + 1;
+  if (lastSeen > m_last_seq || lastSeen + 1 < firstSeq) return false;
+
+  out.assign(m_frames.begin() + (lastSeen + 1 - firstSeq), m_frames.end());
+  return true;
+}
+
+size_t NotifyLog::size() const {
+  return m_frames.size();
+}
+
+size_t NotifyLog::bytes() const {
+  return m_bytes;
+}
@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+// 最近发给某个玩家的通知，断线重连时按序号补发缺的那些
+// 每条通知的序号填在包的requestId位置上（不记录时固定是-2），客户端记住最后收到的序号，
+// 重连时在Setup里带上；缺的都还在就直接补发，否则还是让Lua整局重发
+// 条数和字节数都有上限，超了就丢最老的
+// 只在主线程使用
+class NotifyLog {
+public:
+  NotifyLog() = default;
+  NotifyLog(NotifyLog &) = delete;
+  NotifyLog(NotifyLog &&) = delete;
+
+  uint64_t nextSeq() const;
+  // frame的序号必须是nextSeq()
+  void append(std::shared_ptr<std::string> frame);
+
+  // 取出序号大于lastSeen的所有包；lastSeen之后的有被丢掉的（或者lastSeen比已发的还大）返回false
+  bool since(uint64_t lastSeen, std::vector<std::shared_ptr<std::string>> &out) const;
+
+  size_t size() const;
+  size_t bytes() const;
+
+private:
+  static constexpr size_t maxFrames = 512;
+  static constexpr size_t maxBytes = 256 * 1024;
+
+  std::deque<std::shared_ptr<std::string>> m_frames;
+  uint64_t m_last_seq = 0;
+  size_t m_bytes = 0;
+};
@@ -2,6 +2,7 @@
 
 #include "network/router.h"
 #include "network/client_socket.h"
+#include "network/notify_log.h"
 #include "server/user/player.h"
 #include "server/server.h"
 #include "core/c-wrapper.h"
@@ -61,25 +62,92 @@ void Router::request(int type, const std::string_view &command,
   m_reply = "__notready";
   replyMutex.unlock();
 
-  sendMessage(Cbor::encodeArray({
+  auto buf = Cbor::encodeArray({
     requestId,
     type,
     command,
     cborData,
     timeout,
     (timestamp <= 0 ? requestStartTime : timestamp)
-  }));
+  });
+
+  replyMutex.lock();
+  m_last_request = buf;
+  replyMutex.unlock();
+
+  sendMessage(buf);
 }
 
 void Router::notify(int type, const std::string_view &command, const std::string_view &data) {
-  if (!socket) return;
-  auto buf = Cbor::encodeArray({
+  if (!m_notify_log_enabled) {
+    if (!socket) return;
+    sendMessage(encodeNotification(command, data));
+    return;
+  }
+
+  // 序号的分配和发送都在主线程上，保证线路上的顺序和序号一致
+  auto &main_ctx = Server::instance().context();
+  auto f = asio::dispatch(main_ctx, asio::use_future([&] {
+    // 转过来的途中被关掉了，照普通通知发
+    if (!m_notify_log) {
+      if (socket) socket->send(std::make_shared<std::string>(encodeNotification(command, data)));
+      return;
+    }
+    auto frame = std::make_shared<std::string>(Cbor::encodeArray({
+      m_notify_log->nextSeq(),
+      Router::TYPE_NOTIFICATION | Router::SRC_SERVER | Router::DEST_CLIENT,
+      command,
+      data,
+    }));
+    m_notify_log->append(frame);
+    if (socket) socket->send(frame);
+  }));
+  f.wait();
+}
+
+std::string Router::encodeNotification(const std::string_view &command, const std::string_view &data) {
+  return Cbor::encodeArray({
     -2,
     Router::TYPE_NOTIFICATION | Router::SRC_SERVER | Router::DEST_CLIENT,
     command,
     data,
   });
-  sendMessage(buf);
+}
+
+void Router::setNotifyLogEnabled(bool enabled) {
+  if (!enabled) {
+    m_notify_log_enabled = false;
+    m_notify_log = nullptr;
+  } else if (!m_notify_log) {
+    m_notify_log = std::make_unique<NotifyLog>();
+    m_notify_log_enabled = true;
+  }
+}
+
+bool Router::notifyLogEnabled() const {
+  return m_notify_log_enabled;
+}
+
+bool Router::replayNotifications(uint64_t lastSeen) {
+  if (!m_notify_log || !socket) return false;
+
+  std::vector<std::shared_ptr<std::string>> frames;
+  if (!m_notify_log->since(lastSeen, frames)) return false;
+
+  for (auto &frame : frames) {
+    socket->send(frame);
+  }
+  return true;
+}
+
+void Router::resendRequest() {
+  std::string buf;
+  {
+    std::lock_guard<std::mutex> lock(replyMutex);
+    if (m_reply != "__notready") return;
+    buf = m_last_request;
+  }
+  if (!buf.empty()) sendMessage(buf);
 }
 
 // timeout永远是0
@@ -124,12 +192,16 @@ void Router::handlePacket(const Packet &packet) {
 }
 
 void Router::sendMessage(const std::string &msg) {
+  sendFrame(std::make_shared<std::string>(msg));
+}
+
+void Router::sendFrame(std::shared_ptr<std::string> frame) {
   if (!socket) return;
   // 将send任务交给主进程（如同Qt）并等待
   auto &main_ctx = Server::instance().context();
   auto f = asio::dispatch(main_ctx, asio::use_future([&, weak = socket->weak_from_this()] {
     auto c = weak.lock();
-    if (c) c->send(std::make_shared<std::string>(msg));
+    if (c) c->send(frame);
   }));
   f.wait();
 }
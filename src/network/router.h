@@ -5,6 +5,7 @@
 struct Packet;
 class Player;
 class ClientSocket;
+class NotifyLog;
 
 class Router {
 public:
@@ -39,6 +40,19 @@ public:
   void request(int type, const std::string_view &command,
               const std::string_view &cborData, int timeout, int64_t timestamp = -1);
   void notify(int type, const std::string_view &command, const std::string_view &cborData);
+  // 发一个已经编码好的包，群发时所有人共用同一份
+  void sendFrame(std::shared_ptr<std::string> frame);
+  static std::string encodeNotification(const std::string_view &command, const std::string_view &cborData);
+
+  // 客户端在Setup里带了序号才打开，见NotifyLog
+  // 打开后notify会带上序号，断线期间的通知也照样记下
+  // setNotifyLogEnabled和replayNotifications只能在主线程调用，notifyLogEnabled哪都能调
+  void setNotifyLogEnabled(bool enabled);
+  bool notifyLogEnabled() const;
+  // 重连后补发lastSeen之后的通知，补不齐返回false，什么都不发
+  bool replayNotifications(uint64_t lastSeen);
+  // 断线时还没答复的请求再发一次
+  void resendRequest();
   std::string waitForReply(int timeout);
 
   void abortRequest();
@@ -56,6 +70,10 @@ private:
 
   int64_t requestStartTime;
   std::string m_reply;    // should be json string
+  std::string m_last_request;
+  // m_notify_log只在主线程上碰；RoomThread上的notify先看这个标记决定要不要转到主线程
+  std::unique_ptr<NotifyLog> m_notify_log;
+  std::atomic<bool> m_notify_log_enabled = false;
   int expectedReplyId;
   int replyTimeout;
 
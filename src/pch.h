@@ -13,6 +13,7 @@
 #include <array>
 #include <list>
 #include <deque>
+#include <queue>
 #include <set>
 #include <map>
 #include <unordered_set>
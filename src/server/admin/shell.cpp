@@ -6,13 +6,24 @@
 #include "server/server.h"
 #include "server/user/player.h"
 #include "server/user/user_manager.h"
+#include "server/user/access_control.h"
+#include "server/user/save_states.h"
+#include "server/user/auth.h"
 #include "server/room/room_manager.h"
+#include "server/room/room_list.h"
 #include "server/room/room.h"
 #include "server/room/lobby.h"
+#include "server/room/general_stats.h"
 #include "server/rpc-lua/rpc-lua.h"
+#include "server/rpc-lua/rpc-tracer.h"
 #include "server/gamelogic/roomthread.h"
 #include "core/util.h"
 #include "core/c-wrapper.h"
+#include "core/db_executor.h"
+#include "core/ahocorasick.h"
+
+#include <openssl/rsa.h>
+#include <openssl/pem.h>
 
 #include <readline/history.h>
 #include <readline/readline.h>
@@ -47,6 +58,11 @@ void Shell::helpCommand(StringList &) {
   HELP_MSG("{}: Kick a player by his <id>.", "kick");
   HELP_MSG("{}: Kick all players in a room, then abandon it.", "killroom");
   HELP_MSG("{}: Delete dead players in the lobby.", "checklobby");
+  HELP_MSG("{}: Toggle (on/off [thread id]) or dump (dump <thread id> [file]) RPC traces.", "rpctrace");
+  HELP_MSG("{}: Database maintenance in background (analyze | vacuum [pages] | vacuum full).", "dbmaint");
+  HELP_MSG("{}: Benchmark ban word matching against the old linear scan ([iterations]).", "benchbanword");
+  HELP_MSG("{}: Fuzz and benchmark Sqlite3::checkString against the old regex ([iterations]).", "benchcheckstring");
+  HELP_MSG("{}: Simulate a login storm, inline vs. worker pool crypto ([logins]).", "benchlogin");
 
   spdlog::info("");
   spdlog::info("===== Account commands =====");
@@ -54,11 +70,11 @@ void Shell::helpCommand(StringList &) {
   HELP_MSG("{}: Unban 1 or more accounts by their <name>.", "unban");
   HELP_MSG(
       "{}: Ban 1 or more IP address. "
-      "At least 1 <name> required.",
+      "At least 1 <name>, address or CIDR range required.",
       "banip");
   HELP_MSG(
       "{}: Unban 1 or more IP address. "
-      "At least 1 <name> required.",
+      "At least 1 <name>, address or CIDR range required.",
       "unbanip");
   HELP_MSG(
       "{}: Ban 1 or more UUID. "
@@ -76,13 +92,13 @@ void Shell::helpCommand(StringList &) {
 
   spdlog::info("");
   spdlog::info("===== Package commands =====");
-  HELP_MSG("{}: Install a new package from <url>.", "install");
+  HELP_MSG("{}: Install new packages from <url> [url...], fetched in parallel.", "install");
   HELP_MSG("{}: Remove a package.", "remove");
   HELP_MSG("{}: List all packages.", "pkgs");
   HELP_MSG("{}: Get packages hash from file system and write to database.", "syncpkgs");
   HELP_MSG("{}: Enable a package.", "enable");
   HELP_MSG("{}: Disable a package.", "disable");
-  HELP_MSG("{}: Upgrade a package. Leave empty to upgrade all.", "upgrade/u");
+  HELP_MSG("{}: Upgrade packages [pack...], fetched in parallel. Leave empty to upgrade all.", "upgrade/u");
   spdlog::info("For more commands, check the documentation.");
 
 #undef HELP_MSG
@@ -172,8 +188,7 @@ void Shell::installCommand(StringList &list) {
     return;
   }
 
-  auto url = list[0];
-  PackMan::instance().downloadNewPack(url.c_str());
+  PackMan::instance().downloadNewPacks(list);
   Server::instance().refreshMd5();
 }
 
@@ -189,17 +204,15 @@ void Shell::removeCommand(StringList &list) {
 }
 
 void Shell::upgradeCommand(StringList &list) {
-  if (list.empty()) {
-    auto arr = PackMan::instance().listPackages();
-    for (auto &a : arr) {
-      PackMan::instance().upgradePack(a["name"].c_str());
+  auto packs = list;
+  if (packs.empty()) {
+    for (auto &a : PackMan::instance().listPackages()) {
+      packs.push_back(a["name"]);
     }
-    Server::instance().refreshMd5();
-    return;
   }
 
-  auto pack = list[0];
-  PackMan::instance().upgradePack(pack.c_str());
+  // 全部升级完只刷新一次md5和包摘要
+  PackMan::instance().upgradePacks(packs);
   Server::instance().refreshMd5();
 }
 
@@ -290,24 +303,33 @@ void Shell::msgRoomCommand(StringList &list) {
   room->doBroadcastNotify(room->getPlayers(), "ServerMessage", msg);
 }
 
-static void banAccount(Sqlite3 &db, const std::string_view &name, bool banned) {
+// AccessControl和在线玩家表都只在主线程上动，shell这边派过去做完再回来
+template <typename F>
+static auto onMainThread(F &&f) {
+  return asio::dispatch(Server::instance().context(), asio::use_future(std::forward<F>(f))).get();
+}
+
+static void banAccount(DbExecutor &db, const std::string_view &name, bool banned) {
   if (!Sqlite3::checkString(name))
     return;
   static constexpr const char *sql_find =
     "SELECT id FROM userinfo WHERE name='{}';";
-  auto result = db.select(fmt::format(sql_find, name));
+  auto result = db.selectSync(fmt::format(sql_find, name));
   if (result.empty())
     return;
   auto obj = result[0];
   int id = atoi(obj["id"].c_str());
-  db.exec(fmt::format("UPDATE userinfo SET banned={} WHERE id={};",
-                  banned ? 1 : 0, id));
-
-  if (banned) {
-    auto p = Server::instance().user_manager().findPlayer(id).lock();
+  onMainThread([&] {
+    auto &server = Server::instance();
+    server.accessControl().banUser(id, banned);
+    if (!banned) return;
+    auto p = server.user_manager().findPlayer(id).lock();
     if (p) {
       p->emitKicked();
     }
+  });
+
+  if (banned) {
     spdlog::info("Banned {}.", name);
   } else {
     spdlog::info("Unbanned {}.", name);
@@ -320,7 +342,7 @@ void Shell::banCommand(StringList &list) {
     return;
   }
 
-  auto &db = Server::instance().database();
+  auto &db = Server::instance().dbExecutor();
 
   for (auto &name : list) {
     banAccount(db, name, true);
@@ -333,7 +355,7 @@ void Shell::unbanCommand(StringList &list) {
     return;
   }
 
-  auto &db = Server::instance().database();
+  auto &db = Server::instance().dbExecutor();
 
   for (auto &name : list) {
     banAccount(db, name, false);
@@ -343,29 +365,45 @@ void Shell::unbanCommand(StringList &list) {
   unbanUuidCommand(list);
 }
 
-static void banIPByName(Sqlite3 &db, const std::string_view &name, bool banned) {
+static void banIPByName(DbExecutor &db, const std::string_view &name, bool banned) {
+  auto &acl = Server::instance().accessControl();
+
+  // 直接给了地址或者网段
+  if (onMainThread([&] { return acl.banIp(name, banned); })) {
+    spdlog::info("{} IP {}.", banned ? "Banned" : "Unbanned", name);
+    return;
+  }
+
   if (!Sqlite3::checkString(name))
     return;
 
   static constexpr const char *sql_find =
     "SELECT id, lastLoginIp FROM userinfo WHERE name='{}';";
-  auto result = db.select(fmt::format(sql_find, name));
+  auto result = db.selectSync(fmt::format(sql_find, name));
   if (result.empty())
     return;
   auto obj = result[0];
   int id = atoi(obj["id"].c_str());
   auto addr = obj["lastLoginIp"];
 
-  if (banned) {
-    db.exec(fmt::format("INSERT INTO banip VALUES('{}');", addr));
-
-    auto p = Server::instance().user_manager().findPlayer(id).lock();
-    if (p) {
-      p->emitKicked();
+  bool ok = onMainThread([&] {
+    if (!acl.banIp(addr, banned)) return false;
+    if (banned) {
+      auto p = Server::instance().user_manager().findPlayer(id).lock();
+      if (p) {
+        p->emitKicked();
+      }
     }
+    return true;
+  });
+  if (!ok) {
+    spdlog::warn("Invalid IP address {}.", addr);
+    return;
+  }
+
+  if (banned) {
     spdlog::info("Banned IP {}.", addr);
   } else {
-    db.exec(fmt::format("DELETE FROM banip WHERE ip='{}';", addr));
     spdlog::info("Unbanned IP {}.", addr);
   }
 }
@@ -376,7 +414,7 @@ void Shell::banipCommand(StringList &list) {
     return;
   }
 
-  auto &db = Server::instance().database();
+  auto &db = Server::instance().dbExecutor();
 
   for (auto &name : list) {
     banIPByName(db, name, true);
@@ -389,40 +427,42 @@ void Shell::unbanipCommand(StringList &list) {
     return;
   }
 
-  auto &db = Server::instance().database();
+  auto &db = Server::instance().dbExecutor();
 
   for (auto &name : list) {
     banIPByName(db, name, false);
   }
 }
 
-static void banUuidByName(Sqlite3 &db, const std::string_view &name, bool banned) {
+static void banUuidByName(DbExecutor &db, const std::string_view &name, bool banned) {
   if (!Sqlite3::checkString(name))
     return;
   static constexpr const char *sql_find =
     "SELECT id FROM userinfo WHERE name='{}';";
-  auto result = db.select(fmt::format(sql_find, name));
+  auto result = db.selectSync(fmt::format(sql_find, name));
   if (result.empty())
     return;
   auto obj = result[0];
   int id = atoi(obj["id"].c_str());
 
-  auto result2 = db.select(fmt::format("SELECT * FROM uuidinfo WHERE id={};", id));
+  auto result2 = db.selectSync(fmt::format("SELECT * FROM uuidinfo WHERE id={};", id));
   if (result2.empty())
     return;
 
   auto uuid = result2[0]["uuid"];
-
-  if (banned) {
-    db.exec(fmt::format("INSERT INTO banuuid VALUES('{}');", uuid));
-
-    auto p = Server::instance().user_manager().findPlayer(id).lock();
+  onMainThread([&] {
+    auto &server = Server::instance();
+    server.accessControl().banUuid(uuid, banned);
+    if (!banned) return;
+    auto p = server.user_manager().findPlayer(id).lock();
     if (p) {
       p->emitKicked();
     }
+  });
+
+  if (banned) {
     spdlog::info("Banned UUID {}.", uuid);
   } else {
-    db.exec(fmt::format("DELETE FROM banuuid WHERE uuid='{}';", uuid));
     spdlog::info("Unbanned UUID {}.", uuid);
   }
 }
@@ -433,7 +473,7 @@ void Shell::banUuidCommand(StringList &list) {
     return;
   }
 
-  auto &db = Server::instance().database();
+  auto &db = Server::instance().dbExecutor();
 
   for (auto &name : list) {
     banUuidByName(db, name, true);
@@ -446,7 +486,7 @@ void Shell::unbanUuidCommand(StringList &list) {
     return;
   }
 
-  auto &db = Server::instance().database();
+  auto &db = Server::instance().dbExecutor();
 
   for (auto &name : list) {
     banUuidByName(db, name, false);
@@ -459,7 +499,7 @@ void Shell::tempbanCommand(StringList &list) {
     return;
   }
 
-  auto &db = Server::instance().database();
+  auto &db = Server::instance().dbExecutor();
   auto name = list[0];
   auto duration_str = list[1];
   static const char *invalid_dur = "Invalid duration value. "
@@ -504,20 +544,20 @@ void Shell::tempbanCommand(StringList &list) {
 
   static constexpr const char *sql_find =
     "SELECT id FROM userinfo WHERE name='{}';";
-  auto result = db.select(fmt::format(sql_find, name));
+  auto result = db.selectSync(fmt::format(sql_find, name));
   if (result.empty())
     return;
 
   auto obj = result[0];
   int id = atoi(obj["id"].c_str());
-  db.exec(fmt::format("UPDATE userinfo SET banned=1 WHERE id={};", id));
-  db.exec(fmt::format(
-    "REPLACE INTO tempban (uid, expireAt) VALUES ({}, {});", id, expireTimestamp));
-
-  auto p = Server::instance().user_manager().findPlayer(id).lock();
-  if (p) {
-    p->emitKicked();
-  }
+  onMainThread([&] {
+    auto &server = Server::instance();
+    server.accessControl().banUser(id, true, expireTimestamp);
+    auto p = server.user_manager().findPlayer(id).lock();
+    if (p) {
+      p->emitKicked();
+    }
+  });
 
   std::time_t now_time_t = system_clock::to_time_t(end_tp);
   std::tm local_tm = *std::localtime(&now_time_t);
@@ -533,7 +573,7 @@ void Shell::tempmuteCommand(StringList &list) {
     return;
   }
 
-  auto &db = Server::instance().database();
+  auto &db = Server::instance().dbExecutor();
   auto type_num = list[0];
   auto name = list[1];
   auto duration_str = list[2];
@@ -585,14 +625,13 @@ void Shell::tempmuteCommand(StringList &list) {
 
   static constexpr const char *sql_find = 
     "SELECT id FROM userinfo WHERE name='{}';";
-  auto result = db.select(fmt::format(sql_find, name));
+  auto result = db.selectSync(fmt::format(sql_find, name));
   if (result.empty())
     return;
 
   auto obj = result[0];
   int id = atoi(obj["id"].c_str());
-  db.exec(fmt::format(
-    "REPLACE INTO tempmute (uid, expireAt, type) VALUES ({}, {}, {});", id, expireTimestamp, mute_type));
+  onMainThread([&] { Server::instance().accessControl().mute(id, mute_type, expireTimestamp); });
 
   std::time_t now_time_t = system_clock::to_time_t(end_tp);
   std::tm local_tm = *std::localtime(&now_time_t);
@@ -612,7 +651,7 @@ void Shell::unmuteCommand(StringList &list) {
     spdlog::warn("The 'unmute' command needs at least 1 <name>.");
     return;
   }
-  auto &db = Server::instance().database();
+  auto &db = Server::instance().dbExecutor();
 
   for (auto &name : list) {
     if (!Sqlite3::checkString(name))
@@ -620,7 +659,7 @@ void Shell::unmuteCommand(StringList &list) {
 
     static constexpr const char *sql_find = 
       "SELECT id FROM userinfo WHERE name='{}';";
-    auto result = db.select(fmt::format(sql_find, name));
+    auto result = db.selectSync(fmt::format(sql_find, name));
     if (result.empty()) {
       spdlog::info("Player {} not found.", name.c_str());
       continue;
@@ -628,7 +667,7 @@ void Shell::unmuteCommand(StringList &list) {
 
     auto obj = result[0];
     int id = atoi(obj["id"].c_str());
-    db.exec(fmt::format("DELETE FROM tempmute WHERE uid={};", id));
+    onMainThread([&] { Server::instance().accessControl().unmute(id); });
     spdlog::info("Unmuted player {}.", name.c_str());
   }
 }
@@ -640,29 +679,24 @@ void Shell::whitelistCommand(StringList &list) {
   }
 
   auto op = list[0];
-  auto &server = Server::instance();
-  auto &db = server.database();
+  auto &acl = Server::instance().accessControl();
 
   if (op == "add") {
-    server.beginTransaction();
     for (size_t i = 1; i < list.size(); i++) {
       auto &name = list[i];
       if (!Sqlite3::checkString(name))
         continue;
 
-      db.exec(fmt::format("INSERT INTO whitelist VALUES ('{}');", name));
+      onMainThread([&] { acl.setWhitelisted(name, true); });
     }
-    server.endTransaction();
   } else if (op == "rm") {
-    server.beginTransaction();
     for (size_t i = 1; i < list.size(); i++) {
       auto &name = list[i];
       if (!Sqlite3::checkString(name))
         continue;
 
-      db.exec(fmt::format("DELETE FROM whitelist WHERE name='{}';", name));
+      onMainThread([&] { acl.setWhitelisted(name, false); });
     }
-    server.endTransaction();
   } else {
     spdlog::warn("usage: whitelist add/rm <names>...");
     return;
@@ -680,7 +714,7 @@ void Shell::resetPasswordCommand(StringList &list) {
     return;
   }
 
-  auto &db = Server::instance().database();
+  auto &db = Server::instance().dbExecutor();
   for (auto &name : list) {
     // 重置为1234
     db.exec(fmt::format("UPDATE userinfo SET password="
@@ -735,11 +769,27 @@ void Shell::statCommand(StringList &) {
     } else {
       spdlog::info("RoomThread {} | {} | {} room(s) {}", id, stat_str, roomsCount,
             outdated ? "| Outdated" : "");
+      auto q = thr->getQueueStats();
+      spdlog::info("  queue: depth {} (max {}) | {} cmd(s) in {} batch(es) | latency avg {:.1f}us max {:.1f}us",
+            q.depth, q.max_depth, q.processed, q.batches, q.avg_latency_us, q.max_latency_us);
     }
   }
 
   spdlog::info("Database memory usage: {:.2f} MiB",
         ((double)server.database().getMemUsage()) / 1048576);
+  spdlog::info("General win rate updates pending: {}",
+        server.generalStats().pendingCount());
+  auto &room_list = server.room_manager().roomList();
+  spdlog::info("Room list: version {}, {} subscriber(s)",
+        room_list.version(), room_list.subscriberCount());
+  auto &saves = server.user_manager().saveStates();
+  spdlog::info("Save states: {} cached, {} unsaved",
+        saves.cachedCount(), saves.dirtyCount());
+
+  auto acl = onMainThread([&] { return server.accessControl().getStats(); });
+  spdlog::info("Access control: {} IP rule(s), {} temp-banned IP(s), {} UUID(s), "
+               "{} banned account(s), {} mute(s), {} whitelisted.", acl.ipRules,
+               acl.tempIps, acl.uuids, acl.users, acl.mutes, acl.whitelist);
 }
 
 void Shell::killRoomCommand(StringList &list) {
@@ -774,6 +824,324 @@ void Shell::checkLobbyCommand(StringList &) {
   asio::post(Server::instance().context(), [&] { lobby->checkAbandoned(); });
 }
 
+void Shell::rpcTraceCommand(StringList &list) {
+  auto &threads = Server::instance().getThreads();
+
+  if (list.empty() || list[0].empty()) {
+    for (auto &[id, thr] : threads) {
+      auto &tracer = thr->getLua().tracer();
+      spdlog::info("RoomThread {} | RPC trace {} | {} record(s) written", id,
+                   tracer.enabled() ? "on" : "off", tracer.total());
+    }
+    return;
+  }
+
+  auto &op = list[0];
+  if (op == "on" || op == "off") {
+    bool enable = op == "on";
+    for (auto &[id, thr] : threads) {
+      if (list.size() >= 2 && id != atoi(list[1].c_str())) continue;
+      thr->getLua().tracer().setEnabled(enable);
+      spdlog::info("RPC trace of RoomThread {} is now {}.", id, op);
+    }
+  } else if (op == "dump") {
+    if (list.size() < 2) {
+      spdlog::warn("Need thread id to do this.");
+      return;
+    }
+
+    int id = atoi(list[1].c_str());
+    auto it = threads.find(id);
+    if (it == threads.end()) {
+      spdlog::info("No such thread.");
+      return;
+    }
+
+    auto &L = it->second->getLua();
+    auto path = list.size() >= 3 ? list[2] :
+      fmt::format("rpctrace-{}-{}.bin", id, time(nullptr));
+    if (L.tracer().dump(path, L.pid())) {
+      spdlog::info("RPC trace of RoomThread {} dumped to {}.", id, path);
+    }
+  } else {
+    spdlog::warn("Usage: rpctrace [on|off [thread id]] | [dump <thread id> [file]]");
+  }
+}
+
+void Shell::dbMaintCommand(StringList &list) {
+  auto &server = Server::instance();
+  auto op = list.empty() ? "" : list[0];
+
+  // 都在DB线程上跑，不走post的批量事务（VACUUM不能放在事务里）
+  // WAL模式下读连接照常工作，跑的时候只有写入会排队
+  for (auto exec : { &server.dbExecutor(), &server.gameDbExecutor() }) {
+    auto dbname = exec == &server.dbExecutor() ? "users.db" : "game.db";
+    if (op.empty()) {
+      exec->run([](Sqlite3 &db) {
+        return std::make_pair(db.schemaVersion(), db.incrementalVacuumEnabled());
+      }, [dbname](std::pair<int, bool> ret) {
+        spdlog::info("{}: schema version {}, incremental vacuum {}", dbname,
+                     ret.first, ret.second ? "enabled" : "disabled");
+      });
+    } else if (op == "analyze") {
+      exec->run([](Sqlite3 &db) { db.analyze(); return 0; }, [dbname](int) {
+        spdlog::info("{}: ANALYZE done.", dbname);
+      });
+    } else if (op == "vacuum" && list.size() >= 2 && list[1] == "full") {
+      exec->run([](Sqlite3 &db) { return db.enableIncrementalVacuum(); }, [dbname](bool ok) {
+        spdlog::info("{}: VACUUM done, incremental vacuum {}.", dbname, ok ? "enabled" : "still disabled");
+      });
+    } else if (op == "vacuum") {
+      int pages = list.size() >= 2 ? atoi(list[1].c_str()) : 0;
+      exec->run([pages](Sqlite3 &db) { return db.incrementalVacuum(pages); }, [dbname](int64_t left) {
+        if (left < 0) {
+          spdlog::warn("{}: incremental vacuum is not enabled, run `dbmaint vacuum full` once.", dbname);
+        } else {
+          spdlog::info("{}: incremental vacuum done, {} free page(s) left.", dbname, left);
+        }
+      });
+    } else {
+      spdlog::warn("Usage: dbmaint [analyze | vacuum [pages] | vacuum full]");
+      return;
+    }
+  }
+}
+
+// bench*命令共用：固定种子，每次生成的输入都一样，前后两次跑的结果能直接比
+static std::mt19937 benchRng() {
+  return std::mt19937 { 20250101 };
+}
+
+// 轮流拿inputs喂给fn跑iterations次，返回平均每次多少纳秒、fn返回true的次数
+template <typename F>
+static std::pair<double, int> benchChecks(const std::vector<std::string> &inputs,
+                                          int iterations, F &&fn) {
+  using namespace std::chrono;
+  int hits = 0;
+  auto start = steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    hits += fn(inputs[i % inputs.size()]);
+  }
+  auto ns = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+  return { (double)ns / iterations, hits };
+}
+
+// 换成自动机之前checkBanWord的写法，留着做对照
+static bool linearBanWordCheck(const std::vector<std::string> &words, const std::string_view &str) {
+  for (auto &s : words) {
+    if (str.find(s) != std::string_view::npos) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void Shell::benchBanWordCommand(StringList &list) {
+  int iterations = list.empty() ? 100000 : atoi(list[0].c_str());
+  if (iterations <= 0) {
+    spdlog::warn("Usage: benchbanword [iterations]");
+    return;
+  }
+
+  // 自己拷一份词表另建一个，不碰服务器正在用的
+  auto words = Server::instance().config().banWords;
+  words.erase(std::remove(words.begin(), words.end(), ""), words.end());
+  AhoCorasick ac { words };
+
+  // 大致模拟聊天内容：中英文混杂，十分之一左右夹着一个违禁词
+  static const char *pieces[] = {
+    "hello", "gg", "杀", "闪", "桃", "无懈可击", "主公", "反贼", "忠臣", "内奸",
+    "233", "你好", "快点出牌", "ok", " ", "！", "？",
+  };
+  auto rng = benchRng();
+  std::vector<std::string> inputs(1024);
+  for (auto &str : inputs) {
+    int n = rng() % 24 + 1;
+    for (int i = 0; i < n; i++) {
+      str += pieces[rng() % std::size(pieces)];
+    }
+    if (!words.empty() && rng() % 10 == 0) {
+      str.insert(rng() % (str.size() + 1), words[rng() % words.size()]);
+    }
+  }
+
+  int mismatch = 0;
+  for (auto &str : inputs) {
+    if (linearBanWordCheck(words, str) == ac.matches(str)) mismatch++;
+  }
+
+  auto [linear_ns, linear_hits] = benchChecks(inputs, iterations,
+    [&](const std::string &s) { return !linearBanWordCheck(words, s); });
+  auto [ac_ns, ac_hits] = benchChecks(inputs, iterations,
+    [&](const std::string &s) { return ac.matches(s); });
+
+  spdlog::info("{} ban word(s), {} automaton state(s), {} iteration(s).",
+               ac.patternCount(), ac.stateCount(), iterations);
+  spdlog::info("linear scan: {:.1f} ns/check, {} hit(s)", linear_ns, linear_hits);
+  spdlog::info("automaton:   {:.1f} ns/check, {} hit(s)", ac_ns, ac_hits);
+  if (mismatch) {
+    spdlog::error("{} input(s) got different results!", mismatch);
+  }
+}
+
+// 原来的Sqlite3::checkString，只管字符，不管UTF-8
+static bool regexCheckString(const std::string_view &sv) {
+  static const std::regex exp(R"(['\";#* /\\?<>|:]+|(--)|(/\*)|(\*/)|(--\+))");
+  return !std::regex_search(sv.begin(), sv.end(), exp);
+}
+
+void Shell::benchCheckStringCommand(StringList &list) {
+  int iterations = list.empty() ? 100000 : atoi(list[0].c_str());
+  if (iterations <= 0) {
+    spdlog::warn("Usage: benchcheckstring [iterations]");
+    return;
+  }
+
+  // 用合法UTF-8片段拼，这样结果应当和正则完全一致；禁用字符和'-'给高一点的权重
+  static const char *pieces[] = {
+    "a", "Z", "0", "_", ".", "-", "+", "=", "@", "你", "好", "界", "é", "😀",
+    "'", "\"", ";", "#", "*", " ", "/", "\\", "?", "<", ">", "|", ":",
+  };
+  auto rng = benchRng();
+  auto gen = [&](int max_len) {
+    std::string str;
+    int n = rng() % max_len;
+    bool clean = rng() % 2;
+    for (int i = 0; i < n; i++) {
+      auto piece = pieces[rng() % (clean ? 14 : std::size(pieces))];
+      str += piece;
+    }
+    return str;
+  };
+
+  int mismatch = 0, rejected = 0;
+  for (int i = 0; i < iterations; i++) {
+    auto str = gen(i % 2 ? 12 : 80);
+    bool expected = regexCheckString(str);
+    if (!expected) rejected++;
+    if (Sqlite3::checkString(str) != expected) {
+      if (mismatch++ < 5) spdlog::error("checkString disagrees with regex on '{}'", str);
+    }
+  }
+
+  // 截断的多字节字符必须被拒绝
+  int invalid_passed = 0;
+  for (auto s : { "你好\xE4\xBD", "\xC0\x80", "\xED\xA0\x80", "\xF4\x90\x80\x80", "abc\x80", "\xFF" }) {
+    if (Sqlite3::checkString(s)) invalid_passed++;
+  }
+
+  std::vector<std::string> inputs(1024);
+  for (auto &str : inputs) str = gen(32);
+
+  auto [regex_ns, regex_ok] = benchChecks(inputs, iterations, regexCheckString);
+  auto [scan_ns, scan_ok] = benchChecks(inputs, iterations,
+    [](const std::string &s) { return Sqlite3::checkString(s); });
+
+  spdlog::info("fuzz: {} input(s), {} rejected, {} mismatch(es).", iterations, rejected, mismatch);
+  spdlog::info("regex:   {:.1f} ns/check, {} passed", regex_ns, regex_ok);
+  spdlog::info("scanner: {:.1f} ns/check, {} passed", scan_ns, scan_ok);
+  if (invalid_passed) {
+    spdlog::error("{} invalid UTF-8 input(s) passed checkString!", invalid_passed);
+  }
+}
+
+// 模拟重启后一大波人同时登录：n份用公钥加密的密码同时进来，
+// 对比在事件循环上直接解密（原来的做法）和丢进池子里，看每秒能过多少人，
+// 以及循环上每5ms一次的定时器被拖了多久，也就是已经在线的玩家感受到的延迟
+// 用的是shell线程上单独开的io_context，不去拖真正的主线程
+void Shell::benchLoginCommand(StringList &list) {
+  int n = list.empty() ? 500 : atoi(list[0].c_str());
+  if (n <= 0) {
+    spdlog::warn("Usage: benchlogin [logins]");
+    return;
+  }
+
+  RSA *pub = nullptr;
+  if (FILE *f = fopen("server/rsa_pub", "r")) {
+    pub = PEM_read_RSAPublicKey(f, NULL, NULL, NULL);
+    fclose(f);
+  }
+  if (!pub) {
+    spdlog::error("Cannot read server/rsa_pub.");
+    return;
+  }
+
+  // 和客户端一样，32字节AES key后面接密码
+  std::string plain = std::string(32, 'k') + "benchlogin";
+  std::vector<std::string> encrypted(n);
+  for (auto &enc : encrypted) {
+    enc.resize(RSA_size(pub));
+    RSA_public_encrypt(plain.size(), (const u_char *)plain.data(),
+                       (u_char *)enc.data(), pub, RSA_PKCS1_PADDING);
+  }
+  RSA_free(pub);
+
+  auto &server = Server::instance();
+  auto &auth = server.user_manager().auth();
+  std::string salt = "12345678", hash(64, '0');
+
+  struct Result {
+    double seconds = 0;
+    int ok = 0;
+    std::vector<double> lags;
+  };
+
+  using namespace std::chrono;
+  auto run = [&](bool pooled) {
+    Result r;
+    int remaining = n;
+    bool stop = false;
+    asio::io_context ctx;
+    auto start = steady_clock::now();
+
+    asio::co_spawn(ctx, [&]() -> asio::awaitable<void> {
+      asio::steady_timer timer { ctx };
+      while (!stop) {
+        auto expected = steady_clock::now() + 5ms;
+        timer.expires_at(expected);
+        co_await timer.async_wait(asio::use_awaitable);
+        r.lags.push_back(duration<double, std::milli>(steady_clock::now() - expected).count());
+      }
+    }, asio::detached);
+
+    for (auto &enc : encrypted) {
+      asio::co_spawn(ctx, [&]() -> asio::awaitable<void> {
+        std::string pw;
+        if (pooled) {
+          pw = co_await auth.decryptPassword(enc);
+          co_await auth.verifyPassword(pw.substr(std::min<size_t>(32, pw.size())), salt, hash);
+        } else {
+          pw = auth.decryptPasswordSync(enc);
+          auth.verifyPasswordSync(pw.substr(std::min<size_t>(32, pw.size())), salt, hash);
+        }
+        r.ok += pw == plain;
+        if (--remaining == 0) {
+          r.seconds = duration<double>(steady_clock::now() - start).count();
+          stop = true;
+        }
+      }, asio::detached);
+    }
+
+    // 池子做完会回到这个ctx上，全部跑完run()就返回了
+    ctx.run();
+    std::sort(r.lags.begin(), r.lags.end());
+    return r;
+  };
+
+  auto report = [&](const char *name, const Result &r) {
+    auto pct = [&](double p) {
+      return r.lags.empty() ? 0.0 : r.lags[std::min(r.lags.size() - 1, (size_t)(p * r.lags.size()))];
+    };
+    spdlog::info("{}: {:.0f} logins/s ({}/{} ok), event loop lag p50 {:.1f} ms, p99 {:.1f} ms, max {:.1f} ms",
+                 name, n / r.seconds, r.ok, n, pct(0.5), pct(0.99), r.lags.empty() ? 0.0 : r.lags.back());
+  };
+
+  spdlog::info("Simulating {} simultaneous login(s), {} auth thread(s)...", n,
+               std::max(server.config().authThreads, 1));
+  report("inline", run(false));
+  report("worker pool", run(true));
+}
+
 static void sigintHandler(int) {
   rl_reset_line_state();
   rl_replace_line("", 0);
@@ -832,6 +1200,11 @@ Shell::Shell() {
     {"gc", &Shell::statCommand},
     {"killroom", &Shell::killRoomCommand},
     {"checklobby", &Shell::checkLobbyCommand},
+    {"rpctrace", &Shell::rpcTraceCommand},
+    {"dbmaint", &Shell::dbMaintCommand},
+    {"benchbanword", &Shell::benchBanWordCommand},
+    {"benchcheckstring", &Shell::benchCheckStringCommand},
+    {"benchlogin", &Shell::benchLoginCommand},
     // special command
     {"quit", &Shell::helpCommand},
     {"crash", &Shell::helpCommand},
@@ -1019,7 +1392,7 @@ static char *user_generator(const char *text, int state) {
   const char *name;
 
   if (state == 0) {
-    arr = Server::instance().database().select("SELECT name FROM userinfo;");
+    arr = Server::instance().dbExecutor().selectSync("SELECT name FROM userinfo;");
     list_index = 0;
     len = strlen(text);
   }
@@ -1040,10 +1413,10 @@ static char *banned_user_generator(const char *text, int state) {
   static Sqlite3::QueryResult arr;
   static size_t list_index, len;
   const char *name;
-  auto &db = Server::instance().database();
+  auto &db = Server::instance().dbExecutor();
 
   if (state == 0) {
-    arr = db.select("SELECT name FROM userinfo WHERE banned = 1;");
+    arr = db.selectSync("SELECT name FROM userinfo WHERE banned = 1;");
     list_index = 0;
     len = strlen(text);
   }
@@ -50,6 +50,11 @@ private:
   void statCommand(StringList &);
   void killRoomCommand(StringList &);
   void checkLobbyCommand(StringList &);
+  void rpcTraceCommand(StringList &);
+  void dbMaintCommand(StringList &);
+  void benchBanWordCommand(StringList &);
+  void benchCheckStringCommand(StringList &);
+  void benchLoginCommand(StringList &);
 
 private:
   // QString syntaxHighlight(char *);
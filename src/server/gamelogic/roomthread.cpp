@@ -11,6 +11,7 @@
 #include "server/room/room_manager.h"
 #include "server/room/room.h"
 #include "server/rpc-lua/rpc-lua.h"
+#include "core/cpu_topology.h"
 
 #include <spdlog/spdlog.h>
 #include <sys/eventfd.h>
@@ -20,8 +21,9 @@
 namespace asio = boost::asio;
 using namespace std::literals;
 
-RoomThread::RoomThread(asio::io_context &main_ctx) : io_ctx {},
-  m_thread {} // 调用start后才有效
+RoomThread::RoomThread(asio::io_context &main_ctx, CpuPartition &cpu_partition) : io_ctx {},
+  m_thread {}, // 调用start后才有效
+  m_cpu_partition { cpu_partition }
 {
   static int nextThreadId = 1000;
   m_id = nextThreadId++;
@@ -32,53 +34,10 @@ RoomThread::RoomThread(asio::io_context &main_ctx) : io_ctx {},
 
   // 在run中创建，这样就能在接下来的exec中处理事件了
   // 这集可以直接在构造函数创了 Qt故事里面是为了绑定到新线程对应的eventLoop
-  L = std::make_unique<RpcLua>(io_ctx);
+  m_core = m_cpu_partition.acquireWorkerCore();
+  m_cpus = m_cpu_partition.workerCpus(m_core);
 
-  push_request_callback = [&](const std::string msg) {
-    // spdlog::debug("--> PushRequest {}" , msg);
-    L->call("HandleRequest", msg);
-  };
-  delay_callback = [&](int roomId, int ms) {
-    // spdlog::debug("--> Delay {} {}", roomId, ms);
-    auto timer = std::make_shared<asio::steady_timer>(io_ctx, std::chrono::milliseconds(ms));
-    timer->async_wait([weak = weak_from_this(), roomId, timer](const std::error_code& ec){
-      if (!ec) {
-        auto t = weak.lock();
-        if (!t) return;
-        t->L->call("ResumeRoom", roomId, "delay_done"sv);
-      } else {
-        spdlog::error("error in delay(): {}", ec.message());
-      }
-    });
-  };
-  wake_up_callback = [&](int roomId, const char *reason) {
-    // spdlog::debug("--> ResumeRoom {} {}", roomId, reason);
-    L->call("ResumeRoom", roomId, std::string_view { reason });
-  };
-
-  set_player_state_callback = [&](int connId, int pid, int roomId) {
-    auto &um = Server::instance().user_manager();
-    auto p = um.findPlayerByConnId(connId).lock();
-    if (!p) {
-      L->call("SetPlayerState", roomId, pid, Player::Offline);
-      return;
-    }
-
-    // spdlog::debug("--> SetPlayerState {}, {}, {}, {}", roomId, connId, p->getId(), p->getStateString());
-    L->call("SetPlayerState", roomId, p->getId(), p->getState());
-  };
-  add_observer_callback = [&](int connId, int roomId) {
-    auto &um = Server::instance().user_manager();
-    auto p = um.findPlayerByConnId(connId).lock();
-    if (!p) return;
-
-    // spdlog::debug("--> AddObserver {}, {}, {}", roomId, connId, p->getId());
-    L->call("AddObserver", roomId, RpcDispatchers::getPlayerObject(*p));
-  };
-  remove_observer_callback = [&](int pid, int roomId) {
-    // spdlog::debug("--> RemoveObserver {}, {}", roomId, pid);
-    L->call("RemoveObserver", roomId, pid);
-  };
+  L = std::make_unique<RpcLua>(io_ctx, m_cpus);
 
   start();
 }
@@ -86,6 +45,7 @@ RoomThread::RoomThread(asio::io_context &main_ctx) : io_ctx {},
 RoomThread::~RoomThread() {
   io_ctx.stop();
   m_thread.join();
+  m_cpu_partition.releaseWorkerCore(m_core);
   // spdlog::debug("[MEMORY] RoomThread {} destructed", m_id);
 }
 
@@ -100,6 +60,10 @@ asio::io_context &RoomThread::context() {
 void RoomThread::start() {
   evt_fd = ::eventfd(0, 0);
   m_thread = std::thread([&] {
+    if (!m_cpus.empty()) {
+      setCpuAffinity(0, m_cpus);
+    }
+
     // 直到调用quit()写evt_fd之前都让他一直等下去
     asio::posix::stream_descriptor eventfd_desc(io_ctx, evt_fd);
     char buf[16];
@@ -139,38 +103,171 @@ void RoomThread::shutdown() {
   }
 }
 
-void RoomThread::emit_signal(std::function<void()> f) {
+static int64_t steadyNowNs() {
+  using namespace std::chrono;
+  return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void RoomThread::emit_signal(Command &&cmd) {
+  if (m_lua_dead.load(std::memory_order_relaxed)) return;
+
+  cmd.enqueue_time = steadyNowNs();
+  m_queue.push(std::move(cmd));
+  m_enqueued.fetch_add(1, std::memory_order_relaxed);
+
+  // 已经有一次drain在排队了就不用再post了
+  if (!m_drain_scheduled.exchange(true, std::memory_order_acq_rel)) {
+    asio::post(io_ctx, [weak = weak_from_this()] {
+      auto t = weak.lock();
+      if (t) t->drainQueue();
+    });
+  }
+}
+
+void RoomThread::drainQueue() {
+  // 先清标记再取，这样取的过程中新来的命令一定会再触发一次drain
+  m_drain_scheduled.store(false, std::memory_order_release);
+
+  // 子进程死没死要查一次/proc，每批看一次就够了
   if (!L->alive()) {
-    spdlog::error("Lua is not working ({}). Shutting down thread {}.", L->getConnectionInfo(), m_id);
-    shutdown();
+    if (!m_lua_dead.exchange(true)) {
+      spdlog::error("Lua is not working ({}). Shutting down thread {}.", L->getConnectionInfo(), m_id);
+      // shutdown要动房间，交给主线程
+      asio::post(Server::instance().context(), [weak = weak_from_this()] {
+        auto t = weak.lock();
+        if (t) t->shutdown();
+      });
+    }
+    Command cmd;
+    while (m_queue.pop(cmd)) m_dequeued.fetch_add(1, std::memory_order_relaxed);
     return;
   }
 
-  asio::dispatch(io_ctx, f);
+  auto depth = m_enqueued.load(std::memory_order_relaxed) - m_dequeued.load(std::memory_order_relaxed);
+  if (depth > m_max_depth.load(std::memory_order_relaxed)) {
+    m_max_depth.store(depth, std::memory_order_relaxed);
+  }
+
+  // 一批最多处理这么多，剩下的让给定时器等其他事件之后再来
+  static constexpr int max_batch = 128;
+  Command cmd;
+  int n = 0;
+  for (; n < max_batch && m_queue.pop(cmd); n++) {
+    uint64_t latency = steadyNowNs() - cmd.enqueue_time;
+    m_total_latency_ns.fetch_add(latency, std::memory_order_relaxed);
+    if (latency > m_max_latency_ns.load(std::memory_order_relaxed)) {
+      m_max_latency_ns.store(latency, std::memory_order_relaxed);
+    }
+    m_dequeued.fetch_add(1, std::memory_order_relaxed);
+
+    handleCommand(cmd);
+    cmd.request.clear();
+  }
+  if (n > 0) m_batches.fetch_add(1, std::memory_order_relaxed);
+
+  if (n == max_batch && !m_drain_scheduled.exchange(true, std::memory_order_acq_rel)) {
+    asio::post(io_ctx, [weak = weak_from_this()] {
+      auto t = weak.lock();
+      if (t) t->drainQueue();
+    });
+  }
+}
+
+// Lua那边目前没有批量调用的接口，只能一条条call；以后有了可以在drainQueue里合并
+void RoomThread::handleCommand(Command &cmd) {
+  switch (cmd.type) {
+  case Command::PushRequest:
+    // spdlog::debug("--> PushRequest {}" , cmd.request);
+    L->call("HandleRequest", cmd.request);
+    break;
+
+  case Command::Delay: {
+    // spdlog::debug("--> Delay {} {}", cmd.roomId, cmd.ms);
+    auto roomId = cmd.roomId;
+    auto timer = std::make_shared<asio::steady_timer>(io_ctx, std::chrono::milliseconds(cmd.ms));
+    timer->async_wait([weak = weak_from_this(), roomId, timer](const std::error_code& ec){
+      if (!ec) {
+        auto t = weak.lock();
+        if (!t) return;
+        t->L->call("ResumeRoom", roomId, "delay_done"sv);
+      } else {
+        spdlog::error("error in delay(): {}", ec.message());
+      }
+    });
+    break;
+  }
+
+  case Command::WakeUp:
+    // spdlog::debug("--> ResumeRoom {} {}", cmd.roomId, cmd.reason);
+    L->call("ResumeRoom", cmd.roomId, std::string_view { cmd.reason });
+    break;
+
+  case Command::SetPlayerState: {
+    auto &um = Server::instance().user_manager();
+    auto p = um.findPlayerByConnId(cmd.connId).lock();
+    if (!p) {
+      L->call("SetPlayerState", cmd.roomId, cmd.pid, Player::Offline);
+      break;
+    }
+
+    // spdlog::debug("--> SetPlayerState {}, {}, {}, {}", cmd.roomId, cmd.connId, p->getId(), p->getStateString());
+    L->call("SetPlayerState", cmd.roomId, p->getId(), p->getState());
+    break;
+  }
+
+  case Command::AddObserver: {
+    auto &um = Server::instance().user_manager();
+    auto p = um.findPlayerByConnId(cmd.connId).lock();
+    if (!p) break;
+
+    // spdlog::debug("--> AddObserver {}, {}, {}", cmd.roomId, cmd.connId, p->getId());
+    L->call("AddObserver", cmd.roomId, RpcDispatchers::getPlayerObject(*p));
+    break;
+  }
+
+  case Command::RemoveObserver:
+    // spdlog::debug("--> RemoveObserver {}, {}", cmd.roomId, cmd.pid);
+    L->call("RemoveObserver", cmd.roomId, cmd.pid);
+    break;
+  }
 }
 
-void RoomThread::pushRequest(const std::string &req) {
-  emit_signal([=, this] { push_request_callback(req); });
+void RoomThread::pushRequest(std::string req) {
+  emit_signal({ .type = Command::PushRequest, .request = std::move(req) });
 }
 
 void RoomThread::delay(int roomId, int ms) {
-  emit_signal([=, this] { delay_callback(roomId, ms); });
+  emit_signal({ .type = Command::Delay, .roomId = roomId, .ms = ms });
 }
 
 void RoomThread::wakeUp(int roomId, const char *reason) {
-  emit_signal([=, this] { wake_up_callback(roomId, reason); });
+  emit_signal({ .type = Command::WakeUp, .roomId = roomId, .reason = reason });
 }
 
 void RoomThread::setPlayerState(int connId, int pid, int roomId) {
-  emit_signal([=, this] { set_player_state_callback(connId, pid, roomId); });
+  emit_signal({ .type = Command::SetPlayerState, .roomId = roomId, .connId = connId, .pid = pid });
 }
 
 void RoomThread::addObserver(int connId, int roomId) {
-  emit_signal([=, this] { add_observer_callback(connId, roomId); });
+  emit_signal({ .type = Command::AddObserver, .roomId = roomId, .connId = connId });
 }
 
 void RoomThread::removeObserver(int pid, int roomId) {
-  emit_signal([=, this] { remove_observer_callback(pid, roomId); });
+  emit_signal({ .type = Command::RemoveObserver, .roomId = roomId, .pid = pid });
+}
+
+RoomThread::QueueStats RoomThread::getQueueStats() const {
+  auto enqueued = m_enqueued.load(std::memory_order_relaxed);
+  auto dequeued = m_dequeued.load(std::memory_order_relaxed);
+  return {
+    .depth = enqueued > dequeued ? enqueued - dequeued : 0,
+    .max_depth = m_max_depth.load(std::memory_order_relaxed),
+    .processed = dequeued,
+    .batches = m_batches.load(std::memory_order_relaxed),
+    .avg_latency_us = dequeued == 0 ? 0.0 :
+      (double)m_total_latency_ns.load(std::memory_order_relaxed) / dequeued / 1000,
+    .max_latency_us = (double)m_max_latency_ns.load(std::memory_order_relaxed) / 1000,
+  };
 }
 
 const RpcLua &RoomThread::getLua() const {
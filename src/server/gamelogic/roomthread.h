@@ -2,14 +2,18 @@
 
 #pragma once
 
+#include "core/mpsc_queue.h"
+
 class Room;
 class RpcLua;
+class CpuPartition;
 
 class RoomThread : public std::enable_shared_from_this<RoomThread> {
 public:
   using io_context = boost::asio::io_context;
 
-  explicit RoomThread(io_context &main_ctx);
+  // 析构可能发生在~Server里，那时Server::instance()已经不能用了，所以直接把CpuPartition传进来
+  RoomThread(io_context &main_ctx, CpuPartition &cpu_partition);
   RoomThread(RoomThread &) = delete;
   RoomThread(RoomThread &&) = delete;
   ~RoomThread();
@@ -20,7 +24,7 @@ public:
   void quit();
 
   // signal emitters
-  void pushRequest(const std::string &req);
+  void pushRequest(std::string req);
   void delay(int roomId, int ms);
   void wakeUp(int roomId, const char *reason);
 
@@ -30,6 +34,17 @@ public:
 
   const RpcLua &getLua() const;
 
+  // 命令队列的统计信息，给shell的stat用
+  struct QueueStats {
+    uint64_t depth;
+    uint64_t max_depth;
+    uint64_t processed;
+    uint64_t batches;
+    double avg_latency_us;
+    double max_latency_us;
+  };
+  QueueStats getQueueStats() const;
+
   bool isFull() const;
 
   int getCapacity() const;
@@ -55,18 +70,52 @@ private:
 
   std::unique_ptr<RpcLua> L;
 
+  CpuPartition &m_cpu_partition;
+  // 绑定的工作核心，-1表示不绑
+  int m_core = -1;
+  std::vector<int> m_cpus;
+
   void start();
   void shutdown();
 
   // signals
-  std::function<void(const std::string req)> push_request_callback = nullptr;
-  std::function<void(int roomId, int ms)> delay_callback = nullptr;
-  std::function<void(int roomId, const char* reason)> wake_up_callback = nullptr;
-  std::function<void(int connId, int pid, int roomId)> set_player_state_callback = nullptr;
-  std::function<void(int connId, int roomId)> add_observer_callback = nullptr;
-  std::function<void(int pid, int roomId)> remove_observer_callback = nullptr;
-
-  void emit_signal(std::function<void()> f);
+  // 以前每个信号都是一个std::function丢给asio::dispatch，现在统一塞进定长的命令队列
+  // 由RoomThread成批取出处理
+  struct Command {
+    enum Type : uint8_t {
+      PushRequest,
+      Delay,
+      WakeUp,
+      SetPlayerState,
+      AddObserver,
+      RemoveObserver,
+    };
+
+    Type type;
+    int roomId;
+    int connId;
+    int pid;
+    int ms;
+    const char *reason;   // 总是字符串字面量
+    std::string request;  // 仅PushRequest，move进来
+    int64_t enqueue_time; // steady_clock, ns
+  };
+
+  MpscQueue<Command, 1024> m_queue;
+  std::atomic<bool> m_drain_scheduled { false };
+  // drainQueue发现Lua子进程没了之后置上，之后的命令直接丢掉
+  std::atomic<bool> m_lua_dead { false };
+
+  std::atomic<uint64_t> m_enqueued { 0 };
+  std::atomic<uint64_t> m_dequeued { 0 };
+  std::atomic<uint64_t> m_max_depth { 0 };
+  std::atomic<uint64_t> m_batches { 0 };
+  std::atomic<uint64_t> m_total_latency_ns { 0 };
+  std::atomic<uint64_t> m_max_latency_ns { 0 };
+
+  void emit_signal(Command &&cmd);
+  void drainQueue();
+  void handleCommand(Command &cmd);
 
   int m_capacity;
   // 为什么不直接用智能指针呢，算了，这个值表示当前引用它的房间数量
@@ -519,52 +519,7 @@ static _rpcRet _rpc_Player_getGlobalSaveState(const JsonRpcPacket &packet) {
 // 收官：getRoom
 
 std::string RpcDispatchers::getPlayerObject(Player &p) {
-  std::string ret;
-  ret.reserve(256);
-
-  u_char buf[10]; size_t buflen;
-
-  ret.push_back('\xA7');
-  ret += "\x46" "connId";
-  buflen = cbor_encode_uint(p.getConnId(), buf, 10);
-  ret += std::string_view { (char *)buf, buflen };
-
-  ret += "\x42id";
-  buflen = cbor_encode_uint(p.getId(), buf, 10);
-  ret += std::string_view { (char *)buf, buflen };
-
-  ret += "\x4AscreenName";
-  auto screenName = p.getScreenName();
-  buflen = cbor_encode_uint(screenName.size(), buf, 10);
-  buf[0] += 0x40;
-  ret += std::string_view { (char *)buf, buflen };
-  ret += screenName;
-
-  ret += "\x46" "avatar";
-  auto avatar = p.getAvatar();
-  buflen = cbor_encode_uint(avatar.size(), buf, 10);
-  buf[0] += 0x40;
-  ret += std::string_view { (char *)buf, buflen };
-  ret += avatar;
-
-  ret += "\x4DtotalGameTime";
-  buflen = cbor_encode_uint(p.getTotalGameTime(), buf, 10);
-  ret += std::string_view { (char *)buf, buflen };
-
-  ret += "\x45state";
-  buflen = cbor_encode_uint(p.getState(), buf, 10);
-  ret += std::string_view { (char *)buf, buflen };
-
-  ret += "\x48gameData";
-  ret += "\x83";
-  buflen = cbor_encode_uint(p.getGameData()[0], buf, 10);
-  ret += std::string_view { (char *)buf, buflen };
-  buflen = cbor_encode_uint(p.getGameData()[1], buf, 10);
-  ret += std::string_view { (char *)buf, buflen };
-  buflen = cbor_encode_uint(p.getGameData()[2], buf, 10);
-  ret += std::string_view { (char *)buf, buflen };
-
-  return ret;
+  return p.getCborObject();
 }
 
 static _rpcRet _rpc_RoomThread_getRoom(const JsonRpcPacket &packet) {
@@ -601,7 +556,7 @@ static _rpcRet _rpc_RoomThread_getRoom(const JsonRpcPacket &packet) {
   auto &um = Server::instance().user_manager();
   for (auto pid : pids) {
     auto p = um.findPlayerByConnId(pid).lock();
-    if (p) ret += RpcDispatchers::getPlayerObject(*p);
+    if (p) p->appendCborObject(ret);
   }
 
   ret += "\x47ownerId";
@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "server/room/general_stats.h"
+#include "server/server.h"
+#include "core/c-wrapper.h"
+#include "core/db_executor.h"
+
+namespace asio = boost::asio;
+using asio::awaitable;
+using asio::use_awaitable;
+using asio::redirect_error;
+
+static constexpr const char *upsertGWinRate = ("INSERT INTO gWinRate "
+            "(general, mode, role, win, lose, draw) "
+            "VALUES (?, ?, ?, ?, ?, ?) "
+            "ON CONFLICT(general, mode, role) DO UPDATE SET "
+            "win = win + excluded.win, lose = lose + excluded.lose, "
+            "draw = draw + excluded.draw;");
+
+size_t GeneralStats::KeyHash::operator()(const Key &k) const {
+  std::hash<std::string> h;
+  size_t seed = h(k.general);
+  seed ^= h(k.mode) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+  seed ^= h(k.role) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+  return seed;
+}
+
+void GeneralStats::add(const std::string_view &general, const std::string_view &mode,
+                       const std::string_view &role, int result) {
+  Key key { std::string(general), std::string(mode), std::string(role) };
+  auto &shard = m_shards[KeyHash {}(key) % ShardCount];
+  {
+    std::lock_guard<std::mutex> lock { shard.mutex };
+    auto &rec = shard.table[std::move(key)];
+    switch (result) {
+    case 1: rec.win++; break;
+    case 2: rec.lose++; break;
+    case 3: rec.draw++; break;
+    default: break;
+    }
+  }
+
+  // 崩服时最多丢maxPending条，攒够了就不等定时器了
+  auto maxPending = m_max_pending.load(std::memory_order_relaxed);
+  if (m_pending.fetch_add(1, std::memory_order_relaxed) + 1 == maxPending) {
+    flush();
+  }
+}
+
+void GeneralStats::applyConfig(const ServerConfig &conf) {
+  m_max_pending = (size_t)std::max(conf.generalStatsMaxPending, 1);
+  m_flush_interval = std::max(conf.generalStatsFlushInterval, 1);
+}
+
+void GeneralStats::start(asio::io_context &ctx) {
+  m_timer = std::make_unique<asio::steady_timer>(ctx);
+  asio::co_spawn(ctx, flushLoop(), asio::detached);
+}
+
+void GeneralStats::stop() {
+  if (m_timer) m_timer->cancel();
+}
+
+awaitable<void> GeneralStats::flushLoop() {
+  for (;;) {
+    // 每轮都重新取，reloadConfig之后下一轮生效
+    m_timer->expires_after(std::chrono::seconds(m_flush_interval.load()));
+    boost::system::error_code ec;
+    co_await m_timer->async_wait(redirect_error(use_awaitable, ec));
+    if (ec) break;
+
+    flush();
+  }
+}
+
+void GeneralStats::flush() {
+  flush(Server::instance().dbExecutor());
+}
+
+void GeneralStats::flush(DbExecutor &db) {
+  m_pending = 0;
+
+  std::vector<std::pair<Key, Record>> batch;
+  for (auto &shard : m_shards) {
+    Table table;
+    {
+      std::lock_guard<std::mutex> lock { shard.mutex };
+      table.swap(shard.table);
+    }
+    for (auto &[key, rec] : table) {
+      batch.emplace_back(key, rec);
+    }
+  }
+
+  if (batch.empty()) return;
+
+  // post进去的写入本身就会被合并在一个事务里
+  db.post([batch = std::move(batch)](Sqlite3 &db) {
+    for (auto &[key, rec] : batch) {
+      db.execute(upsertGWinRate, { key.general, key.mode, key.role,
+                                   rec.win, rec.lose, rec.draw });
+    }
+  });
+}
+
+size_t GeneralStats::pendingCount() const {
+  return m_pending;
+}
@@ -0,0 +1,63 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+class DbExecutor;
+struct ServerConfig;
+
+// 武将胜率（gWinRate）的增量计数器
+// 每局结束只在内存里累加，每隔一段时间把所有增量用一个事务UPSERT进去
+// 按key分片加锁，RoomThread之间基本不会抢同一把锁
+class GeneralStats {
+public:
+  GeneralStats() = default;
+  GeneralStats(GeneralStats &) = delete;
+  GeneralStats(GeneralStats &&) = delete;
+
+  // 任意线程；result: 1胜 2负 3平
+  void add(const std::string_view &general, const std::string_view &mode,
+           const std::string_view &role, int result);
+
+  // 主线程，每次换了config都调一次；add在RoomThread上跑，不能直接读config
+  void applyConfig(const ServerConfig &conf);
+
+  // 主线程，开始按配置的间隔定时写回
+  void start(boost::asio::io_context &ctx);
+  void stop();
+
+  // 把目前攒下的增量交给DB线程
+  void flush();
+  // 关服用，这时候Server::instance()已经不能用了
+  void flush(DbExecutor &db);
+
+  size_t pendingCount() const;
+
+private:
+  static constexpr size_t ShardCount = 16;
+
+  struct Key {
+    std::string general;
+    std::string mode;
+    std::string role;
+    bool operator==(const Key &) const = default;
+  };
+  struct KeyHash {
+    size_t operator()(const Key &k) const;
+  };
+  struct Record { int win = 0; int lose = 0; int draw = 0; };
+  using Table = std::unordered_map<Key, Record, KeyHash>;
+
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    Table table;
+  };
+
+  std::array<Shard, ShardCount> m_shards;
+  // 上次写回以来的更新次数，超过maxPending就提前写回
+  std::atomic<size_t> m_pending = 0;
+  std::atomic<size_t> m_max_pending = 5000;
+  std::atomic<int> m_flush_interval = 60;   // 秒
+
+  std::unique_ptr<boost::asio::steady_timer> m_timer;
+  boost::asio::awaitable<void> flushLoop();
+};
@@ -5,10 +5,13 @@
 #include "server/user/player.h"
 #include "server/user/user_manager.h"
 #include "server/room/room_manager.h"
+#include "server/room/room_list.h"
 #include "server/room/room.h"
 #include "network/client_socket.h"
+#include "network/router.h"
 
 #include "core/c-wrapper.h"
+#include "core/db_executor.h"
 #include "core/util.h"
 
 #include <openssl/sha.h>
@@ -37,20 +40,66 @@ void Lobby::addPlayer(Player &player) {
 
 void Lobby::removePlayer(Player &player) {
   auto connId = player.getConnId();
+  Server::instance().room_manager().roomList().unsubscribe(connId);
   // spdlog::debug("[LOBBY_REMOVEPLAYER] Player {} (connId={}, state={})", player.getId(), player.getConnId(), player.getStateString());
   players.erase(connId);
   updateOnlineInfo();
 }
 
 void Lobby::updateOnlineInfo() {
-  auto &um = Server::instance().user_manager();
-  auto arr = Cbor::encodeArray({
-    players.size(),
-    um.getPlayers().size(),
+  m_online_info_dirty = true;
+  scheduleNotify();
+}
+
+void Lobby::announce(std::string msg) {
+  m_announcements.push_back(std::move(msg));
+  scheduleNotify();
+}
+
+void Lobby::scheduleNotify() {
+  if (m_notify_scheduled) return;
+  m_notify_scheduled = true;
+
+  auto &server = Server::instance();
+  if (!m_notify_timer) {
+    m_notify_timer = std::make_unique<boost::asio::steady_timer>(server.context());
+  }
+
+  // 距上次发送已经超过间隔的话expires_at在过去，下一轮事件循环就发，
+  // 同一轮里的进出照样合并
+  auto interval = std::chrono::milliseconds(std::max(server.config().onlineInfoInterval, 0));
+  m_notify_timer->expires_at(m_last_notify + interval);
+  m_notify_timer->async_wait([this](const boost::system::error_code &ec) {
+    // 关服时timer随Lobby析构，这里不能再碰this
+    if (ec) return;
+    sendNotify();
   });
+}
+
+void Lobby::sendNotify() {
+  m_notify_scheduled = false;
+  m_last_notify = std::chrono::steady_clock::now();
+
+  auto &server = Server::instance();
+  auto &um = server.user_manager();
+
+  for (auto &msg : m_announcements) {
+    server.broadcast("ServerMessage", msg);
+  }
+  m_announcements.clear();
+
+  if (!m_online_info_dirty) return;
+  m_online_info_dirty = false;
+
+  auto frame = std::make_shared<std::string>(Router::encodeNotification(
+    "UpdatePlayerNum", Cbor::encodeArray({
+      players.size(),
+      um.getPlayers().size(),
+    })
+  ));
   for (auto &[pid, _] : players) {
     auto p = um.findPlayerByConnId(pid).lock();
-    if (p) p->doNotify("UpdatePlayerNum", arr);
+    if (p) p->sendFrame(frame);
   }
 }
 
@@ -89,7 +138,7 @@ void Lobby::updateAvatar(Player &sender, const Packet &packet) {
   if (avatar == "") return;
 
   if (!Sqlite3::checkString(avatar)) return;
-  Server::instance().database().exec(
+  Server::instance().dbExecutor().exec(
     fmt::format(
       "UPDATE userinfo SET avatar='{}' WHERE id={};",
       avatar,
@@ -127,32 +176,37 @@ void Lobby::updatePassword(Player &sender, const Packet &packet) {
   if (newpw == "") return;
 
 
-  auto passed = false;
-  auto &db = Server::instance().database();
-  auto arr2 = db.select(fmt::format(
-    "SELECT password, salt FROM userinfo WHERE id={};", sender.getId()));
-  auto result = arr2[0];
+  auto &db = Server::instance().dbExecutor();
+  auto sql = fmt::format("SELECT password, salt FROM userinfo WHERE id={};", sender.getId());
+  db.select(sql, [weak = sender.weak_from_this(), oldpw = std::string(oldpw),
+            newpw = std::string(newpw)](Sqlite3::QueryResult arr2) {
+    auto sender = weak.lock();
+    if (!sender || arr2.empty()) return;
 
-  auto pw = std::string(oldpw) + result["salt"];
-  unsigned char hash[SHA256_DIGEST_LENGTH];
-  SHA256((const u_char *)pw.data(), pw.size(), hash);
+    auto passed = false;
+    auto result = arr2[0];
 
-  passed = (result["password"] == toHex(std::string_view { (char*)hash, SHA256_DIGEST_LENGTH }));
-  if (passed) {
-    auto pw2 = std::string(newpw) + result["salt"];
+    auto pw = oldpw + result["salt"];
     unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256((const u_char *)pw2.data(), pw2.size(), hash);
+    SHA256((const u_char *)pw.data(), pw.size(), hash);
 
-    auto sql = fmt::format(
-      "UPDATE userinfo SET password='{}' WHERE id={};",
-      toHex(std::string_view { (char*)hash, SHA256_DIGEST_LENGTH }),
-      sender.getId()
-    );
+    passed = (result["password"] == toHex(std::string_view { (char*)hash, SHA256_DIGEST_LENGTH }));
+    if (passed) {
+      auto pw2 = newpw + result["salt"];
+      unsigned char hash[SHA256_DIGEST_LENGTH];
+      SHA256((const u_char *)pw2.data(), pw2.size(), hash);
 
-    db.exec(sql);
-  }
+      auto sql = fmt::format(
+        "UPDATE userinfo SET password='{}' WHERE id={};",
+        toHex(std::string_view { (char*)hash, SHA256_DIGEST_LENGTH }),
+        sender->getId()
+      );
+
+      Server::instance().dbExecutor().exec(sql);
+    }
 
-  sender.doNotify("UpdatePassword", passed ? "1" : "0");
+    sender->doNotify("UpdatePassword", passed ? "1" : "0");
+  });
 }
 
 void Lobby::createRoom(Player &sender, const Packet &packet) {
@@ -259,46 +313,49 @@ void Lobby::observeRoom(Player &sender, const Packet &pkt) {
   joinRoom(sender, pkt, true);
 }
 
-void Lobby::refreshRoomList(Player &sender, const Packet &) {
-  auto &rm = Server::instance().room_manager();
+// 老客户端不带参数，发完整列表（缓存好的）
+// 新客户端可以带 [页码, 每页个数, 模式(可选)]，回复UpdateRoomListPage
+void Lobby::refreshRoomList(Player &sender, const Packet &pkt) {
+  auto &list = Server::instance().room_manager().roomList();
 
-  auto &rooms = rm.getRooms();
-
-  // 拼好cbor 首先拼一个头
-  std::ostringstream oss;
-
-  size_t sz = rooms.size();
-  char buf[10];
-  size_t len = cbor_encode_uint(sz, (cbor_mutable_data)buf, 10);
-  buf[0] += 0x80; // uint -> array header
-
-  oss << std::string_view { buf, len };
-
-  for (auto &[_, room] : rooms) {
-    if (room->isFull()) continue;
-    oss << Cbor::encodeArray({
-      room->getId(),
-      room->getName().data(),
-      room->getGameMode().data(),
-      room->getPlayers().size(),
-      room->getCapacity(),
-      !room->getPassword().empty(),
-      room->isOutdated(),
-    });
+  auto cbuf = (cbor_data)pkt.cborData.data();
+  auto len = pkt.cborData.size();
+  size_t sz = 0;
+  int page = 0, pageSize = 0;
+  std::string_view mode;
+
+  cbor_decoder_result result;
+  result = cbor_stream_decode(cbuf, len, &Cbor::arrayCallbacks, &sz);
+  if (result.read == 0 || sz < 2 || sz > 3) {
+    sender.doNotify("UpdateRoomList", list.fullList());
+    return;
   }
-  for (auto &[_, room] : rooms) {
-    if (!room->isFull()) continue;
-    oss << Cbor::encodeArray({
-      room->getId(),
-      room->getName().data(),
-      room->getGameMode().data(),
-      room->getPlayers().size(),
-      room->getCapacity(),
-      !room->getPassword().empty(),
-      room->isOutdated(),
-    });
+  cbuf += result.read; len -= result.read;
+
+  result = cbor_stream_decode(cbuf, len, &Cbor::intCallbacks, &page);
+  if (result.read == 0) return;
+  cbuf += result.read; len -= result.read;
+
+  result = cbor_stream_decode(cbuf, len, &Cbor::intCallbacks, &pageSize);
+  if (result.read == 0) return;
+  cbuf += result.read; len -= result.read;
+
+  if (sz == 3) {
+    result = cbor_stream_decode(cbuf, len, &Cbor::stringCallbacks, &mode);
+    if (result.read == 0) return;
   }
-  sender.doNotify("UpdateRoomList", oss.str());
+
+  sender.doNotify("UpdateRoomListPage", list.page(page, pageSize, mode));
+}
+
+// 参数为模式名，空串为全部；之后房间有变化时推送UpdateRoomListDelta，离开大厅自动取消
+void Lobby::subscribeRoomList(Player &sender, const Packet &pkt) {
+  auto cbuf = (cbor_data)pkt.cborData.data();
+  auto len = pkt.cborData.size();
+  std::string_view mode;
+  cbor_stream_decode(cbuf, len, &Cbor::stringCallbacks, &mode);
+
+  Server::instance().room_manager().roomList().subscribe(sender, mode);
 }
 
 typedef void (Lobby::*room_cb)(Player &, const Packet &);
@@ -311,6 +368,7 @@ void Lobby::handlePacket(Player &sender, const Packet &packet) {
     {"EnterRoom", &Lobby::enterRoom},
     {"ObserveRoom", &Lobby::observeRoom},
     {"RefreshRoomList", &Lobby::refreshRoomList},
+    {"SubscribeRoomList", &Lobby::subscribeRoomList},
     {"Chat", &Lobby::chat},
   };
 
@@ -12,6 +12,12 @@ private:
   // connId -> true
   std::unordered_map<int, bool> players;
 
+  std::unique_ptr<boost::asio::steady_timer> m_notify_timer;
+  std::chrono::steady_clock::time_point m_last_notify;
+  bool m_notify_scheduled = false;
+  bool m_online_info_dirty = false;
+  std::vector<std::string> m_announcements;
+
 public:
   Lobby();
   Lobby(Lobby &) = delete;
@@ -23,7 +29,11 @@ public:
   void removePlayer(Player &player) final;
   void handlePacket(Player &sender, const Packet &packet) final;
 
+  // 人数更新和上下线提示都是节流的：最多每onlineInfoInterval毫秒发一次，
+  // 只发最新的人数，同一条消息编码一次所有人共用
   void updateOnlineInfo();
+  // 原来的"xxx logged in"之类，发给所有在线玩家
+  void announce(std::string msg);
 
   void checkAbandoned();
 
@@ -35,6 +45,10 @@ private:
   void enterRoom(Player &, const Packet &);
   void observeRoom(Player &, const Packet &);
   void refreshRoomList(Player &, const Packet &);
+  void subscribeRoomList(Player &, const Packet &);
 
   void joinRoom(Player &, const Packet &, bool ob = false);
+
+  void scheduleNotify();
+  void sendNotify();
 };
@@ -3,20 +3,23 @@
 #include "server/room/room.h"
 #include "server/room/lobby.h"
 #include "server/room/room_manager.h"
+#include "server/room/room_list.h"
+#include "server/room/general_stats.h"
 #include "server/gamelogic/roomthread.h"
 #include "network/client_socket.h"
 #include "network/router.h"
 #include "server/server.h"
 #include "server/user/player.h"
 #include "server/user/user_manager.h"
+#include "server/user/player_stats.h"
 #include "core/c-wrapper.h"
+#include "core/db_executor.h"
 #include "core/util.h"
 
 namespace asio = boost::asio;
 
-Room::Room() {
-  static int nextRoomId = 1;
-  id = nextRoomId++;
+Room::Room(int id) {
+  this->id = id;
 
   m_thread_id = 1000;
 
@@ -134,7 +137,7 @@ bool Room::isAbandoned() const {
   auto &um = Server::instance().user_manager();
   for (auto connId : players) {
     auto p = um.findPlayerByConnId(connId).lock();
-    if (p && p->getRouter().getSocket() != nullptr)
+    if (p && p->isOnline())
       return false;
   }
   return true;
@@ -177,6 +180,7 @@ void Room::addPlayer(Player &player) {
 
   players.push_back(player.getConnId());
   player.setRoom(*this);
+  Server::instance().room_manager().roomList().update(*this);
   // spdlog::debug("[ROOM_ADDPLAYER] Player {} (connId={}, state={}) added to room {}", player.getId(), player.getConnId(), player.getStateString(), id);
 
   // 这集不用信号；这个信号是把玩家从大厅删除的
@@ -236,9 +240,10 @@ void Room::addRobot(Player &player) {
     return;
 
   auto &um = Server::instance().user_manager();
-  auto &robot = um.createRobot();
+  auto robot = um.createRobot();
+  if (!robot) return;
 
-  addPlayer(robot);
+  addPlayer(*robot);
 }
 
 void Room::createRunnedPlayer(Player &player, std::shared_ptr<ClientSocket> socket) {
@@ -256,7 +261,13 @@ void Room::createRunnedPlayer(Player &player, std::shared_ptr<ClientSocket> sock
 
   // 最后向服务器玩家列表中增加这个人
   // 原先的跑路机器人会在游戏结束后自动销毁掉
-  um.addPlayer(runner);
+  if (!um.addPlayer(runner)) {
+    if (socket) {
+      Server::instance().sendEarlyPacket(*socket, "ErrorDlg", "server is full!");
+      socket->disconnectFromHost();
+    }
+    return;
+  }
 
   Server::instance().room_manager().lobby().lock()->addPlayer(*runner);
 
@@ -292,9 +303,9 @@ void Room::removePlayer(Player &player) {
     doBroadcastNotify(players, "RemovePlayer", Cbor::encodeArray({ player.getId() }));
   } else {
     // 首先拿到跑路玩家的socket，然后把玩家的状态设为逃跑，这样自动被机器人接管
-    auto socket = player.getRouter().getSocket();
+    auto socket = player.getSocket();
     player.setState(Player::Run);
-    player.getRouter().setSocket(nullptr);
+    if (socket) player.getRouter().setSocket(nullptr);
 
     if (!player.isDied()) {
       player.setRunned(true);
@@ -310,6 +321,8 @@ void Room::removePlayer(Player &player) {
     createRunnedPlayer(player, socket);
   }
 
+  Server::instance().room_manager().roomList().update(*this);
+
   if (isAbandoned()) {
     m_owner_conn_id = 0;
     checkAbandoned(NoHuman);
@@ -427,6 +440,8 @@ void Room::_checkAbandoned(CheckAbandonReason reason) {
     players.erase(std::remove_if(players.begin(), players.end(), [&](int x) {
       return std::find(to_delete.begin(), to_delete.end(), x) != to_delete.end();
     }), players.end());
+    // 房间还留着的话大厅列表里的人数得跟着变；删房时removeRoom会自己处理
+    if (!to_delete.empty()) Server::instance().room_manager().roomList().update(*this);
   }
 
   if (!isAbandoned()) return;
@@ -440,71 +455,16 @@ void Room::_checkAbandoned(CheckAbandonReason reason) {
   rm.removeRoom(id);
 }
 
-static constexpr const char *findPWinRate = "SELECT win, lose, draw "
-            "FROM pWinRate WHERE id = {} and mode = '{}' and role = '{}';";
-
-static constexpr const char *updatePWinRate = ("UPDATE pWinRate "
-            "SET win = {}, lose = {}, draw = {} "
-            "WHERE id = {} and mode = '{}' and role = '{}';");
-
-static constexpr const char *insertPWinRate = ("INSERT INTO pWinRate "
-            "(id, mode, role, win, lose, draw) "
-            "VALUES ({}, '{}', '{}', {}, {}, {});");
-
-static constexpr const char *findGWinRate = ("SELECT win, lose, draw "
-            "FROM gWinRate WHERE general = '{}' and mode = '{}' and role = '{}';");
-
-static constexpr const char *updateGWinRate = ("UPDATE gWinRate "
-            "SET win = {}, lose = {}, draw = {} "
-            "WHERE general = '{}' and mode = '{}' and role = '{}';");
-
-static constexpr const char *insertGWinRate = ("INSERT INTO gWinRate "
-            "(general, mode, role, win, lose, draw) "
-            "VALUES ('{}', '{}', '{}', {}, {}, {});");
-
-static constexpr const char *findRunRate = ("SELECT run "
-      "FROM runRate WHERE id = {} and mode = '{}';");
-
-static constexpr const char *updateRunRate = ("UPDATE runRate "
-            "SET run = {} WHERE id = {} and mode = '{}';");
-
-static constexpr const char *insertRunRate = ("INSERT INTO runRate "
-            "(id, mode, run) VALUES ({}, '{}', {});");
-
+// 战绩不直接写库：玩家的由PlayerStats缓存，武将的由GeneralStats攒着定时写回
+// 这里在RoomThread上，找玩家、改lastGameMode都留给主线程上的回调
 void Room::updatePlayerWinRate(int id, const std::string_view &mode, const std::string_view &role, int game_result) {
   if (!Sqlite3::checkString(mode))
     return;
-  auto &db = Server::instance().database();
-
-  int win = 0;
-  int lose = 0;
-  int draw = 0;
-
-  switch (game_result) {
-  case 1: win++; break;
-  case 2: lose++; break;
-  case 3: draw++; break;
-  default: break;
-  }
-
-  auto result = db.select(fmt::format(findPWinRate, id, mode, role));
-
-  if (result.empty()) {
-    db.exec(fmt::format(insertPWinRate, id, mode, role, win, lose, draw));
-  } else {
-    auto obj = result[0];
-    win += atoi(obj["win"].c_str());
-    lose += atoi(obj["lose"].c_str());
-    draw += atoi(obj["draw"].c_str());
-    db.exec(fmt::format(updatePWinRate, win, lose, draw, id, mode, role));
-  }
 
   auto &um = Server::instance().user_manager();
-  auto player = um.findPlayer(id).lock();
-  if (player && std::find(players.begin(), players.end(), player->getConnId()) != players.end()) {
-    player->setLastGameMode(std::string(mode));
-    updatePlayerGameData(id, mode);
-  }
+  um.playerStats().addResult(id, mode, role, game_result);
+
+  updatePlayerGameData(id, mode, true);
 }
 
 void Room::updateGeneralWinRate(const std::string_view &general, const std::string_view &mode, const std::string_view &role, int game_result) {
@@ -512,84 +472,41 @@ void Room::updateGeneralWinRate(const std::string_view &general, const std::stri
     return;
   if (!Sqlite3::checkString(mode))
     return;
-  auto &db = Server::instance().database();
-
-  int win = 0;
-  int lose = 0;
-  int draw = 0;
-
-  switch (game_result) {
-  case 1: win++; break;
-  case 2: lose++; break;
-  case 3: draw++; break;
-  default: break;
-  }
 
-  auto result = db.select(fmt::format(findGWinRate, general, mode, role));
-
-  if (result.empty()) {
-    db.exec(fmt::format(insertGWinRate, general, mode, role, win, lose, draw));
-  } else {
-    auto obj = result[0];
-    win += atoi(obj["win"].c_str());
-    lose += atoi(obj["lose"].c_str());
-    draw += atoi(obj["draw"].c_str());
-    db.exec(fmt::format(updateGWinRate, win, lose, draw, general, mode, role));
-  }
+  Server::instance().generalStats().add(general, mode, role, game_result);
 }
 
 void Room::addRunRate(int id, const std::string_view &mode) {
-  int run = 1;
-  auto &db = Server::instance().database();
-  auto result = db.select(fmt::format(findRunRate, id, mode));
-
-  if (result.empty()) {
-    db.exec(fmt::format(insertRunRate, id, mode, run));
-  } else {
-    auto obj = result[0];
-    run += atoi(obj["run"].c_str());
-    db.exec(fmt::format(updateRunRate, run, id, mode));
-  }
+  Server::instance().user_manager().playerStats().addRun(id, mode);
 }
 
-void Room::updatePlayerGameData(int id, const std::string_view &mode) {
-  static constexpr const char *findModeRate =
-    "SELECT win, total FROM pWinRateView WHERE id = {} and mode = '{}';";
-
+void Room::updatePlayerGameData(int id, const std::string_view &mode, bool game_over) {
   if (id < 0) return;
 
-  auto &server = Server::instance();
-  auto &um = server.user_manager();
-  auto &db = server.database();
-
-  auto player = um.findPlayer(id).lock();
-  if (!player) return;
-
-  auto room = dynamic_pointer_cast<Room>(player->getRoom().lock());
-  if (player->getState() == Player::Robot || !room) {
-    return;
-  }
-
-  int total = 0;
-  int win = 0;
-  int run = 0;
-
-  auto result = db.select(fmt::format(findRunRate, id, mode));
-
-  if (!result.empty()) {
-    run = atoi(result[0]["run"].c_str());
-  }
+  auto &um = Server::instance().user_manager();
 
-  result = db.select(fmt::format(findModeRate, id, mode));
+  // 直接从战绩缓存里算，回调在主线程
+  um.playerStats().getGameData(id, mode, [id, mode = std::string(mode), game_over,
+                                          weak = weak_from_this()](PlayerStats::GameData data) {
+    auto &um = Server::instance().user_manager();
+    auto player = um.findPlayer(id).lock();
+    if (!player) return;
+
+    auto room = dynamic_pointer_cast<Room>(player->getRoom().lock());
+    if (game_over) {
+      // 这局打完之前就已经离开的不算
+      if (!room || room != weak.lock()) return;
+      player->setLastGameMode(mode);
+    }
 
-  if (!result.empty()) {
-    total = atoi(result[0]["total"].c_str());
-    win = atoi(result[0]["win"].c_str());
-  }
+    if (player->getState() == Player::Robot || !room) {
+      return;
+    }
 
-  player->setGameData(total, win, run);
-  room->doBroadcastNotify(room->getPlayers(), "UpdateGameData",
-                          Cbor::encodeArray({ player->getId(), total, win, run }));
+    player->setGameData(data.total, data.win, data.run);
+    room->doBroadcastNotify(room->getPlayers(), "UpdateGameData",
+                            Cbor::encodeArray({ player->getId(), data.total, data.win, data.run }));
+  });
 }
 
 // 多线程非常麻烦 把GameOver交给主线程完成去
@@ -607,7 +524,6 @@ void Room::updatePlayerGameTime() {
   auto &server = Server::instance();
   auto &um = server.user_manager();
 
-  server.beginTransaction();
   for (auto pConnId : players) {
     auto p = um.findPlayerByConnId(pConnId).lock();
     if (!p) continue;
@@ -621,7 +537,7 @@ void Room::updatePlayerGameTime() {
       "IIF(totalGameTime IS NULL, {}, totalGameTime + {}) WHERE id = {};",
       time, time, pid
     );
-    server.database().exec(info_update);
+    server.dbExecutor().exec(info_update);
 
     // 然后时间得告诉别人
     auto bytes = Cbor::encodeArray( { pid, time } );
@@ -638,7 +554,6 @@ void Room::updatePlayerGameTime() {
       realPlayer->doNotify("AddTotalGameTime", bytes);
     }
   }
-  server.endTransaction();
 }
 
 void Room::_gameOver() {
@@ -891,11 +806,12 @@ void Room::changeroom(Player &player, const Packet &packet) {
   setSettings(newsettings);
 
   auto &rm = Server::instance().room_manager();
+  rm.roomList().update(*this);
   auto &um = Server::instance().user_manager();
   for (auto pid : currentplayers) {
     auto p = um.findPlayerByConnId(pid).lock();
     if (!p) continue;
-    if (p->getRouter().getSocket() != nullptr ){
+    if (p->isOnline()) {
       //先移出去再进来
       p->setReady(false);
       auto it = std::find(players.begin(), players.end(), p->getConnId());
@@ -12,7 +12,7 @@ class ClientSocket;
 
 class Room final : public RoomBase, public std::enable_shared_from_this<Room> {
 public:
-  explicit Room();
+  explicit Room(int id);
   Room(Room &) = delete;
   Room(Room &&) = delete;
   ~Room();
@@ -135,7 +135,8 @@ private:
   void _checkAbandoned(CheckAbandonReason reason);
 
   void addRunRate(int id, const std::string_view &mode);
-  void updatePlayerGameData(int id, const std::string_view &mode);
+  // game_over为真时顺便把玩家的lastGameMode改成mode（仅限还在本房间的）
+  void updatePlayerGameData(int id, const std::string_view &mode, bool game_over = false);
 
   void setPlayerReady(Player &, bool ready);
 
@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "server/room/room_list.h"
+#include "server/room/room.h"
+#include "server/room/room_manager.h"
+#include "server/user/player.h"
+#include "server/user/user_manager.h"
+#include "server/server.h"
+#include "core/c-wrapper.h"
+
+namespace asio = boost::asio;
+
+static std::string uintHeader(uint64_t n, uint8_t major = 0) {
+  unsigned char buf[10];
+  size_t len = cbor_encode_uint(n, buf, 10);
+  buf[0] += major;
+  return { (char *)buf, len };
+}
+
+static std::string arrayHeader(size_t n) {
+  return uintHeader(n, 0x80);
+}
+
+void RoomList::update(Room &room) {
+  auto &entry = m_entries[room.getId()];
+  entry.cbor = Cbor::encodeArray({
+    room.getId(),
+    room.getName().data(),
+    room.getGameMode().data(),
+    room.getPlayers().size(),
+    room.getCapacity(),
+    !room.getPassword().empty(),
+    room.isOutdated(),
+  });
+  entry.mode = room.getGameMode();
+  entry.full = room.isFull();
+  markChanged(room.getId());
+}
+
+void RoomList::remove(int id) {
+  if (m_entries.erase(id)) markChanged(id);
+}
+
+void RoomList::updateAll() {
+  for (auto &[_, room] : Server::instance().room_manager().getRooms()) {
+    update(*room);
+  }
+}
+
+void RoomList::markChanged(int id) {
+  m_version++;
+  if (m_subscribers.empty()) return;
+
+  m_changed.insert(id);
+  if (m_push_scheduled) return;
+  m_push_scheduled = true;
+  asio::post(Server::instance().context(), [this] { pushDelta(); });
+}
+
+const std::string &RoomList::fullList() {
+  if (m_full_list_version == m_version) return m_full_list;
+
+  m_full_list = arrayHeader(m_entries.size());
+  for (bool full : { false, true }) {
+    for (auto &[_, entry] : m_entries) {
+      if (entry.full == full) m_full_list += entry.cbor;
+    }
+  }
+  m_full_list_version = m_version;
+  return m_full_list;
+}
+
+std::string RoomList::page(int page, int pageSize, std::string_view mode) {
+  page = std::max(page, 0);
+  pageSize = std::clamp(pageSize, 1, 200);
+  size_t begin = (size_t)page * pageSize, end = begin + pageSize;
+
+  size_t total = 0;
+  std::string rooms;
+  for (bool full : { false, true }) {
+    for (auto &[_, entry] : m_entries) {
+      if (entry.full != full) continue;
+      if (!mode.empty() && entry.mode != mode) continue;
+      if (total >= begin && total < end) rooms += entry.cbor;
+      total++;
+    }
+  }
+
+  size_t count = total > begin ? std::min(total, end) - begin : 0;
+  return arrayHeader(3) + uintHeader(m_version) + uintHeader(total) +
+    arrayHeader(count) + rooms;
+}
+
+// [版本号, [变化或新增的房间...], [删掉的房间id...]]
+std::string RoomList::encodeDelta(const std::set<int> &ids, std::string_view mode) {
+  std::string upserts, removed;
+  size_t n_upserts = 0, n_removed = 0;
+  for (auto id : ids) {
+    auto it = m_entries.find(id);
+    // 模式对不上的也当删除发，房间改了模式的话客户端也能去掉它
+    if (it == m_entries.end() || (!mode.empty() && it->second.mode != mode)) {
+      removed += uintHeader(id);
+      n_removed++;
+    } else {
+      upserts += it->second.cbor;
+      n_upserts++;
+    }
+  }
+  return arrayHeader(3) + uintHeader(m_version) + arrayHeader(n_upserts) + upserts +
+    arrayHeader(n_removed) + removed;
+}
+
+void RoomList::pushDelta() {
+  m_push_scheduled = false;
+  std::set<int> changed;
+  changed.swap(m_changed);
+  if (changed.empty()) return;
+
+  auto &um = Server::instance().user_manager();
+  // 同一个过滤条件只编码一次
+  std::unordered_map<std::string, std::string> encoded;
+  for (auto it = m_subscribers.begin(); it != m_subscribers.end();) {
+    auto p = um.findPlayerByConnId(it->first).lock();
+    if (!p) {
+      it = m_subscribers.erase(it);
+      continue;
+    }
+
+    auto [enc, inserted] = encoded.try_emplace(it->second);
+    if (inserted) enc->second = encodeDelta(changed, it->second);
+    p->doNotify("UpdateRoomListDelta", enc->second);
+    ++it;
+  }
+}
+
+void RoomList::subscribe(Player &player, std::string_view mode) {
+  m_subscribers[player.getConnId()] = mode;
+
+  std::set<int> all;
+  for (auto &[id, entry] : m_entries) {
+    if (mode.empty() || entry.mode == mode) all.insert(id);
+  }
+  player.doNotify("UpdateRoomListDelta", encodeDelta(all, mode));
+}
+
+void RoomList::unsubscribe(int connId) {
+  m_subscribers.erase(connId);
+}
+
+uint64_t RoomList::version() const {
+  return m_version;
+}
+
+size_t RoomList::subscriberCount() const {
+  return m_subscribers.size();
+}
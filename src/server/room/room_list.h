@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+class Room;
+class Player;
+
+// 大厅房间列表的缓存
+// 每个房间在自己有变化（建房、进出人、改设置、过期、删除）时重新编码一次，
+// 刷新列表时直接把编码好的拼起来；不带参数的完整列表整个缓存，版本号没变就原样发
+// 订阅了的客户端在房间变化时收到增量，同一轮事件循环里的变化合并成一条
+// 只在主线程使用
+class RoomList {
+public:
+  RoomList() = default;
+  RoomList(RoomList &) = delete;
+  RoomList(RoomList &&) = delete;
+
+  void update(Room &room);
+  void remove(int id);
+  // 服务器md5变了，所有房间的过期标记都要重算
+  void updateAll();
+
+  // 与原来的UpdateRoomList格式相同：未满的房间在前，满了的在后，各自按id排序
+  const std::string &fullList();
+  // 只给新客户端用：[版本号, 符合条件的总数, [房间...]]
+  std::string page(int page, int pageSize, std::string_view mode);
+
+  // 订阅后立即收到一条包含全部（符合mode的）房间的增量，之后只收变化
+  void subscribe(Player &player, std::string_view mode);
+  void unsubscribe(int connId);
+
+  uint64_t version() const;
+  size_t subscriberCount() const;
+
+private:
+  struct Entry {
+    std::string cbor;
+    std::string mode;
+    bool full;
+  };
+
+  std::map<int, Entry> m_entries;
+  uint64_t m_version = 1;
+
+  std::string m_full_list;
+  uint64_t m_full_list_version = 0;
+
+  // connId -> 只看哪个模式，空串为全部
+  std::unordered_map<int, std::string> m_subscribers;
+  std::set<int> m_changed;
+  bool m_push_scheduled = false;
+
+  void markChanged(int id);
+  void pushDelta();
+  std::string encodeDelta(const std::set<int> &ids, std::string_view mode);
+};
@@ -4,6 +4,7 @@
 #include "server/room/room.h"
 #include "server/room/roombase.h"
 #include "server/room/lobby.h"
+#include "server/room/room_list.h"
 #include "server/user/player.h"
 #include "server/gamelogic/roomthread.h"
 #include "server/server.h"
@@ -11,6 +12,7 @@
 
 RoomManager::RoomManager() {
   m_lobby = std::make_shared<Lobby>();
+  m_room_list = std::make_unique<RoomList>();
 }
 
 std::shared_ptr<Room> RoomManager::createRoom(Player &creator, const std::string &name, int capacity,
@@ -24,30 +26,30 @@ std::shared_ptr<Room> RoomManager::createRoom(Player &creator, const std::string
 
   auto &thread = server.getAvailableThread();
 
-  auto room = std::make_shared<Room>();
-  auto id = room->getId();
+  std::shared_ptr<Room> room;
+  auto id = rooms.emplace([&](int handle) { return room = std::make_shared<Room>(handle); });
+  if (id == 0) [[unlikely]] {
+    spdlog::error("Too many rooms, failed to create room for player {}", creator.getId());
+    creator.doNotify("ErrorMsg", "unk error");
+    return nullptr;
+  }
 
-  rooms[id] = room;
   room->setName(name);
   room->setCapacity(capacity);
   room->setThread(thread);
   room->setTimeout(timeout);
   room->setSettings(settings);
+  m_room_list->update(*room);
   return room;
 }
 
 void RoomManager::removeRoom(int id) {
-  if (rooms.contains(id)) {
-    rooms.erase(id);
-  }
+  rooms.erase(id);
+  m_room_list->remove(id);
 }
 
 std::weak_ptr<Room> RoomManager::findRoom(int id) const {
-  try {
-    return rooms.at(id);
-  } catch (const std::out_of_range &) {
-    return {};
-  }
+  return rooms.find(id);
 }
 
 std::weak_ptr<Lobby> RoomManager::lobby() const {
@@ -57,3 +59,7 @@ std::weak_ptr<Lobby> RoomManager::lobby() const {
 auto RoomManager::getRooms() const -> const decltype(rooms) & {
   return rooms;
 }
+
+RoomList &RoomManager::roomList() {
+  return *m_room_list;
+}
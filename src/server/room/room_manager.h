@@ -2,15 +2,18 @@
 
 #pragma once
 
+#include "core/slot_map.h"
+
 class RoomBase;
 class Lobby;
 class Room;
 class Player;
+class RoomList;
 
 class RoomManager {
 private:
-  // 用有序map吧，有个按id自动排序的小功能
-  std::map<int, std::shared_ptr<Room>> rooms;
+  // 房间id就是槽位句柄，遍历顺序是槽位顺序；RoomThread里的RPC也会来查
+  SlotMap<Room> rooms;
 
 public:
   explicit RoomManager();
@@ -25,8 +28,10 @@ public:
   std::weak_ptr<Room> findRoom(int id) const;
   std::weak_ptr<Lobby> lobby() const;
   auto getRooms() const -> const decltype(rooms) &;
+  RoomList &roomList();
 
 private:
   // what can i say? Player::getRoom需要
   std::shared_ptr<Lobby> m_lobby;
+  std::unique_ptr<RoomList> m_room_list;
 };
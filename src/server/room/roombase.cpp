@@ -7,6 +7,7 @@
 #include "server/room/room_manager.h"
 #include "server/user/user_manager.h"
 #include "server/user/player.h"
+#include "server/user/access_control.h"
 #include "network/client_socket.h"
 
 bool RoomBase::isLobby() const {
@@ -65,7 +66,7 @@ void RoomBase::chat(Player &sender, const Packet &packet) {
     return;
   }
 
-  int muteType = server.isMuted(senderId);
+  int muteType = server.accessControl().muteType(senderId);
   if (muteType == 1) { // 完全禁言
     return;
   } else if (muteType == 2 && msg.starts_with("$")) {
@@ -1,12 +1,14 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include "server/rpc-lua/rpc-lua.h"
+#include "server/rpc-lua/rpc-tracer.h"
 #include "core/packman.h"
 #include "server/rpc-lua/jsonrpc.h"
 
 #include "server/gamelogic/rpc-dispatchers.h"
 
 #include "core/util.h"
+#include "core/lua_bytecode.h"
 
 #include <unistd.h>
 #include <sys/wait.h>
@@ -16,8 +18,9 @@ using namespace JsonRpc;
 namespace asio = boost::asio;
 
 // 传过去的算上call和返回值只有int bytes和null... 毁灭吧
-static void sendParam(asio::posix::stream_descriptor &file, JsonRpcParam &param) {
+static size_t sendParam(asio::posix::stream_descriptor &file, JsonRpcParam &param) {
   u_char buf[10]; size_t buflen;
+  size_t written = 0;
   std::visit([&](auto&& arg) {
     using T = std::decay_t<decltype(arg)>;
     if constexpr (std::is_same_v<T, int>) {
@@ -26,103 +29,110 @@ static void sendParam(asio::posix::stream_descriptor &file, JsonRpcParam &param)
       } else {
         buflen = cbor_encode_negint(-1-arg, buf, 10);
       }
-      file.write_some(asio::const_buffer(buf, buflen));
+      written += file.write_some(asio::const_buffer(buf, buflen));
     } else if constexpr (std::is_same_v<T, std::string_view> || std::is_same_v<T, std::string>) {
       buflen = cbor_encode_uint(arg.size(), buf, 10);
       buf[0] += 0x40;
-      file.write_some(asio::const_buffer(buf, buflen));
-      file.write_some(asio::const_buffer(arg.data(), arg.size()));
+      written += file.write_some(asio::const_buffer(buf, buflen));
+      written += file.write_some(asio::const_buffer(arg.data(), arg.size()));
     } else if constexpr (std::is_same_v<T, bool>) {
-      file.write_some(asio::const_buffer(arg ? "\xF5" : "\xF4", 1));
+      written += file.write_some(asio::const_buffer(arg ? "\xF5" : "\xF4", 1));
     } else if constexpr (std::is_same_v<T, std::nullptr_t>) {
-      file.write_some(asio::const_buffer("\xF6", 1));
+      written += file.write_some(asio::const_buffer("\xF6", 1));
     }
   }, param);
+  return written;
 }
 
 // request: { jsonRpc, method, params, id }
-static void sendRequest(asio::posix::stream_descriptor &file, JsonRpcPacket &pkt) {
+static size_t sendRequest(asio::posix::stream_descriptor &file, JsonRpcPacket &pkt) {
   u_char buf[10]; size_t buflen;
+  size_t written = 0;
   // { jsonRpc: '2.0', method: '
-  file.write_some(asio::const_buffer("\xa4\x18\x64\x43\x32\x2e\x30\x18\x65", 9));
+  written += file.write_some(asio::const_buffer("\xa4\x18\x64\x43\x32\x2e\x30\x18\x65", 9));
   buflen = cbor_encode_uint(pkt.method.size(), buf, 10);
   buf[0] += 0x40;
   // <method>',
-  file.write_some(asio::const_buffer(buf, buflen));
-  file.write_some(asio::const_buffer(pkt.method.data(), pkt.method.size()));
+  written += file.write_some(asio::const_buffer(buf, buflen));
+  written += file.write_some(asio::const_buffer(pkt.method.data(), pkt.method.size()));
   // id:
   buflen = cbor_encode_uint(pkt.id, buf, 10);
-  file.write_some(asio::const_buffer("\x18\x68", 2));
-  file.write_some(asio::const_buffer(buf, buflen));
+  written += file.write_some(asio::const_buffer("\x18\x68", 2));
+  written += file.write_some(asio::const_buffer(buf, buflen));
   // params + arr head
   size_t i = pkt.param_count;
   buflen = cbor_encode_uint(i, buf, 10);
   buf[0] += 0x80;
-  file.write_some(asio::const_buffer("\x18\x66", 2));
-  file.write_some(asio::const_buffer(buf, buflen));
+  written += file.write_some(asio::const_buffer("\x18\x66", 2));
+  written += file.write_some(asio::const_buffer(buf, buflen));
 
-  if (i == 0) return;
-  sendParam(file, pkt.param1);
+  if (i == 0) return written;
+  written += sendParam(file, pkt.param1);
   i--;
 
-  if (i == 0) return;
-  sendParam(file, pkt.param2);
+  if (i == 0) return written;
+  written += sendParam(file, pkt.param2);
   i--;
 
-  if (i == 0) return;
-  sendParam(file, pkt.param3);
+  if (i == 0) return written;
+  written += sendParam(file, pkt.param3);
+  return written;
 }
 
 // response: { jsonRpc, result, id }
-static void sendResponse(asio::posix::stream_descriptor &file, JsonRpcPacket &pkt) {
+static size_t sendResponse(asio::posix::stream_descriptor &file, JsonRpcPacket &pkt) {
   u_char buf[10]; size_t buflen;
+  size_t written = 0;
   // { jsonRpc: '2.0', id:
-  file.write_some(asio::const_buffer("\xa3\x18\x64\x43\x32\x2e\x30\x18\x68", 9));
+  written += file.write_some(asio::const_buffer("\xa3\x18\x64\x43\x32\x2e\x30\x18\x68", 9));
 
   // id
   buflen = cbor_encode_uint(pkt.id, buf, 10);
-  file.write_some(asio::const_buffer(buf, buflen));
+  written += file.write_some(asio::const_buffer(buf, buflen));
 
   // result
-  file.write_some(asio::const_buffer("\x18\x69", 2));
-  sendParam(file, pkt.result);
+  written += file.write_some(asio::const_buffer("\x18\x69", 2));
+  written += sendParam(file, pkt.result);
+  return written;
 }
 
 // response: { jsonRpc, error, [id] }
-static void sendError(asio::posix::stream_descriptor &file, JsonRpcPacket &pkt) {
+static size_t sendError(asio::posix::stream_descriptor &file, JsonRpcPacket &pkt) {
   u_char buf[10]; size_t buflen;
+  size_t written = 0;
 
   if (pkt.id < 0) {
-    file.write_some(asio::const_buffer("\xa2", 1));
+    written += file.write_some(asio::const_buffer("\xa2", 1));
   } else {
-    file.write_some(asio::const_buffer("\xa3", 1));
+    written += file.write_some(asio::const_buffer("\xa3", 1));
   }
 
   // { jsonRpc: '2.0',
-  file.write_some(asio::const_buffer("\x18\x64\x43\x32\x2e\x30", 6));
+  written += file.write_some(asio::const_buffer("\x18\x64\x43\x32\x2e\x30", 6));
 
   // [id]
   if (pkt.id >= 0) {
     buflen = cbor_encode_uint(pkt.id, buf, 10);
-    file.write_some(asio::const_buffer("\x18\x68", 2));
-    file.write_some(asio::const_buffer(buf, buflen));
+    written += file.write_some(asio::const_buffer("\x18\x68", 2));
+    written += file.write_some(asio::const_buffer(buf, buflen));
   }
 
   // error: { code:
-  file.write_some(asio::const_buffer("\x18\x67\xA3\x18\xC8", 5));
+  written += file.write_some(asio::const_buffer("\x18\x67\xA3\x18\xC8", 5));
   buflen = cbor_encode_negint(pkt.error.code, buf, 10);
-  file.write_some(asio::const_buffer(buf, buflen));
+  written += file.write_some(asio::const_buffer(buf, buflen));
 
   // msg:
-  file.write_some(asio::const_buffer("\x18\xC9", 2));
+  written += file.write_some(asio::const_buffer("\x18\xC9", 2));
   buflen = cbor_encode_uint(pkt.error.message.size(), buf, 10);
   buf[0] += 0x40;
-  file.write_some(asio::const_buffer(buf, buflen));
-  file.write_some(asio::const_buffer(pkt.error.message.data(), pkt.error.message.size()));
+  written += file.write_some(asio::const_buffer(buf, buflen));
+  written += file.write_some(asio::const_buffer(pkt.error.message.data(), pkt.error.message.size()));
 
   // data:
-  file.write_some(asio::const_buffer("\x18\xCA", 2));
-  sendParam(file, pkt.error.data);
+  written += file.write_some(asio::const_buffer("\x18\xCA", 2));
+  written += sendParam(file, pkt.error.data);
+  return written;
 }
 
 struct RpcPacketBuilder {
@@ -411,17 +421,36 @@ static cbor_decoder_status readJsonRpcPacket(cbor_data &cbuf, size_t &len, JsonR
   }
 }
 
-RpcLua::RpcLua(asio::io_context &ctx) : io_ctx { ctx },
+RpcLua::RpcLua(asio::io_context &ctx, const std::vector<int> &cpus) : io_ctx { ctx },
   child_stdin { ctx }, child_stdout { ctx }
 {
+  m_tracer = std::make_unique<RpcTracer>();
+
   int stdin_pipe[2];  // [0]=read, [1]=write
   int stdout_pipe[2]; // [0]=read, [1]=write
   if (::pipe(stdin_pipe) == -1 || pipe(stdout_pipe) == -1) {
     throw std::runtime_error("Failed to create pipes");
   }
 
+  // fork之后尽量少做事，cpu_set先在父进程准备好
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (auto cpu : cpus) CPU_SET(cpu, &cpu_set);
+
+  // 管理员自己设了LUA_INIT的话不去覆盖，这时就不用字节码了
+  auto bytecode_dir = luaBytecodeDir();
+  if (!bytecode_dir.empty() && (::getenv("LUA_INIT_5_4") || ::getenv("LUA_INIT"))) {
+    bytecode_dir.clear();
+  }
+  auto bytecode_loader = fmt::format("@{}/loader.lua", bytecode_dir);
+  auto core_dir = std::filesystem::absolute("packages/freekill-core").string();
+
   pid_t pid = fork();
   if (pid == 0) { // child
+    if (!cpus.empty()) {
+      ::sched_setaffinity(0, sizeof(cpu_set), &cpu_set);
+    }
+
     // 关闭父进程用的 pipe 端
     ::close(stdin_pipe[1]);  // 关闭父进程的写入端（子进程只读 stdin）
     ::close(stdout_pipe[0]); // 关闭父进程的读取端（子进程只写 stdout）
@@ -453,6 +482,13 @@ RpcLua::RpcLua(asio::io_context &ctx) : io_ctx { ctx },
     free(json_string);
     cJSON_Delete(json_array);
 
+    // 预编译好的字节码，见core/lua_bytecode.h；没有的话Lua那边照常读源码
+    if (!bytecode_dir.empty()) {
+      ::setenv("FK_LUA_BYTECODE", bytecode_dir.c_str(), 1);
+      ::setenv("FK_LUA_CWD", core_dir.c_str(), 1);
+      ::setenv("LUA_INIT_5_4", bytecode_loader.c_str(), 1);
+    }
+
     ::setenv("FK_RPC_MODE", "cbor", 1);
     ::execlp("lua5.4", "lua5.4", "lua/server/rpc/entry.lua", nullptr);
 
@@ -495,8 +531,14 @@ RpcLua::~RpcLua() {
   }
 }
 
+static uint32_t elapsedMicroseconds(std::chrono::steady_clock::time_point since) {
+  using namespace std::chrono;
+  return duration_cast<microseconds>(steady_clock::now() - since).count();
+}
+
 void RpcLua::wait(WaitType waitType, const char *method, int id) {
   JsonRpcPacket received_pkt;
+  auto wait_start = std::chrono::steady_clock::now();
 
   while (child_stdout.is_open() && alive()) {
     received_pkt.reset();
@@ -511,6 +553,7 @@ void RpcLua::wait(WaitType waitType, const char *method, int id) {
     cbor_data cbuf = (cbor_data)cborBuffer.data(); size_t len = cborBuffer.size();
 
     auto stat = readJsonRpcPacket(cbuf, len, received_pkt);
+    size_t pkt_size = cborBuffer.size() - len;
 
     if (stat == CBOR_DECODER_ERROR) {
       cborBuffer.clear();
@@ -526,24 +569,31 @@ void RpcLua::wait(WaitType waitType, const char *method, int id) {
 #ifdef RPC_DEBUG
       spdlog::debug("Me <-- returned {}", toHex({ buffer, read_sz }));
 #endif
+      m_tracer->record(RpcTracer::ReturnIn, method, id, pkt_size, elapsedMicroseconds(wait_start));
       // 并不关心lua返回了啥；那为什么还要去读取
       return;
     } else if (received_pkt.error.code != 0) {
       spdlog::warn("RPC call failed! id={} method={} ec={} msg={}", id, method, received_pkt.error.code, received_pkt.error.message);
+      m_tracer->record(RpcTracer::ErrorIn, method, id, pkt_size, elapsedMicroseconds(wait_start));
       return;
     } else {
 #ifdef RPC_DEBUG
       spdlog::debug("  Me <-- {} {}", received_pkt.method, toHex({ buffer, read_sz }));
 #endif
+      auto handle_start = std::chrono::steady_clock::now();
+      m_tracer->record(RpcTracer::CallIn, received_pkt.method, received_pkt.id, pkt_size);
+
       auto res = JsonRpc::handleRequest(RpcDispatchers::ServerRpcMethods, received_pkt);
       if (res) {
         if (res->error.code < 0) {
-          sendError(child_stdin, *res);
+          auto sz = sendError(child_stdin, *res);
+          m_tracer->record(RpcTracer::ErrorOut, received_pkt.method, res->id, sz, elapsedMicroseconds(handle_start));
 #ifdef RPC_DEBUG
           spdlog::debug("  Me --> returned an error");
 #endif
         } else if (res->id > 0) {
-          sendResponse(child_stdin, *res);
+          auto sz = sendResponse(child_stdin, *res);
+          m_tracer->record(RpcTracer::ReturnOut, received_pkt.method, res->id, sz, elapsedMicroseconds(handle_start));
 #ifdef RPC_DEBUG
           spdlog::debug("  Me --> returned some value");
 #endif
@@ -574,7 +624,8 @@ void RpcLua::call(const char *func_name, JsonRpcParam param1, JsonRpcParam param
 
   auto req = JsonRpc::request(func_name, param1, param2, param3);
   auto id = req.id;
-  sendRequest(child_stdin, req);
+  auto sz = sendRequest(child_stdin, req);
+  m_tracer->record(RpcTracer::CallOut, func_name, id, sz);
 
   wait(WaitForResponse, func_name, id);
 }
@@ -607,6 +658,14 @@ std::string RpcLua::getConnectionInfo() const {
   return ret;
 }
 
+int RpcLua::pid() const {
+  return child_pid;
+}
+
+RpcTracer &RpcLua::tracer() const {
+  return *m_tracer;
+}
+
 bool RpcLua::alive() const {
   auto procDir = fmt::format("/proc/{}/exe", child_pid);
   return std::filesystem::exists(procDir);
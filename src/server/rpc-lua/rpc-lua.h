@@ -4,6 +4,8 @@
 
 #include "server/rpc-lua/jsonrpc.h"
 
+class RpcTracer;
+
 class RpcLua {
 public:
   using io_context = boost::asio::io_context;
@@ -11,7 +13,8 @@ public:
   using tcp = boost::asio::ip::tcp;
   using udp = boost::asio::ip::udp;
 
-  explicit RpcLua(io_context &);
+  // cpus非空时Lua子进程会绑定到这些CPU上
+  explicit RpcLua(io_context &, const std::vector<int> &cpus = {});
   RpcLua(RpcLua &) = delete;
   RpcLua(RpcLua &&) = delete;
   ~RpcLua();
@@ -21,6 +24,10 @@ public:
     JsonRpc::JsonRpcParam param3 = nullptr);
 
   std::string getConnectionInfo() const;
+  int pid() const;
+
+  // 追踪器本身是线程安全的，const的RpcLua也允许开关
+  RpcTracer &tracer() const;
 
   bool alive() const;
 
@@ -40,4 +47,6 @@ private:
   enum { max_length = 32768 };
   char buffer[max_length];
   std::vector<unsigned char> cborBuffer;
+
+  std::unique_ptr<RpcTracer> m_tracer;
 };
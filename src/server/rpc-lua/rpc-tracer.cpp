@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "server/rpc-lua/rpc-tracer.h"
+
+// dump文件格式: header + Record[count]，小端，和本机内存布局一致
+struct TraceFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t count;
+  int32_t pid;
+};
+
+static constexpr const char trace_magic[8] = "FKRPCTR";
+static constexpr uint32_t trace_version = 1;
+
+RpcTracer::RpcTracer() {
+  m_slots = std::make_unique<Slot[]>(capacity);
+}
+
+bool RpcTracer::enabled() const {
+  return m_enabled.load(std::memory_order_relaxed);
+}
+
+void RpcTracer::setEnabled(bool enabled) {
+  m_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+void RpcTracer::record(Direction direction, std::string_view method, int id,
+                       size_t size, uint32_t latency) {
+  if (!enabled()) return;
+
+  using namespace std::chrono;
+  auto pos = m_head.fetch_add(1, std::memory_order_relaxed);
+  auto &slot = m_slots[pos & (capacity - 1)];
+
+  // seqlock写法：先标记为写入中，写完后再发布位置
+  slot.seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  auto &rec = slot.rec;
+  rec.timestamp = duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+  rec.latency = latency;
+  rec.id = id;
+  rec.size = (uint32_t)size;
+  rec.direction = direction;
+  auto len = std::min(method.size(), sizeof(rec.method) - 1);
+  memcpy(rec.method, method.data(), len);
+  rec.method[len] = 0;
+
+  slot.seq.store(pos + 1, std::memory_order_release);
+}
+
+std::vector<RpcTracer::Record> RpcTracer::snapshot() const {
+  std::vector<Record> ret;
+  auto head = m_head.load(std::memory_order_acquire);
+  auto begin = head > capacity ? head - capacity : 0;
+  ret.reserve(head - begin);
+
+  for (auto pos = begin; pos < head; pos++) {
+    auto &slot = m_slots[pos & (capacity - 1)];
+    auto seq = slot.seq.load(std::memory_order_acquire);
+    if (seq != pos + 1) continue;
+
+    Record rec;
+    memcpy(&rec, &slot.rec, sizeof(Record));
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    // 复制期间被覆写了，丢弃
+    if (slot.seq.load(std::memory_order_relaxed) != seq) continue;
+    ret.push_back(rec);
+  }
+
+  return ret;
+}
+
+uint64_t RpcTracer::total() const {
+  return m_head.load(std::memory_order_relaxed);
+}
+
+bool RpcTracer::dump(const std::string &path, int pid) const {
+  auto records = snapshot();
+
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file.is_open()) {
+    spdlog::error("Cannot open {} for writing RPC trace.", path);
+    return false;
+  }
+
+  TraceFileHeader header;
+  memcpy(header.magic, trace_magic, sizeof(header.magic));
+  header.version = trace_version;
+  header.record_size = sizeof(Record);
+  header.count = records.size();
+  header.pid = pid;
+
+  file.write((const char *)&header, sizeof(header));
+  file.write((const char *)records.data(), records.size() * sizeof(Record));
+  return file.good();
+}
+
+bool RpcTracer::decode(const char *path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open()) {
+    fmt::print(stderr, "Cannot open {}.\n", path);
+    return false;
+  }
+
+  TraceFileHeader header;
+  file.read((char *)&header, sizeof(header));
+  if (!file || memcmp(header.magic, trace_magic, sizeof(header.magic)) != 0
+    || header.version != trace_version || header.record_size != sizeof(Record)) {
+    fmt::print(stderr, "{} is not a valid RPC trace file.\n", path);
+    return false;
+  }
+
+  std::vector<Record> records(header.count);
+  file.read((char *)records.data(), header.count * sizeof(Record));
+  records.resize(file.gcount() / sizeof(Record));
+
+  std::stable_sort(records.begin(), records.end(), [](const Record &a, const Record &b) {
+    return a.timestamp < b.timestamp;
+  });
+
+  fmt::print("RPC trace of Lua process {}: {} record(s)\n", header.pid, records.size());
+  if (records.empty()) return true;
+
+  static constexpr const char *labels[] = {
+    "Me --> call ",
+    "Me <-- ret  ",
+    "Me <-- error",
+    "Me <-- call ",
+    "Me --> ret  ",
+    "Me --> error",
+  };
+
+  // 嵌套调用缩进一下，Lua在一次call里面会反过来调用我们很多次
+  int depth = 0;
+  auto start = records[0].timestamp;
+  for (auto &rec : records) {
+    if (rec.direction > ErrorOut) continue;
+    auto dir = (Direction)rec.direction;
+
+    if (dir == ReturnIn || dir == ErrorIn || dir == ReturnOut || dir == ErrorOut) {
+      if (depth > 0) depth--;
+    }
+
+    auto latency = (dir == CallOut || dir == CallIn) ? std::string {} :
+      fmt::format(" ({:.3f} ms)", rec.latency / 1000.0);
+
+    fmt::print("[{:>12.3f} ms] {:{}}{} {} id={} {} bytes{}\n",
+               (rec.timestamp - start) / 1000.0, "", depth * 2,
+               labels[dir], rec.method, rec.id, rec.size, latency);
+
+    if (dir == CallOut || dir == CallIn) depth++;
+  }
+
+  return true;
+}
@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+// 运行时开关的RPC追踪器
+// RPC_DEBUG要重新编译，而且每条消息都hex一遍丢给spdlog，生产环境根本开不起
+// 这个永远编译进去但默认关闭，开了之后每条消息也只是往环形缓冲区里写一条定长记录
+// 用shell的rpctrace命令开关/导出，导出的文件用 freekill-asio --decode-trace 看
+class RpcTracer {
+public:
+  enum Direction : uint8_t {
+    CallOut,    // Me --> Lua 发起调用
+    ReturnIn,   // Me <-- Lua 返回
+    ErrorIn,    // Me <-- Lua 返回错误
+    CallIn,     // Me <-- Lua 调用ServerRpcMethods
+    ReturnOut,  // Me --> Lua 返回
+    ErrorOut,   // Me --> Lua 返回错误
+  };
+
+  // 定长记录，导出时原样写进文件
+  struct Record {
+    int64_t timestamp;  // unix时间，微秒
+    uint32_t latency;   // 微秒，只有Return/Error类记录有意义
+    int32_t id;
+    uint32_t size;      // 整条CBOR消息的字节数
+    uint8_t direction;
+    char method[27];    // 截断，以\0结尾
+  };
+  static_assert(sizeof(Record) == 48);
+
+  // 必须是2的幂
+  enum { capacity = 4096 };
+
+  RpcTracer();
+  RpcTracer(RpcTracer &) = delete;
+  RpcTracer(RpcTracer &&) = delete;
+
+  bool enabled() const;
+  void setEnabled(bool enabled);
+
+  // 只由持有RpcLua的线程调用，但也允许多个线程同时写
+  void record(Direction direction, std::string_view method, int id,
+              size_t size, uint32_t latency = 0);
+
+  // 可由其他线程（shell）随时调用，不阻塞写入方；正在写的记录会被跳过
+  std::vector<Record> snapshot() const;
+  uint64_t total() const;
+
+  bool dump(const std::string &path, int pid) const;
+
+  // 离线解码dump文件并以时间线形式打印到stdout
+  static bool decode(const char *path);
+
+private:
+  struct Slot {
+    // 0表示正在写入，否则为写入位置+1
+    std::atomic<uint64_t> seq { 0 };
+    Record rec;
+  };
+
+  std::atomic<bool> m_enabled { false };
+  std::atomic<uint64_t> m_head { 0 };
+  std::unique_ptr<Slot[]> m_slots;
+};
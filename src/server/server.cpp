@@ -2,9 +2,14 @@
 
 #include "server/server.h"
 #include "server/room/room_manager.h"
+#include "server/room/room_list.h"
 #include "server/room/room.h"
 #include "server/room/lobby.h"
+#include "server/room/general_stats.h"
 #include "server/user/user_manager.h"
+#include "server/user/player_stats.h"
+#include "server/user/save_states.h"
+#include "server/user/access_control.h"
 #include "server/user/auth.h"
 #include "server/user/player.h"
 #include "network/server_socket.h"
@@ -16,8 +21,11 @@
 #include "server/admin/shell.h"
 
 #include "core/c-wrapper.h"
+#include "core/db_executor.h"
 #include "core/util.h"
 #include "core/packman.h"
+#include "core/cpu_topology.h"
+#include "core/ahocorasick.h"
 
 #include <cjson/cJSON.h>
 
@@ -39,10 +47,15 @@ Server &Server::instance() {
 Server::Server() : m_socket { nullptr } {
   m_user_manager = std::make_unique<UserManager>();
   m_room_manager = std::make_unique<RoomManager>();
+  m_cpu_partition = std::make_unique<CpuPartition>();
+  m_general_stats = std::make_unique<GeneralStats>();
 
-  db = std::make_unique<Sqlite3>();
+  db = std::make_unique<Sqlite3>("./server/users.db", "./server/init.sql", "./server/migrations");
   gamedb = std::make_unique<Sqlite3>("./server/game.db", "./server/gamedb_init.sql");  // 初始化
 
+  m_access_control = std::make_unique<AccessControl>();
+  m_access_control->load(*db);
+
   reloadConfig();
   refreshMd5();
 
@@ -52,6 +65,16 @@ Server::Server() : m_socket { nullptr } {
 }
 
 Server::~Server() {
+  // 这时候Server::instance()已经用不了了，直接把executor传进去
+  // 定时写回的协程也先停掉，免得它再去调instance()
+  m_general_stats->stop();
+  if (m_db_executor) {
+    m_user_manager->playerStats().flushAll(*m_db_executor);
+    m_general_stats->flush(*m_db_executor);
+  }
+  if (m_gamedb_executor) {
+    m_user_manager->saveStates().flushAll(*m_gamedb_executor);
+  }
 }
 
 awaitable<void> Server::heartbeat() {
@@ -81,12 +104,27 @@ awaitable<void> Server::heartbeat() {
         p->doNotify("Heartbeat", "");
       }
     }
+
+    // 顺便把战绩和存档缓存写回一次
+    m_user_manager->playerStats().flush();
+    m_user_manager->saveStates().flush();
   }
 }
 
 void Server::listen(io_context &io_ctx, tcp::endpoint end, udp::endpoint uend) {
   main_io_ctx = &io_ctx;
 
+  m_db_executor = std::make_unique<DbExecutor>(*db, io_ctx);
+  m_gamedb_executor = std::make_unique<DbExecutor>(*gamedb, io_ctx);
+
+  // 要在创建任何线程和Lua进程之前做，之后创建的线程会继承主线程的亲和性
+  if (m_config->cpuAffinity) {
+    m_cpu_partition->setup(m_config->reservedCores);
+    if (m_cpu_partition->enabled()) {
+      setCpuAffinity(0, m_cpu_partition->reservedCpus());
+    }
+  }
+
   m_socket = std::make_unique<ServerSocket>(io_ctx, end, uend);
   m_socket->set_new_connection_callback([this](std::shared_ptr<ClientSocket> p) {
     m_user_manager->processNewConnection(p);
@@ -96,6 +134,8 @@ void Server::listen(io_context &io_ctx, tcp::endpoint end, udp::endpoint uend) {
   heartbeat_timer = std::make_unique<asio::steady_timer>(io_ctx);
   asio::co_spawn(io_ctx, heartbeat(), detached);
 
+  m_general_stats->start(io_ctx);
+
   m_shell = std::make_unique<Shell>();
   m_shell->start();
 
@@ -128,6 +168,14 @@ Sqlite3 &Server::database() {
   return *db;
 }
 
+DbExecutor &Server::dbExecutor() {
+  return *m_db_executor;
+}
+
+DbExecutor &Server::gameDbExecutor() {
+  return *m_gamedb_executor;
+}
+
 Sqlite3 &Server::gameDatabase() {
   return *gamedb;
 }
@@ -136,6 +184,18 @@ Shell &Server::shell() {
   return *m_shell;
 }
 
+CpuPartition &Server::cpuPartition() {
+  return *m_cpu_partition;
+}
+
+GeneralStats &Server::generalStats() {
+  return *m_general_stats;
+}
+
+AccessControl &Server::accessControl() {
+  return *m_access_control;
+}
+
 void Server::sendEarlyPacket(ClientSocket &client, const std::string_view &type, const std::string_view &msg) {
   auto buf = Cbor::encodeArray({
     -2,
@@ -147,7 +207,7 @@ void Server::sendEarlyPacket(ClientSocket &client, const std::string_view &type,
 }
 
 RoomThread &Server::createThread() {
-  auto thr = std::make_unique<RoomThread>(*main_io_ctx);
+  auto thr = std::make_unique<RoomThread>(*main_io_ctx, *m_cpu_partition);
   auto id = thr->id();
   m_threads[id] = std::move(thr);
   return *m_threads[id];
@@ -183,8 +243,9 @@ const std::unordered_map<int, std::shared_ptr<RoomThread>> &
 }
 
 void Server::broadcast(const std::string_view &command, const std::string_view &jsonData) {
+  auto frame = std::make_shared<std::string>(Router::encodeNotification(command, jsonData));
   for (auto &[_, p] : user_manager().getPlayers()) {
-    p->doNotify(command, jsonData);
+    p->sendFrame(frame);
   }
 }
 
@@ -259,6 +320,34 @@ void ServerConfig::loadConf(const char* jsonStr) {
     maxPlayersPerDevice = static_cast<int>(item->valuedouble);
   }
 
+  if ((item = cJSON_GetObjectItem(root, "cpuAffinity")) && cJSON_IsBool(item)) {
+    cpuAffinity = cJSON_IsTrue(item);
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "reservedCores")) && cJSON_IsNumber(item)) {
+    reservedCores = static_cast<int>(item->valuedouble);
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "generalStatsFlushInterval")) && cJSON_IsNumber(item)) {
+    generalStatsFlushInterval = static_cast<int>(item->valuedouble);
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "generalStatsMaxPending")) && cJSON_IsNumber(item)) {
+    generalStatsMaxPending = static_cast<int>(item->valuedouble);
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "onlineInfoInterval")) && cJSON_IsNumber(item)) {
+    onlineInfoInterval = static_cast<int>(item->valuedouble);
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "resumeTokenTtl")) && cJSON_IsNumber(item)) {
+    resumeTokenTtl = static_cast<int>(item->valuedouble);
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "authThreads")) && cJSON_IsNumber(item)) {
+    authThreads = static_cast<int>(item->valuedouble);
+  }
+
   cJSON_Delete(root);
 }
 
@@ -275,20 +364,26 @@ void Server::reloadConfig() {
     file.close();
   }
 
-  m_config = std::make_unique<ServerConfig>();
-  m_config->loadConf(jsonStr.c_str());
+  // 解析和建自动机都在调用方（shell）线程上做，主线程那边读config和checkBanWord不加锁，只在主线程上换指针
+  auto config = std::make_unique<ServerConfig>();
+  config->loadConf(jsonStr.c_str());
+  auto ban_words = std::make_unique<AhoCorasick>(config->banWords);
+
+  auto swap = [&] {
+    m_config = std::move(config);
+    m_ban_words = std::move(ban_words);
+    m_general_stats->applyConfig(*m_config);
+  };
+  if (!main_io_ctx) {
+    return swap();
+  }
+  asio::dispatch(*main_io_ctx, asio::use_future(swap)).wait();
 }
 
 const ServerConfig &Server::config() const { return *m_config; }
 
 bool Server::checkBanWord(const std::string_view &str) {
-  auto arr = m_config->banWords;
-  for (auto &s : arr) {
-    if (str.find(s) != std::string_view::npos) {
-      return false;
-    }
-  }
-  return true;
+  return !m_ban_words->matches(str);
 }
 
 void Server::temporarilyBan(int playerId) {
@@ -296,72 +391,26 @@ void Server::temporarilyBan(int playerId) {
   if (!player) return;
 
   auto socket = player->getRouter().getSocket();
-  std::string addr;
   if (!socket) {
     static constexpr const char *sql_find =
       "SELECT lastLoginIp FROM userinfo WHERE id={};";
-    auto result = db->select(fmt::format(sql_find, playerId));
-    if (result.empty())
-      return;
-
-    auto obj = result[0];
-    addr = obj["lastLoginIp"];
+    m_db_executor->select(fmt::format(sql_find, playerId), [this, playerId](Sqlite3::QueryResult result) {
+      if (result.empty())
+        return;
+
+      auto player = m_user_manager->findPlayer(playerId).lock();
+      if (!player) return;
+      _temporarilyBan(*player, result[0]["lastLoginIp"]);
+    });
   } else {
-    addr = socket->peerAddress();
+    _temporarilyBan(*player, std::string { socket->peerAddress() });
   }
-  temp_banlist.push_back(addr);
-
-  auto time = m_config->tempBanTime;
-  using namespace std::chrono;
-  auto timer = std::make_shared<asio::steady_timer>(*main_io_ctx, seconds(time * 60));
-  // Server不会析构，先不weak
-  timer->async_wait([this, addr, timer](const std::error_code& ec){
-    if (!ec) {
-      auto it = std::find(temp_banlist.begin(), temp_banlist.end(), addr);
-      if (it != temp_banlist.end())
-        temp_banlist.erase(it);
-    } else {
-      spdlog::error("error in tempBan timer: {}", ec.message());
-    }
-  });
-  player->emitKicked();
 }
 
-bool Server::isTempBanned(const std::string_view &addr) const {
-  return (std::find(temp_banlist.begin(), temp_banlist.end(), addr) != temp_banlist.end());
-}
-
-int Server::isMuted(int playerId) const {
-  auto result = db->select(fmt::format("SELECT expireAt, type FROM tempmute WHERE uid={};", playerId));
-  if (result.empty())
-    return 0; // 0为未被禁言
-
-  auto obj = result[0];
-  auto expireAt = std::stoll(obj["expireAt"]);
-  auto now = std::chrono::duration_cast<std::chrono::seconds>(
-    std::chrono::system_clock::now().time_since_epoch()).count();
-
-  if (now > expireAt) {
-    db->exec(fmt::format("DELETE FROM tempmute WHERE uid={};", playerId));
-    return 0;
-  }
-
-  int type = 1;
-  if (obj.find("type") != obj.end() && !obj["type"].empty()) {
-    type = std::stoi(obj["type"]);
-  }
-
-  return type; // 1为完全禁言，2为禁止$开头
-}
-
-void Server::beginTransaction() {
-  transaction_mutex.lock();
-  db->exec("BEGIN;");
-}
-
-void Server::endTransaction() {
-  db->exec("COMMIT;");
-  transaction_mutex.unlock();
+void Server::_temporarilyBan(Player &player, const std::string &addr) {
+  // 到期由AccessControl自己清掉，不用再每个人开一个定时器
+  m_access_control->tempBanIp(addr, (int64_t)m_config->tempBanTime * 60);
+  player.emitKicked();
 }
 
 const std::string &Server::getMd5() const {
@@ -369,18 +418,29 @@ const std::string &Server::getMd5() const {
 }
 
 void Server::refreshMd5() {
+  // 算md5、编译字节码、查包摘要都慢，在调用方的线程（启动时是主线程，之后是shell）做完，
+  // 主线程上只换结果；FileHashCache不能两个线程一起用，这里串起来
+  static std::mutex refresh_mutex;
+  std::lock_guard<std::mutex> lock { refresh_mutex };
+
+  auto new_md5 = calcFileMD5();
+  auto summary = PackMan::instance().buildSummary();
   if (!main_io_ctx) {
-    return _refreshMd5();
+    return _refreshMd5(std::move(new_md5), std::move(summary));
   }
-  asio::dispatch(*main_io_ctx, [this] { _refreshMd5(); });
+  asio::dispatch(*main_io_ctx, [this, new_md5 = std::move(new_md5), summary = std::move(summary)]() mutable {
+    _refreshMd5(std::move(new_md5), std::move(summary));
+  });
 }
 
-void Server::_refreshMd5() {
-  md5 = calcFileMD5();
+void Server::_refreshMd5(std::string new_md5, std::string summary) {
+  md5 = std::move(new_md5);
 
-  PackMan::instance().refreshSummary();
+  PackMan::instance().setSummary(std::move(summary));
 
   auto &rm = room_manager();
+  // 过期标记变了
+  rm.roomList().updateAll();
   for (auto &[_, room] : rm.getRooms()) {
     if (!room->isOutdated()) continue;
 
@@ -430,9 +490,3 @@ int64_t Server::getUptime() const {
   return now - start_timestamp;
 }
 
-bool Server::nameIsInWhiteList(const std::string_view &name) const {
-  if (!m_config->enableWhitelist) return true;
-  auto obj = db->select(fmt::format(
-    "SELECT name FROM whitelist WHERE name='{}';", name));
-  return !obj.empty();
-}
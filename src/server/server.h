@@ -8,9 +8,15 @@ class ClientSocket;
 class UserManager;
 class RoomManager;
 class RoomThread;
+class Player;
 
 class Shell;
 class Sqlite3;
+class DbExecutor;
+class CpuPartition;
+class GeneralStats;
+class AccessControl;
+class AhoCorasick;
 
 struct ServerConfig {
   std::vector<std::string> banWords;
@@ -25,6 +31,18 @@ struct ServerConfig {
   bool enableWhitelist = false;
   int roomCountPerThread = 2000;
   int maxPlayersPerDevice = 1000;
+  // 把RoomThread和Lua进程绑核，只在启动时生效
+  bool cpuAffinity = false;
+  int reservedCores = 1;  // 留给主线程的物理核心数
+  // 武将胜率每隔多少秒写回一次，以及最多攒多少条更新就提前写回（崩服时最多丢这么多）
+  int generalStatsFlushInterval = 60;
+  int generalStatsMaxPending = 5000;
+  // 大厅人数更新和上下线提示最快多少毫秒发一次
+  int onlineInfoInterval = 500;
+  // 断线重连用的令牌多少秒过期，0为不发令牌
+  int resumeTokenTtl = 3600;
+  // 登录时RSA解密和密码校验的线程数，只在第一次有人登录时生效
+  int authThreads = 2;
 
   void loadConf(const char *json);
 
@@ -55,7 +73,14 @@ public:
   RoomManager &room_manager();
   Sqlite3 &database();
   Sqlite3 &gameDatabase();  // gamedb的getter
+  // 除了shell之外的数据库读写都走这两个
+  DbExecutor &dbExecutor();
+  DbExecutor &gameDbExecutor();
   Shell &shell();
+  CpuPartition &cpuPartition();
+  GeneralStats &generalStats();
+  // 封禁、禁言、白名单都在这里查
+  AccessControl &accessControl();
 
   void sendEarlyPacket(ClientSocket &client, const std::string_view &type, const std::string_view &msg);
 
@@ -68,43 +93,43 @@ public:
   void broadcast(const std::string_view &command, const std::string_view &jsonData);
 
   const ServerConfig &config() const;
+  // 在调用方线程上解析，等主线程换上新的config和违禁词自动机才返回
   void reloadConfig();
   bool checkBanWord(const std::string_view &str);
 
   void temporarilyBan(int playerId);
-  bool isTempBanned(const std::string_view &addr) const;
-  int isMuted(int playerId) const;
-
-  void beginTransaction();
-  void endTransaction();
 
   const std::string &getMd5() const;
+  // 在调用方线程上把md5算完才返回，启动以后别在主线程调
   void refreshMd5();
 
   int64_t getUptime() const;
 
-  bool nameIsInWhiteList(const std::string_view &name) const;
-
 private:
   explicit Server();
   std::unique_ptr<ServerConfig> m_config;
+  std::unique_ptr<AhoCorasick> m_ban_words;  // 随config一起重建
   std::unique_ptr<ServerSocket> m_socket;
 
   std::unique_ptr<Sqlite3> db;
   std::unique_ptr<Sqlite3> gamedb;  // 存档变量
-  std::mutex transaction_mutex;
+  // 要比db先析构，listen时创建
+  std::unique_ptr<DbExecutor> m_db_executor;
+  std::unique_ptr<DbExecutor> m_gamedb_executor;
 
+  // RoomThread析构时要归还核心，得比m_threads活得久
+  std::unique_ptr<CpuPartition> m_cpu_partition;
   std::unordered_map<int, std::shared_ptr<RoomThread>> m_threads;
 
   std::unique_ptr<UserManager> m_user_manager;
   std::unique_ptr<RoomManager> m_room_manager;
 
   std::unique_ptr<Shell> m_shell;
+  std::unique_ptr<GeneralStats> m_general_stats;
+  std::unique_ptr<AccessControl> m_access_control;
 
   io_context *main_io_ctx = nullptr;
 
-  std::vector<std::string> temp_banlist;
-
   std::string md5;
 
   int64_t start_timestamp;
@@ -112,5 +137,6 @@ private:
 
   boost::asio::awaitable<void> heartbeat();
 
-  void _refreshMd5();
+  void _refreshMd5(std::string new_md5, std::string summary);
+  void _temporarilyBan(Player &player, const std::string &addr);
 };
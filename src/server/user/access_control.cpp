@@ -0,0 +1,301 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "server/user/access_control.h"
+#include "server/server.h"
+#include "core/c-wrapper.h"
+#include "core/db_executor.h"
+
+namespace asio = boost::asio;
+
+static int64_t nowSeconds() {
+  using namespace std::chrono;
+  return duration_cast<seconds>(system_clock::now().time_since_epoch()).count();
+}
+
+void AccessControl::load(Sqlite3 &db) {
+  db.query("SELECT ip FROM banip;", {}, [&](const Sqlite3::Row &row) {
+    std::string key;
+    int prefix;
+    auto spec = row.getText(0);
+    if (parseIp(spec, key, prefix)) {
+      m_ip_rules[prefix].insert(std::move(key));
+    } else {
+      spdlog::warn("Ignored invalid banned IP '{}'.", spec);
+    }
+  });
+
+  db.query("SELECT uuid FROM banuuid;", {}, [&](const Sqlite3::Row &row) {
+    m_uuids.emplace(row.getText(0));
+  });
+
+  db.query("SELECT name FROM whitelist;", {}, [&](const Sqlite3::Row &row) {
+    m_whitelist.emplace(row.getText(0));
+  });
+
+  db.query("SELECT id, (SELECT expireAt FROM tempban WHERE uid = id) "
+           "FROM userinfo WHERE banned != 0;", {}, [&](const Sqlite3::Row &row) {
+    int id = row.getInt(0);
+    int64_t expireAt = row.isNull(1) ? 0 : row.getInt(1);
+    m_banned_users[id] = expireAt;
+    if (expireAt) m_expiries.push({ expireAt, UserBan, id, {} });
+  });
+
+  db.query("SELECT uid, type, expireAt FROM tempmute;", {}, [&](const Sqlite3::Row &row) {
+    int id = row.getInt(0);
+    int type = row.isNull(1) ? 1 : row.getInt(1);
+    int64_t expireAt = row.getInt(2);
+    m_mutes[id] = { type, expireAt };
+    m_expiries.push({ expireAt, UserMute, id, {} });
+  });
+
+  auto stats = getStats();
+  spdlog::info("Access control loaded: {} IP rule(s), {} UUID(s), {} banned account(s), "
+               "{} mute(s), {} whitelisted name(s).", stats.ipRules, stats.uuids,
+               stats.users, stats.mutes, stats.whitelist);
+}
+
+bool AccessControl::parseIp(const std::string_view &spec, std::string &key, int &prefix) {
+  auto slash = spec.find('/');
+  auto addr_str = std::string(spec.substr(0, slash));
+
+  boost::system::error_code ec;
+  auto addr = asio::ip::make_address(addr_str, ec);
+  if (ec) return false;
+
+  asio::ip::address_v6::bytes_type bytes;
+  int max_prefix;
+  if (addr.is_v4()) {
+    bytes = asio::ip::make_address_v6(asio::ip::v4_mapped, addr.to_v4()).to_bytes();
+    max_prefix = 32;
+  } else {
+    auto v6 = addr.to_v6();
+    // 监听的是v6，IPv4客户端的地址会是::ffff:a.b.c.d，和v4写法当成一回事
+    max_prefix = v6.is_v4_mapped() ? 32 : 128;
+    bytes = v6.to_bytes();
+  }
+
+  prefix = max_prefix;
+  if (slash != std::string_view::npos) {
+    auto len_str = spec.substr(slash + 1);
+    if (len_str.empty() || len_str.size() > 3 ||
+        !std::all_of(len_str.begin(), len_str.end(), ::isdigit)) {
+      return false;
+    }
+    prefix = atoi(std::string(len_str).c_str());
+    if (prefix > max_prefix) return false;
+  }
+  if (max_prefix == 32) prefix += 96;
+
+  key.assign((const char *)bytes.data(), bytes.size());
+  maskKey(key, prefix);
+  return true;
+}
+
+void AccessControl::maskKey(std::string &key, int prefix) {
+  for (int i = 0; i < 16; i++) {
+    int bits = std::clamp(prefix - i * 8, 0, 8);
+    key[i] &= (char)(0xFF << (8 - bits));
+  }
+}
+
+void AccessControl::purgeExpired() {
+  auto now = nowSeconds();
+  auto &db = Server::instance().dbExecutor();
+
+  while (!m_expiries.empty() && m_expiries.top().at <= now) {
+    auto e = m_expiries.top();
+    m_expiries.pop();
+
+    switch (e.kind) {
+    case TempIp: {
+      auto it = m_temp_ips.find(e.key);
+      if (it != m_temp_ips.end() && it->second == e.at) m_temp_ips.erase(it);
+      break;
+    }
+    case UserBan: {
+      auto it = m_banned_users.find(e.id);
+      if (it == m_banned_users.end() || it->second != e.at) break;
+      m_banned_users.erase(it);
+      db.post([id = e.id](Sqlite3 &db) {
+        db.execute("DELETE FROM tempban WHERE uid=?;", { id });
+        db.execute("UPDATE userinfo SET banned=0 WHERE id=?;", { id });
+      });
+      break;
+    }
+    case UserMute: {
+      auto it = m_mutes.find(e.id);
+      if (it == m_mutes.end() || it->second.expireAt != e.at) break;
+      m_mutes.erase(it);
+      db.post([id = e.id](Sqlite3 &db) {
+        db.execute("DELETE FROM tempmute WHERE uid=?;", { id });
+      });
+      break;
+    }
+    }
+  }
+}
+
+bool AccessControl::isIpBanned(const std::string_view &addr) {
+  std::string key;
+  int prefix;
+  if (!parseIp(addr, key, prefix)) return false;
+
+  // 一般只有寥寥几种前缀长度，每种查一次哈希表
+  for (auto &[len, rules] : m_ip_rules) {
+    auto masked = key;
+    maskKey(masked, len);
+    if (rules.contains(masked)) return true;
+  }
+  return false;
+}
+
+bool AccessControl::isUuidBanned(const std::string_view &uuid) {
+  return m_uuids.contains(std::string(uuid));
+}
+
+bool AccessControl::isWhitelisted(const std::string_view &name) {
+  return m_whitelist.contains(std::string(name));
+}
+
+bool AccessControl::isIpTempBanned(const std::string_view &addr) {
+  purgeExpired();
+
+  std::string key;
+  int prefix;
+  if (!parseIp(addr, key, prefix)) return false;
+  return m_temp_ips.contains(key);
+}
+
+int64_t AccessControl::userBanExpire(int id) {
+  purgeExpired();
+  auto it = m_banned_users.find(id);
+  return it == m_banned_users.end() ? -1 : it->second;
+}
+
+int AccessControl::muteType(int id) {
+  purgeExpired();
+  auto it = m_mutes.find(id);
+  return it == m_mutes.end() ? 0 : it->second.type;
+}
+
+bool AccessControl::banIp(const std::string_view &spec, bool banned) {
+  std::string key;
+  int prefix;
+  if (!parseIp(spec, key, prefix)) return false;
+
+  auto &db = Server::instance().dbExecutor();
+  if (banned) {
+    if (!m_ip_rules[prefix].insert(key).second) return true;
+    db.post([spec = std::string(spec)](Sqlite3 &db) {
+      db.execute("INSERT INTO banip VALUES(?);", { spec });
+    });
+  } else {
+    auto it = m_ip_rules.find(prefix);
+    if (it != m_ip_rules.end()) {
+      it->second.erase(key);
+      if (it->second.empty()) m_ip_rules.erase(it);
+    }
+    // 库里的写法不一定和这次的一样（1.2.3.4/24和1.2.3.0/24、v4和::ffff:写法），
+    // 解析后网段相同的行都删掉，不然重启又封回来了
+    db.post([key, prefix](Sqlite3 &db) {
+      std::vector<std::string> rows;
+      db.query("SELECT ip FROM banip;", {}, [&](const Sqlite3::Row &row) {
+        std::string k;
+        int p;
+        auto ip = row.getText(0);
+        if (parseIp(ip, k, p) && p == prefix && k == key) rows.emplace_back(ip);
+      });
+      for (auto &ip : rows) {
+        db.execute("DELETE FROM banip WHERE ip=?;", { ip });
+      }
+    });
+  }
+  return true;
+}
+
+void AccessControl::tempBanIp(const std::string_view &addr, int64_t seconds) {
+  std::string key;
+  int prefix;
+  if (!parseIp(addr, key, prefix)) return;
+
+  auto expireAt = nowSeconds() + seconds;
+  m_temp_ips[key] = expireAt;
+  m_expiries.push({ expireAt, TempIp, 0, key });
+}
+
+void AccessControl::banUuid(const std::string_view &uuid, bool banned) {
+  auto &db = Server::instance().dbExecutor();
+  if (banned) {
+    if (!m_uuids.emplace(uuid).second) return;
+    db.post([uuid = std::string(uuid)](Sqlite3 &db) {
+      db.execute("INSERT INTO banuuid VALUES(?);", { uuid });
+    });
+  } else {
+    m_uuids.erase(std::string(uuid));
+    db.post([uuid = std::string(uuid)](Sqlite3 &db) {
+      db.execute("DELETE FROM banuuid WHERE uuid=?;", { uuid });
+    });
+  }
+}
+
+void AccessControl::banUser(int id, bool banned, int64_t expireAt) {
+  auto &db = Server::instance().dbExecutor();
+  if (banned) {
+    m_banned_users[id] = expireAt;
+    if (expireAt) m_expiries.push({ expireAt, UserBan, id, {} });
+    db.post([id, expireAt](Sqlite3 &db) {
+      db.execute("UPDATE userinfo SET banned=1 WHERE id=?;", { id });
+      if (expireAt) {
+        db.execute("REPLACE INTO tempban (uid, expireAt) VALUES (?, ?);", { id, expireAt });
+      } else {
+        db.execute("DELETE FROM tempban WHERE uid=?;", { id });
+      }
+    });
+  } else {
+    m_banned_users.erase(id);
+    db.post([id](Sqlite3 &db) {
+      db.execute("UPDATE userinfo SET banned=0 WHERE id=?;", { id });
+      db.execute("DELETE FROM tempban WHERE uid=?;", { id });
+    });
+  }
+}
+
+void AccessControl::mute(int id, int type, int64_t expireAt) {
+  m_mutes[id] = { type, expireAt };
+  m_expiries.push({ expireAt, UserMute, id, {} });
+  Server::instance().dbExecutor().post([=](Sqlite3 &db) {
+    db.execute("REPLACE INTO tempmute (uid, expireAt, type) VALUES (?, ?, ?);",
+               { id, expireAt, type });
+  });
+}
+
+void AccessControl::unmute(int id) {
+  m_mutes.erase(id);
+  Server::instance().dbExecutor().post([id](Sqlite3 &db) {
+    db.execute("DELETE FROM tempmute WHERE uid=?;", { id });
+  });
+}
+
+void AccessControl::setWhitelisted(const std::string_view &name, bool whitelisted) {
+  auto &db = Server::instance().dbExecutor();
+  if (whitelisted) {
+    if (!m_whitelist.emplace(name).second) return;
+    db.post([name = std::string(name)](Sqlite3 &db) {
+      db.execute("INSERT INTO whitelist VALUES (?);", { name });
+    });
+  } else {
+    m_whitelist.erase(std::string(name));
+    db.post([name = std::string(name)](Sqlite3 &db) {
+      db.execute("DELETE FROM whitelist WHERE name=?;", { name });
+    });
+  }
+}
+
+AccessControl::Stats AccessControl::getStats() const {
+  size_t ipRules = 0;
+  for (auto &[_, rules] : m_ip_rules) ipRules += rules.size();
+  return {
+    ipRules, m_temp_ips.size(), m_uuids.size(),
+    m_banned_users.size(), m_mutes.size(), m_whitelist.size(),
+  };
+}
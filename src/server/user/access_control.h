@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+class Sqlite3;
+
+// 封禁/禁言/白名单的内存快照
+// 启动时从数据库整个读进来，连接和登录时的检查只查内存
+// 修改都从这里走（shell、跑路临时封禁等），先改内存再写回数据库
+// 有期限的记录放在一个按到期时间排序的小根堆里，每次检查前顺手清掉过期的
+// 不加锁，只在主线程使用；shell线程要先派到Server::context()上再调
+class AccessControl {
+public:
+  AccessControl() = default;
+  AccessControl(AccessControl &) = delete;
+  AccessControl(AccessControl &&) = delete;
+
+  void load(Sqlite3 &db);
+
+  // ===== 检查 =====
+  // banip表里的地址和网段
+  bool isIpBanned(const std::string_view &addr);
+  // 跑路导致的临时封禁
+  bool isIpTempBanned(const std::string_view &addr);
+  bool isUuidBanned(const std::string_view &uuid);
+  // 不管配置里有没有开白名单
+  bool isWhitelisted(const std::string_view &name);
+  // -1为未封禁，0为永久封禁，否则为解封时间戳（秒）
+  int64_t userBanExpire(int id);
+  // 0为未被禁言，1为完全禁言，2为禁止$开头
+  int muteType(int id);
+
+  // ===== 修改 =====
+  // spec可以是单个地址或者CIDR网段（1.2.3.0/24, 2001:db8::/32），解析不了返回false
+  bool banIp(const std::string_view &spec, bool banned);
+  // 不入库，重启就没了
+  void tempBanIp(const std::string_view &addr, int64_t seconds);
+  void banUuid(const std::string_view &uuid, bool banned);
+  // expireAt为0表示永久
+  void banUser(int id, bool banned, int64_t expireAt = 0);
+  void mute(int id, int type, int64_t expireAt);
+  void unmute(int id);
+  void setWhitelisted(const std::string_view &name, bool whitelisted);
+
+  struct Stats {
+    size_t ipRules, tempIps, uuids, users, mutes, whitelist;
+  };
+  Stats getStats() const;
+
+private:
+  // IPv4统一转成::ffff:a.b.c.d，前缀长度+96；key是按前缀长度掩码后的16字节
+  static bool parseIp(const std::string_view &spec, std::string &key, int &prefix);
+  static void maskKey(std::string &key, int prefix);
+
+  // 前缀长度 -> 该长度下所有被封的网段；单个地址就是128
+  std::map<int, std::unordered_set<std::string>> m_ip_rules;
+  std::unordered_map<std::string, int64_t> m_temp_ips;  // key -> 到期时间
+  std::unordered_set<std::string> m_uuids;
+  std::unordered_set<std::string> m_whitelist;
+  std::unordered_map<int, int64_t> m_banned_users;      // id -> 到期时间，0为永久
+
+  struct Mute { int type; int64_t expireAt; };
+  std::unordered_map<int, Mute> m_mutes;
+
+  enum ExpiryKind { TempIp, UserBan, UserMute };
+  struct Expiry {
+    int64_t at;
+    ExpiryKind kind;
+    int id;
+    std::string key;
+    bool operator>(const Expiry &o) const { return at > o.at; }
+  };
+  // 惰性删除：出堆时和表里现在的到期时间对不上就说明已经被改过了，直接丢掉
+  std::priority_queue<Expiry, std::vector<Expiry>, std::greater<Expiry>> m_expiries;
+
+  void purgeExpired();
+};
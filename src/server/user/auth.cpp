@@ -1,10 +1,12 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include "core/c-wrapper.h"
+#include "core/db_executor.h"
 #include "core/packman.h"
 #include "server/user/auth.h"
 #include "server/user/user_manager.h"
 #include "server/user/player.h"
+#include "server/user/access_control.h"
 #include "server/server.h"
 #include "network/client_socket.h"
 #include "network/router.h"
@@ -14,25 +16,34 @@
 #include <openssl/pem.h>
 #include <openssl/sha.h>
 #include <openssl/md5.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
 
 #include "3rdparty/semver.hpp"
 
+namespace asio = boost::asio;
+using asio::awaitable;
+using asio::use_awaitable;
+
+// 所有连接共用的东西
 struct AuthManagerPrivate {
   AuthManagerPrivate();
   ~AuthManagerPrivate() {
     RSA_free(rsa);
   }
 
-  void reset() {
-    current_idx = 0;
-    name = "";
-    password = "";
-    password_decrypted = "";
-    md5 = "";
-    version = "unknown";
-    uuid = "";
-  }
+  RSA *rsa;
+  unsigned char resume_key[32];
+  // uid -> 最后发出去的令牌的编号；编号全局递增不复用，用过一次或者退出登录就删掉
+  std::unordered_map<int, uint64_t> resume_nonces;
+  uint64_t next_resume_nonce = 1;
+};
 
+// 每个连接一份，认证过程中要跨越好几次数据库查询，所以字符串都自己持有
+struct AuthSession {
   bool is_valid() {
     return current_idx == 5;
   }
@@ -59,23 +70,28 @@ struct AuthManagerPrivate {
     current_idx++;
   }
 
-  RSA *rsa;
-
   // setup message
   std::weak_ptr<ClientSocket> client;
-  std::string_view name;
-  std::string_view password;
-  std::string_view password_decrypted;
-  std::string_view md5;
-  std::string_view version;
-  std::string_view uuid;
+  std::string name;
+  std::string password;
+  std::string md5;
+  std::string version = "unknown";
+  std::string uuid;
+  // 走过KeyExchange的话，password是用它加密的，不是RSA
+  std::string login_key;
+  // 可选的第6项：支持断线补发的客户端带上最后收到的通知序号，首次登录为0
+  int64_t last_seq = -1;
 
   // parsing
-  int current_idx;
+  int current_idx = 0;
 };
 
 AuthManagerPrivate::AuthManagerPrivate() {
   rsa = RSA_new();
+  // 只在本次运行有效，重启后老令牌全部作废，反正玩家也都不在了
+  if (RAND_bytes(resume_key, sizeof(resume_key)) != 1) {
+    throw std::runtime_error("Failed to generate resume token key.");
+  }
   if (!std::filesystem::is_directory("server")) {
     throw std::runtime_error("server/ is not a directory so I can't generate key pairs. Quitting!");
   }
@@ -131,37 +147,372 @@ std::string_view AuthManager::getPublicKeyCbor() const {
 }
 
 void AuthManager::processNewConnection(std::shared_ptr<ClientSocket> conn, Packet &packet) {
+  // 还在等数据库的话，这段时间发来的包都不管
+  if (m_pending.contains(conn.get())) return;
+
+  if (packet.command == "Resume") {
+    // 失败了连接保持不动，客户端可以接着发Setup走正常登录
+    if (!resume(conn, packet)) {
+      Server::instance().sendEarlyPacket(*conn, "ResumeFailed", "");
+    }
+    return;
+  }
+
+  if (packet.command == "KeyExchange") {
+    keyExchange(conn, packet);
+    return;
+  }
+
   conn->timerSignup->cancel();
   auto &server = Server::instance();
+
+  auto session = std::make_shared<AuthSession>();
+  session->client = conn;
+  if (auto it = m_login_keys.find(conn.get()); it != m_login_keys.end()) {
+    // 地址可能被新连接复用了
+    if (it->second.conn.lock() == conn) session->login_key = std::move(it->second.key);
+    m_login_keys.erase(it);
+  }
+
+  if (!loadSetupData(*session, packet)) { return; }
+  if (!checkVersion(*session)) { return; }
+
+  // 剩下的要查数据库，挪到协程里，不阻塞主线程
+  m_pending.insert(conn.get());
+  asio::co_spawn(server.context(), authenticate(session),
+                 [this, raw = conn.get()](std::exception_ptr e) {
+    m_pending.erase(raw);
+    if (e) {
+      try {
+        std::rethrow_exception(e);
+      } catch (const std::exception &ex) {
+        spdlog::error("error occured in authentication: {}", ex.what());
+      }
+    }
+  });
+}
+
+awaitable<void> AuthManager::authenticate(std::shared_ptr<AuthSession> session) {
+  auto &server = Server::instance();
   auto &user_manager = server.user_manager();
 
-  p_ptr->client = conn;
+  if (!checkIfUuidNotBanned(*session)) { co_return; }
+  if (!checkMd5(*session)) { co_return; }
+
+  auto obj = co_await checkPassword(*session);
+  if (obj.id == 0) co_return;
+
+  auto conn = session->client.lock();
+  if (!conn) co_return;
+
+  updateUserLoginData(*session, obj.id);
+  if (!user_manager.createNewPlayer(conn, session->name, obj.avatar, obj.id, session->uuid)) {
+    co_return;
+  }
+
+  if (session->last_seq >= 0) {
+    if (auto player = user_manager.findPlayer(obj.id).lock()) {
+      player->router().setNotifyLogEnabled(true);
+      issueResumeToken(*player);
+    }
+  }
+}
+
+// 在池子里跑f，结果交回发起的协程所在的executor（也就是主线程）；f的签名为 R()
+template <typename F>
+static auto offload(asio::thread_pool &pool, F f) {
+  using R = std::invoke_result_t<F &>;
+  return asio::async_initiate<decltype(use_awaitable), void(R)>(
+    [&pool](auto handler, F f) {
+      // 回到发起方所在的executor，不经过Server::instance()：~Server里join池子时它已经没了
+      auto ex = asio::get_associated_executor(handler);
+      asio::post(pool, [f = std::move(f), ex, handler = std::move(handler)]() mutable {
+        auto result = f();
+        asio::post(ex, [handler = std::move(handler), result = std::move(result)]() mutable {
+          std::move(handler)(std::move(result));
+        });
+      });
+    }, use_awaitable, std::move(f));
+}
+
+// X25519：服务器每个连接现生成一对密钥，和客户端的公钥算出共享密钥，
+// 再用HKDF-SHA256（salt为双方公钥）导出32字节的ChaCha20-Poly1305密钥
+static bool x25519Exchange(std::string_view clientPub, std::string &serverPub, std::string &key) {
+  bool ok = false;
+  EVP_PKEY *own = nullptr, *peer = nullptr;
+  EVP_PKEY_CTX *kctx = nullptr, *dctx = nullptr, *hctx = nullptr;
+  unsigned char secret[32];
+  size_t len = 32;
+  std::string salt;
+
+  peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, nullptr,
+                                     (const u_char *)clientPub.data(), clientPub.size());
+  kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, nullptr);
+  if (!peer || !kctx || EVP_PKEY_keygen_init(kctx) <= 0 || EVP_PKEY_keygen(kctx, &own) <= 0)
+    goto END;
+
+  serverPub.resize(32);
+  if (EVP_PKEY_get_raw_public_key(own, (u_char *)serverPub.data(), &len) <= 0)
+    goto END;
+
+  // 小阶点之类算出全零的，OpenSSL在这里就报错了
+  dctx = EVP_PKEY_CTX_new(own, nullptr);
+  len = sizeof(secret);
+  if (!dctx || EVP_PKEY_derive_init(dctx) <= 0 || EVP_PKEY_derive_set_peer(dctx, peer) <= 0 ||
+      EVP_PKEY_derive(dctx, secret, &len) <= 0)
+    goto END;
+
+  salt = std::string(clientPub) + serverPub;
+  hctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+  key.resize(32);
+  len = 32;
+  if (!hctx || EVP_PKEY_derive_init(hctx) <= 0 ||
+      EVP_PKEY_CTX_set_hkdf_md(hctx, EVP_sha256()) <= 0 ||
+      EVP_PKEY_CTX_set1_hkdf_salt(hctx, (const u_char *)salt.data(), salt.size()) <= 0 ||
+      EVP_PKEY_CTX_set1_hkdf_key(hctx, secret, sizeof(secret)) <= 0 ||
+      EVP_PKEY_CTX_add1_hkdf_info(hctx, (const u_char *)"freekill login", 14) <= 0 ||
+      EVP_PKEY_derive(hctx, (u_char *)key.data(), &len) <= 0)
+    goto END;
+
+  ok = true;
+
+END:
+  OPENSSL_cleanse(secret, sizeof(secret));
+  EVP_PKEY_CTX_free(hctx);
+  EVP_PKEY_CTX_free(dctx);
+  EVP_PKEY_CTX_free(kctx);
+  EVP_PKEY_free(peer);
+  EVP_PKEY_free(own);
+  return ok;
+}
+
+// sealed = nonce(12) + 密文 + tag(16)，附加数据为用户名；明文格式和RSA那边一样
+static std::string openPassword(const std::string &key, std::string_view sealed, std::string_view name) {
+  if (key.size() != 32 || sealed.size() < 12 + 16 || sealed.size() > 4096) return {};
+
+  auto nonce = (const u_char *)sealed.data();
+  auto cipher = nonce + 12;
+  int cipherLen = sealed.size() - 12 - 16;
+  auto tag = cipher + cipherLen;
+
+  std::string out(cipherLen, '\0');
+  int len = 0;
+  bool ok = false;
+  auto ctx = EVP_CIPHER_CTX_new();
+  if (ctx &&
+      EVP_DecryptInit_ex(ctx, EVP_chacha20_poly1305(), nullptr, (const u_char *)key.data(), nonce) > 0 &&
+      EVP_DecryptUpdate(ctx, nullptr, &len, (const u_char *)name.data(), name.size()) > 0 &&
+      EVP_DecryptUpdate(ctx, (u_char *)out.data(), &len, cipher, cipherLen) > 0 &&
+      EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, 16, (void *)tag) > 0 &&
+      EVP_DecryptFinal_ex(ctx, (u_char *)out.data() + len, &len) > 0) {
+    ok = true;
+  }
+  EVP_CIPHER_CTX_free(ctx);
+
+  if (!ok) return {};
+  // RSA那边解出来也是当C字符串用的，保持一致
+  out.resize(strnlen(out.data(), out.size()));
+  return out;
+}
+
+void AuthManager::keyExchange(std::shared_ptr<ClientSocket> conn, const Packet &packet) {
+  // [客户端公钥(bytes 32)]，即 58 20 + 32字节
+  auto data = packet.cborData;
+  if (packet._len != 4 || packet.requestId != -2 ||
+    packet.type != (Router::TYPE_NOTIFICATION | Router::SRC_CLIENT | Router::DEST_SERVER) ||
+    data.size() != 34 || (uint8_t)data[0] != 0x58 || (uint8_t)data[1] != 32)
+  {
+    return;
+  }
+
+  // 每个连接只能协商一次，再来就是在白嫖CPU，直接断开
+  auto it = m_login_keys.find(conn.get());
+  if (it != m_login_keys.end() && it->second.conn.lock() == conn) {
+    spdlog::warn("Repeated KeyExchange from {}, disconnecting", conn->peerAddress());
+    conn->disconnectFromHost();
+    return;
+  }
+
+  // 早就断开了的攒多了再一起清，不用每次都扫一遍
+  if (m_login_keys.size() >= m_login_keys_sweep_at) {
+    std::erase_if(m_login_keys, [](auto &kv) { return kv.second.conn.expired(); });
+    m_login_keys_sweep_at = std::max<size_t>(64, m_login_keys.size() * 2);
+  }
+  // 先占个位，key为空；协商完之前来的Setup还是按RSA处理
+  m_login_keys[conn.get()] = { conn, {} };
+
+  asio::co_spawn(Server::instance().context(),
+                 deriveLoginKey(conn, std::string(data.substr(2))), asio::detached);
+}
+
+awaitable<void> AuthManager::deriveLoginKey(std::weak_ptr<ClientSocket> weak, std::string clientPub) {
+  // 生成密钥对、DH、HKDF都丢到池子里，不占主线程
+  auto [serverPub, key] = co_await offload(cryptoPool(), [clientPub = std::move(clientPub)] {
+    std::pair<std::string, std::string> ret;
+    if (!x25519Exchange(clientPub, ret.first, ret.second)) ret = {};
+    return ret;
+  });
+
+  auto conn = weak.lock();
+  if (!conn || key.empty()) co_return;
+  auto it = m_login_keys.find(conn.get());
+  if (it == m_login_keys.end() || it->second.conn.lock() != conn) co_return;
+
+  it->second.key = std::move(key);
+  Server::instance().sendEarlyPacket(*conn, "KeyExchange", serverPub);
+}
+
+// 令牌：uid(4) connId(4) 编号(8) 过期时间(8)，均为大端，后接32字节HMAC-SHA256
+static constexpr size_t tokenBodySize = 24;
+static constexpr size_t tokenSize = tokenBodySize + 32;
+
+static int64_t nowSeconds() {
+  using namespace std::chrono;
+  return duration_cast<seconds>(system_clock::now().time_since_epoch()).count();
+}
+
+void AuthManager::issueResumeToken(Player &player) {
+  auto ttl = Server::instance().config().resumeTokenTtl;
+  if (ttl <= 0) return;
+
+  // 新令牌一发，之前发的就都作废了
+  uint64_t nonce = p_ptr->next_resume_nonce++;
+  p_ptr->resume_nonces[player.getId()] = nonce;
+
+  int64_t expire = nowSeconds() + ttl;
+  unsigned char token[tokenSize];
+  uint32_t uid = player.getId(), connId = player.getConnId();
+  for (int i = 0; i < 4; i++) {
+    token[i] = uid >> (24 - i * 8);
+    token[4 + i] = connId >> (24 - i * 8);
+  }
+  for (int i = 0; i < 8; i++) {
+    token[8 + i] = nonce >> (56 - i * 8);
+    token[16 + i] = (uint64_t)expire >> (56 - i * 8);
+  }
+
+  unsigned int maclen = 32;
+  HMAC(EVP_sha256(), p_ptr->resume_key, sizeof(p_ptr->resume_key),
+       token, tokenBodySize, token + tokenBodySize, &maclen);
+
+  player.doNotify("ResumeToken", Cbor::encodeArray({
+    std::string_view { (char *)token, tokenSize },
+    expire,
+  }));
+}
+
+bool AuthManager::verifyResumeToken(std::string_view token, int &uid, int &connId) {
+  if (token.size() != tokenSize) return false;
+  auto data = (const unsigned char *)token.data();
+
+  unsigned char mac[32];
+  unsigned int maclen = 32;
+  HMAC(EVP_sha256(), p_ptr->resume_key, sizeof(p_ptr->resume_key),
+       data, tokenBodySize, mac, &maclen);
+  if (CRYPTO_memcmp(mac, data + tokenBodySize, 32) != 0) return false;
+
+  uint32_t u = 0, c = 0;
+  uint64_t nonce = 0, expire = 0;
+  for (int i = 0; i < 4; i++) {
+    u = u << 8 | data[i];
+    c = c << 8 | data[4 + i];
+  }
+  for (int i = 0; i < 8; i++) {
+    nonce = nonce << 8 | data[8 + i];
+    expire = expire << 8 | data[16 + i];
+  }
+  if ((int64_t)expire < nowSeconds()) return false;
+
+  // 只认最后发的那张，并且只能用一次
+  auto it = p_ptr->resume_nonces.find((int)u);
+  if (it == p_ptr->resume_nonces.end() || it->second != nonce) return false;
+
+  uid = (int)u;
+  connId = (int)c;
+  return true;
+}
+
+void AuthManager::revokeResumeToken(int uid) {
+  p_ptr->resume_nonces.erase(uid);
+}
+
+// Resume包：[令牌(bytes), 最后收到的通知序号]
+struct ResumeRequest {
+  std::string token;
+  int64_t last_seq = -1;
+};
+
+static struct cbor_callbacks resumeCallbacks = cbor_empty_callbacks;
+static std::once_flag resumeCallbacksFlag;
+static void initResumeCallbacks() {
+  resumeCallbacks.byte_string = [](void *u, cbor_data data, uint64_t sz) {
+    static_cast<ResumeRequest *>(u)->token = std::string_view { (char *)data, sz };
+  };
+  resumeCallbacks.uint8 = [](void *u, uint8_t v) { static_cast<ResumeRequest *>(u)->last_seq = v; };
+  resumeCallbacks.uint16 = [](void *u, uint16_t v) { static_cast<ResumeRequest *>(u)->last_seq = v; };
+  resumeCallbacks.uint32 = [](void *u, uint32_t v) { static_cast<ResumeRequest *>(u)->last_seq = v; };
+  resumeCallbacks.uint64 = [](void *u, uint64_t v) {
+    static_cast<ResumeRequest *>(u)->last_seq = (int64_t)std::min<uint64_t>(v, INT64_MAX);
+  };
+}
+
+bool AuthManager::resume(std::shared_ptr<ClientSocket> conn, const Packet &packet) {
+  if (packet._len != 4 || packet.requestId != -2 ||
+    packet.type != (Router::TYPE_NOTIFICATION | Router::SRC_CLIENT | Router::DEST_SERVER))
+  {
+    return false;
+  }
+
+  std::call_once(resumeCallbacksFlag, initResumeCallbacks);
+  ResumeRequest req;
+  auto data = packet.cborData;
+  size_t consumed = 0;
+  for (int i = 0; i < 3; i++) {
+    auto res = cbor_stream_decode((cbor_data)data.data() + consumed,
+                                  data.size() - consumed, &resumeCallbacks, &req);
+    if (res.status != CBOR_DECODER_FINISHED) break;
+    consumed += res.read;
+  }
 
-  if (!loadSetupData(packet)) { return; }
-  if (!checkVersion()) { return; }
-  if (!checkIfUuidNotBanned()) { return; }
-  if (!checkMd5()) { return; }
+  int uid, connId;
+  if (!verifyResumeToken(req.token, uid, connId)) return false;
+  // 验过了就作废，下面不管成不成功都不能再拿它来一次
+  revokeResumeToken(uid);
+
+  // 下面全是内存里的检查，不碰数据库
+  auto &server = Server::instance();
+  auto player = server.user_manager().findPlayer(uid).lock();
+  // 不在游戏里的话Player::reconnect也是直接踢，不如让他正常登录
+  if (!player || player->getConnId() != connId || !player->insideGame()) return false;
 
-  auto obj = checkPassword();
-  if (obj.empty()) return;
+  auto &acl = server.accessControl();
+  if (acl.userBanExpire(uid) != -1 || acl.isUuidBanned(player->getUuid())) return false;
 
-  int id = atoi(obj["id"].c_str());
-  updateUserLoginData(id);
-  user_manager.createNewPlayer(conn, p_ptr->name, obj["avatar"], id, p_ptr->uuid);
+  conn->timerSignup->cancel();
+  spdlog::info("Player {} resumed session from {}", uid, conn->peerAddress());
+  player->reconnect(conn, req.last_seq);
+  issueResumeToken(*player);
+  return true;
 }
 
 static struct cbor_callbacks callbacks = cbor_empty_callbacks;
 static std::once_flag callbacks_flag;
 static void init_callbacks() {
   callbacks.string = [](void *u, cbor_data data, uint64_t sz) {
-    static_cast<AuthManagerPrivate *>(u)->handle(data, sz);
+    static_cast<AuthSession *>(u)->handle(data, sz);
   };
   callbacks.byte_string = [](void *u, cbor_data data, uint64_t sz) {
-    static_cast<AuthManagerPrivate *>(u)->handle(data, sz);
+    static_cast<AuthSession *>(u)->handle(data, sz);
+  };
+  callbacks.uint8 = [](void *u, uint8_t v) { static_cast<AuthSession *>(u)->last_seq = v; };
+  callbacks.uint16 = [](void *u, uint16_t v) { static_cast<AuthSession *>(u)->last_seq = v; };
+  callbacks.uint32 = [](void *u, uint32_t v) { static_cast<AuthSession *>(u)->last_seq = v; };
+  callbacks.uint64 = [](void *u, uint64_t v) {
+    static_cast<AuthSession *>(u)->last_seq = (int64_t)std::min<uint64_t>(v, INT64_MAX);
   };
 }
 
-bool AuthManager::loadSetupData(const Packet &packet) {
+bool AuthManager::loadSetupData(AuthSession &session, const Packet &packet) {
   std::call_once(callbacks_flag, init_callbacks);
   auto data = packet.cborData;
   cbor_decoder_result res;
@@ -174,14 +525,13 @@ bool AuthManager::loadSetupData(const Packet &packet) {
     goto FAIL;
   }
 
-  p_ptr->reset();
-  // 一个array带5个bytes 懒得判那么细了解析出5个就行
-  for (int i = 0; i < 6; i++) {
+  // 一个array带5个bytes 懒得判那么细了解析出5个就行；新客户端还会多带一个序号
+  for (int i = 0; i < 7; i++) {
     res = cbor_stream_decode(
       (cbor_data)data.data() + consumed,
       data.size() - consumed,
       &callbacks,
-      p_ptr.get()
+      &session
     );
     if (res.status != CBOR_DECODER_FINISHED) {
       break;
@@ -189,15 +539,15 @@ bool AuthManager::loadSetupData(const Packet &packet) {
     consumed += res.read;
   }
 
-  if (!p_ptr->is_valid()) {
+  if (!session.is_valid()) {
     goto FAIL;
   }
 
   return true;
 
 FAIL:
-  spdlog::warn("Invalid setup string: version={}", p_ptr->version);
-  if (auto client = p_ptr->client.lock()) {
+  spdlog::warn("Invalid setup string: version={}", session.version);
+  if (auto client = session.client.lock()) {
     Server::instance().sendEarlyPacket(*client, "ErrorDlg", "INVALID SETUP STRING");
     client->disconnectFromHost();
   }
@@ -205,16 +555,16 @@ FAIL:
   return false;
 }
 
-bool AuthManager::checkVersion() {
+bool AuthManager::checkVersion(AuthSession &session) {
   semver::range_set range;
   semver::parse(">=0.5.14 <0.6.0", range);
 
-  auto client = p_ptr->client.lock();
+  auto client = session.client.lock();
   if (!client) return false;
 
   const char *errmsg;
 
-  auto &ver = p_ptr->version;
+  auto &ver = session.version;
   semver::version version;
   if (semver::parse(ver, version) && range.contains(version)) {
     return true;
@@ -228,31 +578,27 @@ bool AuthManager::checkVersion() {
 }
 
 
-bool AuthManager::checkIfUuidNotBanned() {
+bool AuthManager::checkIfUuidNotBanned(AuthSession &session) {
   auto &server = Server::instance();
-  auto &db = server.database();
-  auto uuid_str = p_ptr->uuid;
+  auto &uuid_str = session.uuid;
   if (!Sqlite3::checkString(uuid_str)) return false;
 
-  auto result2 = db.select(
-    fmt::format("SELECT * FROM banuuid WHERE uuid='{}';", uuid_str));
+  if (!server.accessControl().isUuidBanned(uuid_str)) return true;
 
-  if (result2.empty()) return true;
-
-  if (auto client = p_ptr->client.lock(); client) {
-    Server::instance().sendEarlyPacket(*client, "ErrorDlg", "you have been banned!");
+  if (auto client = session.client.lock(); client) {
+    server.sendEarlyPacket(*client, "ErrorDlg", "you have been banned!");
     spdlog::info("Refused banned UUID: {}", uuid_str);
     client->disconnectFromHost();
   }
   return false;
 }
 
-bool AuthManager::checkMd5() {
+bool AuthManager::checkMd5(AuthSession &session) {
   auto &server = Server::instance();
-  auto md5_str = p_ptr->md5;
+  auto &md5_str = session.md5;
 
   if (server.getMd5() != md5_str) {
-    if (auto client = p_ptr->client.lock()) {
+    if (auto client = session.client.lock()) {
       server.sendEarlyPacket(*client, "ErrorMsg", "MD5 check failed!");
       server.sendEarlyPacket(*client, "UpdatePackage", PackMan::instance().summary());
       client->disconnectFromHost();
@@ -263,22 +609,93 @@ bool AuthManager::checkMd5() {
   return true;
 }
 
-std::map<std::string, std::string> AuthManager::queryUserInfo(const std::string_view &password) {
-  auto &server = Server::instance();
-  auto &db = server.database();
+static std::string sha256Hex(const std::string &str) {
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  SHA256((const u_char *)str.data(), str.size(), hash);
+
+  std::string ret;
+  ret.reserve(64);
+  for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+    char buf[3];
+    snprintf(buf, sizeof(buf), "%02x", hash[i]);
+    ret += buf;
+  }
+  return ret;
+}
+
+// RSA解密和密码哈希，都是纯CPU活
+
+static std::string rsaDecrypt(RSA *rsa, std::string_view encrypted) {
+  // 长度不对的话RSA_private_decrypt会读越界
+  if (encrypted.size() != (size_t)RSA_size(rsa)) return {};
+
+  char buf[4096] = {0};
+  RSA_private_decrypt(
+    RSA_size(rsa), (const u_char *)encrypted.data(),
+    (u_char *)buf, rsa, RSA_PKCS1_PADDING
+  );
+  return std::string { buf };
+}
+
+// 每个工作线程自己一份私钥，免得所有线程抢同一个RSA的blinding锁
+static RSA *threadRsa(RSA *rsa) {
+  thread_local std::unique_ptr<RSA, decltype(&RSA_free)> copy { nullptr, RSA_free };
+  if (!copy) copy.reset(RSAPrivateKey_dup(rsa));
+  return copy ? copy.get() : rsa;
+}
+
+asio::thread_pool &AuthManager::cryptoPool() {
+  std::call_once(m_crypto_pool_once, [this] {
+    auto n = std::max(Server::instance().config().authThreads, 1);
+    m_crypto_pool = std::make_unique<asio::thread_pool>(n);
+  });
+  return *m_crypto_pool;
+}
+
+std::string AuthManager::decryptPasswordSync(std::string_view encrypted) {
+  return rsaDecrypt(p_ptr->rsa, encrypted);
+}
+
+awaitable<std::string> AuthManager::decryptPassword(std::string encrypted) {
+  co_return co_await offload(cryptoPool(), [rsa = p_ptr->rsa, encrypted = std::move(encrypted)] {
+    return rsaDecrypt(threadRsa(rsa), encrypted);
+  });
+}
+
+bool AuthManager::verifyPasswordSync(const std::string &password, const std::string &salt, const std::string &hash) {
+  return sha256Hex(password + salt) == hash;
+}
+
+awaitable<bool> AuthManager::verifyPassword(std::string password, std::string salt, std::string hash) {
+  co_return co_await offload(cryptoPool(), [password = std::move(password),
+                             salt = std::move(salt), hash = std::move(hash)] {
+    return sha256Hex(password + salt) == hash;
+  });
+}
 
-  auto sql_find = fmt::format("SELECT * FROM userinfo WHERE name='{}';", p_ptr->name);
-  auto sql_count_uuid =
-    fmt::format("SELECT COUNT() AS cnt FROM uuidinfo WHERE uuid='{}';", p_ptr->uuid);
+static constexpr const char *sql_find_user =
+  "SELECT id, password, salt, avatar FROM userinfo WHERE name=?;";
+
+// 在DB线程上执行，查询+注册一次做完，不会有两个连接同时注册同一个名字
+static AuthManager::UserInfo queryOrRegister(Sqlite3 &db, const std::string &name,
+    const std::string &password, const std::string &uuid, const std::string &addr) {
+  AuthManager::UserInfo info;
+  auto readUser = [&](const Sqlite3::Row &row) {
+    info.id = row.getInt(0);
+    info.password = row.getText(1);
+    info.salt = row.getText(2);
+    info.avatar = row.getText(3);
+  };
 
-  auto result = db.select(sql_find);
-  if (!result.empty()) return result[0];
+  db.query(sql_find_user, { name }, readUser);
+  if (info.id != 0) return info;
 
   // 以下为注册流程
 
-  auto result2 = db.select(sql_count_uuid);
-  auto num = atoi(result2[0]["cnt"].c_str());
-  if (num >= server.config().maxPlayersPerDevice) {
+  int64_t num = 0;
+  db.query("SELECT COUNT() FROM uuidinfo WHERE uuid=?;", { uuid },
+           [&](const Sqlite3::Row &row) { num = row.getInt(0); });
+  if (num >= Server::instance().config().maxPlayersPerDevice) {
     return {};
   }
 
@@ -290,99 +707,64 @@ std::map<std::string, std::string> AuthManager::queryUserInfo(const std::string_
     snprintf(saltbuf, 9, "%08x", dis(gen));
   }
 
-  auto pw = std::string(password) + saltbuf;
-  unsigned char hash[SHA256_DIGEST_LENGTH];
-  SHA256((const u_char *)pw.data(), pw.size(), hash);
+  auto passwordHash = sha256Hex(password + saltbuf);
 
-  std::string passwordHash;
-  passwordHash.reserve(64);
-  for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
-    char buf[3];
-    snprintf(buf, sizeof(buf), "%02x", hash[i]);
-    passwordHash += buf;
+  if (!db.execute("INSERT INTO userinfo "
+                  "(name, password, salt, avatar, lastLoginIp, banned) "
+                  "VALUES (?, ?, ?, 'liubei', ?, FALSE);",
+                  { name, passwordHash, saltbuf, addr })) {
+    return {};
   }
 
-  auto sql_reg = fmt::format(
-    "INSERT INTO userinfo "
-    "(name, password, salt, avatar, lastLoginIp, banned) "
-    "VALUES ('{}','{}','{}','{}','{}',{});",
-
-    p_ptr->name,
-    passwordHash,
-    saltbuf,
-    "liubei",
-    p_ptr->client.lock()->peerAddress(),
-    "FALSE"
-  );
-
-  db.exec(sql_reg);
-
-  result = db.select(sql_find);
-  auto obj = result[0];
-
   using namespace std::chrono;
   auto now = system_clock::now();
-  auto timestamp = duration_cast<seconds>(now.time_since_epoch()).count();
-  auto info_update = fmt::format(
-    "INSERT INTO usergameinfo (id, registerTime) VALUES ({}, {});",
-    obj["id"], timestamp
-  );
-  db.exec(info_update);
+  int64_t timestamp = duration_cast<seconds>(now.time_since_epoch()).count();
+  db.execute("INSERT INTO usergameinfo (id, registerTime) VALUES (?, ?);",
+             { db.lastInsertRowId(), timestamp });
 
-  return result[0];
+  db.query(sql_find_user, { name }, readUser);
+  return info;
 }
 
-std::string AuthManager::getBanExpire(std::map<std::string, std::string> &info) {
+awaitable<AuthManager::UserInfo> AuthManager::queryUserInfo(AuthSession &session, const std::string &password) {
   auto &server = Server::instance();
-  auto &db = server.database();
+  auto &db = server.dbExecutor();
 
-  auto result = db.select(fmt::format(
-    "SELECT uid, expireAt FROM tempban WHERE uid={};",
-    info["id"]
-  ));
-  if (result.empty()) return "forever";
+  auto client = session.client.lock();
+  if (!client) co_return UserInfo {};
 
+  co_return co_await db.run([name = session.name, password, uuid = session.uuid,
+                            addr = std::string(client->peerAddress())](Sqlite3 &db) {
+    return queryOrRegister(db, name, password, uuid, addr);
+  }, use_awaitable);
+}
+
+static std::string formatBanExpire(int64_t expire) {
   using namespace std::chrono;
-  int64_t expire = atoll(result[0]["expireAt"].c_str());
   auto tp = system_clock::time_point(seconds(expire));
-
-  if (tp <= system_clock::now()) {
-    db.exec(fmt::format(
-      "DELETE FROM tempban WHERE uid={};",
-      info["id"]
-    ));
-    db.exec(fmt::format(
-      "UPDATE userinfo SET banned=0 WHERE id={};",
-      info["id"]
-    ));
-    return "expired";
-  }
-
   std::time_t now_time_t = system_clock::to_time_t(tp);
   std::tm local_tm = *std::localtime(&now_time_t);
 
   return fmt::format("{:04}-{:02}-{:02} {:02}:{:02}:{:02}.",
                local_tm.tm_year + 1900, local_tm.tm_mon + 1, local_tm.tm_mday,
                local_tm.tm_hour, local_tm.tm_min, local_tm.tm_sec);
-
 }
 
-std::map<std::string, std::string> AuthManager::checkPassword() {
+awaitable<AuthManager::UserInfo> AuthManager::checkPassword(AuthSession &session) {
   auto &server = Server::instance();
   auto &um = server.user_manager();
   bool passed = false;
   std::string error_msg = "";
 
-  // p_ptr的数据
-  auto client = p_ptr->client.lock();
-  auto name = p_ptr->name;
+  // session的数据
+  auto client = session.client.lock();
+  auto &name = session.name;
 
   // 密码相关数据
   std::string decrypted_pw;
-  std::string passwordHash;
 
   // 数据库查询结果
-  std::map<std::string, std::string> obj;
+  UserInfo obj;
 
   if (!client) {
     goto FAIL;
@@ -395,18 +777,16 @@ std::map<std::string, std::string> AuthManager::checkPassword() {
     goto FAIL;
   }
 
-  if (!server.nameIsInWhiteList(name)) {
+  if (server.config().enableWhitelist && !server.accessControl().isWhitelisted(name)) {
     error_msg = "user name not in whitelist";
     goto FAIL;
   }
 
-  {
-    char buf[4096] = {0};
-    RSA_private_decrypt(
-      RSA_size(p_ptr->rsa), (const u_char *)p_ptr->password.data(),
-      (u_char *)buf, p_ptr->rsa, RSA_PKCS1_PADDING
-    );
-    decrypted_pw = std::string { buf };
+  if (!session.login_key.empty()) {
+    // 对称解密，比RSA便宜得多，直接在主线程做
+    decrypted_pw = openPassword(session.login_key, session.password, name);
+  } else {
+    decrypted_pw = co_await decryptPassword(session.password);
   }
 
   if (decrypted_pw.size() > 32) {
@@ -422,52 +802,51 @@ std::map<std::string, std::string> AuthManager::checkPassword() {
     goto FAIL;
   }
 
-  obj = queryUserInfo(decrypted_pw);
-  if (obj.empty()) {
+  obj = co_await queryUserInfo(session, decrypted_pw);
+  if (obj.id == 0) {
     error_msg = "cannot register more new users on this device";
     goto FAIL;
   }
 
-  // check ban account
-  if (obj["banned"] != "0") {
-    auto expiry = getBanExpire(obj);
-    if (expiry == "expired") {
-      // 无事发生
-    } else if (expiry == "forever") {
-      passed = false;
+  // check ban account；到期的封禁在这里面就顺手解掉了
+  if (auto expire = server.accessControl().userBanExpire(obj.id); expire >= 0) {
+    passed = false;
+    if (expire == 0) {
       error_msg = "you have been banned!";
-      goto FAIL;
     } else {
-      passed = false;
-      error_msg = fmt::format("[\"you have been banned! expire at %1\", \"{}\"]", expiry);
-      goto FAIL;
+      error_msg = fmt::format("[\"you have been banned! expire at %1\", \"{}\"]",
+                              formatBanExpire(expire));
     }
+    goto FAIL;
   }
 
   // check if password is the same
-  decrypted_pw += obj["salt"];
-  unsigned char hash[SHA256_DIGEST_LENGTH];
-  SHA256((const u_char *)decrypted_pw.data(), decrypted_pw.size(), hash);
-
-  passwordHash.reserve(64);
-  for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
-    char buf[3];
-    snprintf(buf, sizeof(buf), "%02x", hash[i]);
-    passwordHash += buf;
-  }
-  passed = (passwordHash == obj["password"]);
+  passed = co_await verifyPassword(decrypted_pw, obj.salt, obj.password);
   if (!passed) {
     error_msg = "username or password error";
     goto FAIL;
   }
 
-  if (auto player = um.findPlayer(atoi(obj["id"].c_str())).lock(); player) {
+  // 等数据库的时候可能已经断开了
+  client = session.client.lock();
+  if (!client) {
+    passed = false;
+    goto FAIL;
+  }
+
+  if (auto player = um.findPlayer(obj.id).lock(); player) {
 
     if (player->insideGame()) {
-      updateUserLoginData(player->getId());
-      player->reconnect(client);
+      updateUserLoginData(session, player->getId());
+      player->reconnect(client, session.last_seq);
+      // 用密码重新登录了，旧令牌一律作废
+      if (session.last_seq >= 0) {
+        issueResumeToken(*player);
+      } else {
+        revokeResumeToken(player->getId());
+      }
       passed = true;
-      return {};
+      co_return UserInfo {};
     } else if (player->isOnline()) {
       player->doNotify("ErrorDlg", "others logged in again with this name");
       player->emitKicked();
@@ -482,43 +861,35 @@ std::map<std::string, std::string> AuthManager::checkPassword() {
 
 FAIL:
   if (!passed) {
-    if (auto c = p_ptr->client.lock(); c) {
+    if (auto c = session.client.lock(); c) {
       spdlog::info("{} lost connection: {}", c->peerAddress(), error_msg);
       server.sendEarlyPacket(*c, "ErrorDlg", error_msg);
       c->disconnectFromHost();
     }
-    return {};
+    co_return UserInfo {};
   }
 
-  return obj;
+  co_return obj;
 }
 
-void AuthManager::updateUserLoginData(int id) {
+void AuthManager::updateUserLoginData(AuthSession &session, int id) {
   auto &server = Server::instance();
-  auto &db = server.database();
-  auto client = p_ptr->client.lock();
+  auto &db = server.dbExecutor();
+  auto client = session.client.lock();
   if (!client) return;
 
-  server.beginTransaction();
-
-  auto sql_update = fmt::format(
-    "UPDATE userinfo SET lastLoginIp='{}' WHERE id={};", client->peerAddress(), id);
-  db.exec(sql_update);
-
-  auto uuid_update = fmt::format(
-    "REPLACE INTO uuidinfo (id, uuid) VALUES ({}, '{}');", id, p_ptr->uuid);
-  db.exec(uuid_update);
-
-  // 来晚了，有很大可能存在已经注册但是表里面没数据的人
-  db.exec(fmt::format("INSERT OR IGNORE INTO usergameinfo (id) VALUES ({});", id));
-
   using namespace std::chrono;
   auto now = system_clock::now();
-  auto timestamp = duration_cast<seconds>(now.time_since_epoch()).count();
-  auto info_update = fmt::format(
-    "UPDATE usergameinfo SET lastLoginTime={} where id={};", timestamp, id);
-  db.exec(info_update);
-
-  server.endTransaction();
+  int64_t timestamp = duration_cast<seconds>(now.time_since_epoch()).count();
+
+  // 会被DB线程合并进同一个事务
+  db.post([id, timestamp, addr = std::string(client->peerAddress()),
+           uuid = session.uuid](Sqlite3 &db) {
+    db.execute("UPDATE userinfo SET lastLoginIp=? WHERE id=?;", { addr, id });
+    db.execute("REPLACE INTO uuidinfo (id, uuid) VALUES (?, ?);", { id, uuid });
+
+    // 来晚了，有很大可能存在已经注册但是表里面没数据的人
+    db.execute("INSERT OR IGNORE INTO usergameinfo (id) VALUES (?);", { id });
+    db.execute("UPDATE usergameinfo SET lastLoginTime=? WHERE id=?;", { timestamp, id });
+  });
 }
-
@@ -5,8 +5,10 @@
 class Server;
 class Sqlite3;
 class ClientSocket;
+class Player;
 
 struct AuthManagerPrivate;
+struct AuthSession;
 
 struct Packet;
 
@@ -21,20 +23,66 @@ public:
 
   void processNewConnection(std::shared_ptr<ClientSocket> conn, Packet &packet);
 
+  // 断线重连令牌：HMAC(uid, connId, 编号, 过期时间)，密钥每次启动随机生成
+  // 登录成功后发给支持的客户端（Setup带了序号的），重连时发"Resume"包带上令牌，
+  // 验证通过就直接Player::reconnect，不用RSA解密也不用查库
+  // 每张令牌只能用一次，每个玩家只有最后发的那张有效
+  void issueResumeToken(Player &player);
+  // 退出登录时调用
+  void revokeResumeToken(int uid);
+
+  // 登录里吃CPU的两步，放到authThreads个线程的池子里做，做完回到主线程
+  // 服务器重启时几千人同时登录，主线程上别的玩家就不用陪着等RSA了
+  boost::asio::awaitable<std::string> decryptPassword(std::string encrypted);
+  boost::asio::awaitable<bool> verifyPassword(std::string password, std::string salt, std::string hash);
+  // 在调用线程上直接做，benchlogin拿来对比
+  std::string decryptPasswordSync(std::string_view encrypted);
+  bool verifyPasswordSync(const std::string &password, const std::string &salt, const std::string &hash);
+
+  // userinfo表里认证要用的几列，id为0表示没查到/认证失败
+  struct UserInfo {
+    int id = 0;
+    std::string password;
+    std::string salt;
+    std::string avatar;
+  };
+
 private:
   std::string public_key_cbor;
   std::unique_ptr<AuthManagerPrivate> p_ptr;
 
-  bool loadSetupData(const Packet &packet);
-  bool checkVersion();
+  // 正在走认证协程的连接
+  std::unordered_set<ClientSocket *> m_pending;
+
+  // benchlogin会从shell线程用到，第一次创建要防着两边一起来
+  std::once_flag m_crypto_pool_once;
+  std::unique_ptr<boost::asio::thread_pool> m_crypto_pool;
+  boost::asio::thread_pool &cryptoPool();
+
+  boost::asio::awaitable<void> authenticate(std::shared_ptr<AuthSession> session);
+
+  // 新客户端在Setup之前先发KeyExchange，之后Setup里的密码用X25519协商出的密钥加密
+  // 协商好的密钥先放这，等Setup来了再挪进AuthSession
+  struct PendingKey {
+    std::weak_ptr<ClientSocket> conn;
+    std::string key;
+  };
+  std::unordered_map<ClientSocket *, PendingKey> m_login_keys;
+  size_t m_login_keys_sweep_at = 64;
+  void keyExchange(std::shared_ptr<ClientSocket> conn, const Packet &packet);
+  boost::asio::awaitable<void> deriveLoginKey(std::weak_ptr<ClientSocket> conn, std::string clientPub);
+
+  bool resume(std::shared_ptr<ClientSocket> conn, const Packet &packet);
+  bool verifyResumeToken(std::string_view token, int &uid, int &connId);
 
-  bool checkIfUuidNotBanned();
-  bool checkMd5();
+  bool loadSetupData(AuthSession &session, const Packet &packet);
+  bool checkVersion(AuthSession &session);
 
-  std::string getBanExpire(std::map<std::string, std::string> &info);
+  bool checkIfUuidNotBanned(AuthSession &session);
+  bool checkMd5(AuthSession &session);
 
-  std::map<std::string, std::string> checkPassword();
-  std::map<std::string, std::string> queryUserInfo(const std::string_view &decrypted_pw);
+  boost::asio::awaitable<UserInfo> checkPassword(AuthSession &session);
+  boost::asio::awaitable<UserInfo> queryUserInfo(AuthSession &session, const std::string &decrypted_pw);
 
-  void updateUserLoginData(int id);
+  void updateUserLoginData(AuthSession &session, int id);
 };
@@ -2,6 +2,7 @@
 
 #include "server/user/player.h"
 #include "server/user/user_manager.h"
+#include "server/user/save_states.h"
 #include "server/server.h"
 #include "server/gamelogic/roomthread.h"
 #include "server/room/room_manager.h"
@@ -12,13 +13,12 @@
 #include "network/router.h"
 
 #include "core/c-wrapper.h"
+#include "core/db_executor.h"
 #include "core/util.h"
 
 namespace asio = boost::asio;
 using namespace std::chrono;
 
-static int nextConnId = 1000;
-
 Player::Player() {
   m_router = std::make_unique<Router>(this, nullptr, Router::TYPE_SERVER);
 
@@ -27,9 +27,6 @@ Player::Player() {
 
   roomId = 0;
 
-  connId = nextConnId++;
-  if (nextConnId >= 0x7FFFFF00) nextConnId = 1000;
-
   ttl = max_ttl;
   m_thinking = false;
 
@@ -38,6 +35,15 @@ Player::Player() {
   gameTimerStartTimestamp = duration_cast<seconds>(now.time_since_epoch()).count();
 }
 
+Player::Player(RobotTag) {
+  state = Robot;
+  roomId = 0;
+  m_thinking = false;
+
+  auto now = system_clock::now();
+  gameTimerStartTimestamp = duration_cast<seconds>(now.time_since_epoch()).count();
+}
+
 Player::~Player() {
   // spdlog::debug("[MEMORY] Player {} (connId={} state={}) destructed", id, connId, getStateString());
   auto room = getRoom().lock();
@@ -55,24 +61,30 @@ Player::~Player() {
 
 int Player::getId() const { return id; }
 
-void Player::setId(int id) { this->id = id; }
+void Player::setId(int id) {
+  this->id = id;
+  invalidateCbor();
+}
 
 std::string_view Player::getScreenName() const { return screenName; }
 
 void Player::setScreenName(const std::string &name) {
   this->screenName = name;
+  invalidateCbor();
 }
 
 std::string_view Player::getAvatar() const { return avatar; }
 
 void Player::setAvatar(const std::string &avatar) {
   this->avatar = avatar;
+  invalidateCbor();
 }
 
 int Player::getTotalGameTime() const { return totalGameTime; }
 
 void Player::addTotalGameTime(int toAdd) {
   totalGameTime += toAdd;
+  invalidateCbor();
 }
 
 Player::State Player::getState() const { return state; }
@@ -98,7 +110,7 @@ std::string_view Player::getStateString() const {
 
 
 bool Player::isOnline() const {
-  return m_router->getSocket() != nullptr;
+  return getSocket() != nullptr;
 }
 
 bool Player::insideGame() {
@@ -111,6 +123,7 @@ void Player::setState(Player::State state) {
   this->state = state;
 
   if (old_state != state) {
+    invalidateCbor();
     // QT祖宗之法不可变
     onStateChanged();
   }
@@ -131,6 +144,76 @@ void Player::setGameData(int total, int win, int run) {
   totalGames = total;
   winCount = win;
   runCount = run;
+  invalidateCbor();
+}
+
+void Player::invalidateCbor() {
+  m_cbor_version.fetch_add(1, std::memory_order_release);
+}
+
+// 调用者持有m_cbor_mutex
+void Player::encodeCbor() {
+  auto version = m_cbor_version.load(std::memory_order_acquire);
+  if (version == m_cbor_cached_version) return;
+
+  auto &ret = m_cbor_cache;
+  ret.clear();
+  ret.reserve(256);
+
+  u_char buf[10]; size_t buflen;
+
+  ret.push_back('\xA7');
+  ret += "\x46" "connId";
+  buflen = cbor_encode_uint(connId, buf, 10);
+  ret += std::string_view { (char *)buf, buflen };
+
+  ret += "\x42id";
+  buflen = cbor_encode_uint(id, buf, 10);
+  ret += std::string_view { (char *)buf, buflen };
+
+  ret += "\x4AscreenName";
+  buflen = cbor_encode_uint(screenName.size(), buf, 10);
+  buf[0] += 0x40;
+  ret += std::string_view { (char *)buf, buflen };
+  ret += screenName;
+
+  ret += "\x46" "avatar";
+  buflen = cbor_encode_uint(avatar.size(), buf, 10);
+  buf[0] += 0x40;
+  ret += std::string_view { (char *)buf, buflen };
+  ret += avatar;
+
+  ret += "\x4DtotalGameTime";
+  buflen = cbor_encode_uint(totalGameTime, buf, 10);
+  ret += std::string_view { (char *)buf, buflen };
+
+  ret += "\x45state";
+  buflen = cbor_encode_uint(state, buf, 10);
+  ret += std::string_view { (char *)buf, buflen };
+
+  ret += "\x48gameData";
+  ret += "\x83";
+  buflen = cbor_encode_uint(totalGames, buf, 10);
+  ret += std::string_view { (char *)buf, buflen };
+  buflen = cbor_encode_uint(winCount, buf, 10);
+  ret += std::string_view { (char *)buf, buflen };
+  buflen = cbor_encode_uint(runCount, buf, 10);
+  ret += std::string_view { (char *)buf, buflen };
+
+  // 编码期间又被改了的话版本号对不上，下次还会重新编码
+  m_cbor_cached_version = version;
+}
+
+std::string Player::getCborObject() {
+  std::lock_guard<std::mutex> lock { m_cbor_mutex };
+  encodeCbor();
+  return m_cbor_cache;
+}
+
+void Player::appendCborObject(std::string &out) {
+  std::lock_guard<std::mutex> lock { m_cbor_mutex };
+  encodeCbor();
+  out += m_cbor_cache;
 }
 
 std::string_view Player::getLastGameMode() const {
@@ -159,6 +242,11 @@ void Player::setRunned(bool run) {
 
 int Player::getConnId() const { return connId; }
 
+void Player::setConnId(int connId) {
+  this->connId = connId;
+  invalidateCbor();
+}
+
 std::weak_ptr<RoomBase> Player::getRoom() const {
   auto &room_manager = Server::instance().room_manager();
   if (roomId == 0) {
@@ -175,6 +263,10 @@ Router &Player::router() const {
   return *m_router;
 }
 
+std::shared_ptr<ClientSocket> Player::getSocket() const {
+  return m_router ? m_router->getSocket() : nullptr;
+}
+
 // std::string_view Player::getPeerAddress() const {
 //   auto p = server->findPlayer(getId());
 //   if (!p || p->getState() != Player::Online)
@@ -192,7 +284,7 @@ void Player::setUuid(const std::string &uuid) {
 
 void Player::doRequest(const std::string_view &command,
                        const std::string_view &jsonData, int timeout, int64_t timestamp) {
-  if (getState() != Player::Online)
+  if (getState() != Player::Online || !m_router)
     return;
 
   int type = Router::TYPE_REQUEST | Router::SRC_SERVER | Router::DEST_CLIENT;
@@ -201,7 +293,7 @@ void Player::doRequest(const std::string_view &command,
 
 std::string Player::waitForReply(int timeout) {
   std::string ret;
-  if (getState() != Player::Online) {
+  if (getState() != Player::Online || !m_router) {
     ret = "__cancel";
   } else {
     ret = m_router->waitForReply(timeout);
@@ -210,7 +302,8 @@ std::string Player::waitForReply(int timeout) {
 }
 
 void Player::doNotify(const std::string_view &command, const std::string_view &data) {
-  if (!isOnline())
+  // 开了NotifyLog的话断线期间的也要记下，重连时补发
+  if (!isOnline() && !(m_router && m_router->notifyLogEnabled()))
     return;
 
   // spdlog::debug("[TX](id={} connId={} state={} Room={}): {} {}", id, connId, getStateString(), roomId, command, toHex(data));
@@ -221,6 +314,13 @@ void Player::doNotify(const std::string_view &command, const std::string_view &d
   m_router->notify(type, command, data == "" ? "\xF6" : data);
 }
 
+void Player::sendFrame(std::shared_ptr<std::string> frame) {
+  if (!isOnline())
+    return;
+
+  m_router->sendFrame(std::move(frame));
+}
+
 bool Player::thinking() {
   std::lock_guard<std::mutex> locker { m_thinking_mutex };
   return m_thinking;
@@ -244,9 +344,9 @@ void Player::onNotificationGot(const Packet &packet) {
 
 void Player::onDisconnected() {
   spdlog::info("Player {} disconnected{}", id,
-               m_router->getSocket() != nullptr ? "" : " (pseudo)");
+               isOnline() ? "" : " (pseudo)");
 
-  m_router->setSocket(nullptr);
+  if (m_router) m_router->setSocket(nullptr);
   setState(Player::Offline);
   if (insideGame() && !isDied()) {
     setRunned(true);
@@ -255,7 +355,7 @@ void Player::onDisconnected() {
   auto &server = Server::instance();
   auto &um = server.user_manager();
   if (um.getPlayers().size() <= 10) {
-    server.broadcast("ServerMessage", fmt::format("{} logged out", screenName));
+    server.room_manager().lobby().lock()->announce(fmt::format("{} logged out", screenName));
   }
 
   auto room_ = getRoom().lock();
@@ -273,6 +373,8 @@ void Player::onDisconnected() {
 Router &Player::getRouter() { return *m_router; }
 
 void Player::kick() {
+  if (!m_router) return;
+
   auto weak = weak_from_this();
   if (m_router->getSocket() != nullptr) {
     m_router->getSocket()->disconnectFromHost();
@@ -291,13 +393,19 @@ void Player::emitKicked() {
   f.wait();
 }
 
-void Player::reconnect(std::shared_ptr<ClientSocket> client) {
+void Player::reconnect(std::shared_ptr<ClientSocket> client, int64_t lastSeq) {
   auto &server = Server::instance();
   if (server.user_manager().getPlayers().size() <= 10) {
-    server.broadcast("ServerMessage", fmt::format("{} backed", screenName));
+    server.room_manager().lobby().lock()->announce(fmt::format("{} backed", screenName));
   }
 
   m_router->setSocket(client);
+
+  // 要赶在setState之前补发，不然NetStateChanged的序号会排在补发的包前面
+  // 这次才开始记录的话之前的肯定缺，照样走完整重连
+  bool resumed = lastSeq >= 0 && m_router->replayNotifications(lastSeq);
+  m_router->setNotifyLogEnabled(lastSeq >= 0);
+
   setState(Player::Online);
   setRunned(false);
   ttl = max_ttl;
@@ -305,7 +413,11 @@ void Player::reconnect(std::shared_ptr<ClientSocket> client) {
   auto room = dynamic_pointer_cast<Room>(getRoom().lock());
   if (room) {
     Server::instance().user_manager().setupPlayer(*this, true);
-    room->pushRequest(fmt::format("{},reconnect", id));
+    if (resumed) {
+      if (thinking()) m_router->resendRequest();
+    } else {
+      room->pushRequest(fmt::format("{},reconnect", id));
+    }
   } else {
     // 懒得处理掉线玩家在大厅了！踢掉得了
     doNotify("ErrorMsg", "Unknown Error");
@@ -375,6 +487,7 @@ void Player::onReadyChanged() {
                           Cbor::encodeArray({ id, ready }));
 }
 
+// 存档只进缓存，由SaveStates合并之后再写回
 void Player::saveState(std::string_view jsonData) {
   if (id < 0) return;
 
@@ -389,14 +502,21 @@ void Player::saveState(std::string_view jsonData) {
     return;
   }
 
-  auto hexData = toHex(jsonData);
-  auto &gamedb = Server::instance().gameDatabase();
-  auto sql = fmt::format("REPLACE INTO gameSaves (uid, mode, data) VALUES ({},'{}',X'{}')", id, mode, hexData);
+  auto &saves = Server::instance().user_manager().saveStates();
+  saves.save(id, SaveStates::Mode, mode, jsonData);
+}
+
+static std::string validSaveData(std::string data) {
+  if (data.empty()) return "{}";
+  if (data[0] == '{' || data[0] == '[') return data;
 
-  gamedb.exec(sql);
+  spdlog::warn("Returned data is not valid JSON: {}", data);
+  return "{}";
 }
 
 std::string Player::getSaveState() {
+  if (id < 0) return "{}";
+
   auto room_base = getRoom().lock();
   if (!room_base) return "{}";
   auto room = dynamic_pointer_cast<Room>(room_base);
@@ -408,20 +528,8 @@ std::string Player::getSaveState() {
     return "{}";
   }
 
-  auto sql = fmt::format("SELECT data FROM gameSaves WHERE uid = {} AND mode = '{}'", id, mode);
-
-  auto result = Server::instance().gameDatabase().select(sql);
-  if (result.empty() || result[0].count("data") == 0 || result[0]["data"] == "#null") {
-    return "{}";
-  }
-
-  const auto& data = result[0]["data"];
-  if (!data.empty() && (data[0] == '{' || data[0] == '[')) {
-    return data;
-  }
-
-  spdlog::warn("Returned data is not valid JSON: {}", data);
-  return "{}";
+  auto &saves = Server::instance().user_manager().saveStates();
+  return validSaveData(saves.get(id, SaveStates::Mode, mode));
 }
 
 void Player::saveGlobalState(std::string_view key, std::string_view jsonData) {
@@ -432,31 +540,18 @@ void Player::saveGlobalState(std::string_view key, std::string_view jsonData) {
     return;
   }
 
-  auto hexData = toHex(jsonData);
-  auto &gamedb = Server::instance().gameDatabase();
-  auto sql = fmt::format("REPLACE INTO globalSaves (uid, key, data) VALUES ({},'{}',X'{}')", id, key, hexData);
-  
-  gamedb.exec(sql);
+  auto &saves = Server::instance().user_manager().saveStates();
+  saves.save(id, SaveStates::Global, key, jsonData);
 }
 
 std::string Player::getGlobalSaveState(std::string_view key) {
+  if (id < 0) return "{}";
+
   if (!Sqlite3::checkString(key)) {
     spdlog::error("Invalid key string for getGlobalSaveState: {}", std::string(key));
     return "{}";
   }
 
-  auto sql = fmt::format("SELECT data FROM globalSaves WHERE uid = {} AND key = '{}'", id, key);
-  
-  auto result = Server::instance().gameDatabase().select(sql);
-  if (result.empty() || result[0].count("data") == 0 || result[0]["data"] == "#null") {
-    return "{}";
-  }
-
-  const auto& data = result[0]["data"];
-  if (!data.empty() && (data[0] == '{' || data[0] == '[')) {
-    return data;
-  }
-
-  spdlog::warn("Returned data is not valid JSON: {}", data);
-  return "{}";
+  auto &saves = Server::instance().user_manager().saveStates();
+  return validSaveData(saves.get(id, SaveStates::Global, key));
 }
@@ -22,6 +22,9 @@ public:
   };
 
   explicit Player();
+  // 机器人：不建Router，没有socket也不收发包，状态一直是Robot
+  struct RobotTag {};
+  explicit Player(RobotTag);
   Player(Player &) = delete;
   Player(Player &&) = delete;
   ~Player();
@@ -59,6 +62,8 @@ public:
   void setRunned(bool run);
 
   int getConnId() const;
+  // 由UserManager::addPlayer分配
+  void setConnId(int connId);
 
   // std::string_view getPeerAddress() const;
   std::string_view getUuid() const;
@@ -67,12 +72,16 @@ public:
   std::weak_ptr<RoomBase> getRoom() const;
   void setRoom(RoomBase &room);
 
+  // 机器人没有Router，调用前先用isOnline/getSocket判断
   Router &router() const;
+  std::shared_ptr<ClientSocket> getSocket() const;
 
   void doRequest(const std::string_view &command,
                  const std::string_view &jsonData, int timeout = -1, int64_t timestamp = -1);
   std::string waitForReply(int timeout);
   void doNotify(const std::string_view &command, const std::string_view &data);
+  // 群发用，frame由Router::encodeNotification编码好
+  void sendFrame(std::shared_ptr<std::string> frame);
 
   // 心跳用，若连续TTL个心跳都不回应就踢
   enum { max_ttl = 6 };
@@ -89,13 +98,19 @@ public:
 
   Router &getRouter();
   void emitKicked();
-  void reconnect(std::shared_ptr<ClientSocket> socket);
+  // lastSeq是客户端最后收到的通知序号，老客户端不带，为-1
+  void reconnect(std::shared_ptr<ClientSocket> socket, int64_t lastSeq = -1);
 
   void startGameTimer();
   void pauseGameTimer();
   void resumeGameTimer();
   int getGameTime();
 
+  // 给Lua用的CBOR map，缓存起来，只有编码进去的字段变了才重新编码
+  // RoomThread和主线程都会读，加锁
+  std::string getCborObject();
+  void appendCborObject(std::string &out);
+
   // 模式存档
   void saveState(std::string_view jsonData);
   std::string getSaveState();
@@ -118,7 +133,7 @@ private:
   int winCount = 0;
   int runCount = 0;
 
-  int connId;
+  int connId = 0;
   std::string uuid_str;
 
   int roomId;       // Room that player is in, maybe lobby
@@ -132,4 +147,13 @@ private:
 
   int64_t gameTime = 0; // 在这个房间的有效游戏时长(秒)
   int64_t gameTimerStartTimestamp;
+
+  // 每次改动被编码的字段时+1，与m_cbor_cached_version不同说明缓存失效
+  std::atomic<uint32_t> m_cbor_version = 1;
+  uint32_t m_cbor_cached_version = 0;
+  std::string m_cbor_cache;
+  std::mutex m_cbor_mutex;
+
+  void invalidateCbor();
+  void encodeCbor();
 };
@@ -0,0 +1,227 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "server/user/player_stats.h"
+#include "server/user/user_manager.h"
+#include "server/server.h"
+#include "core/c-wrapper.h"
+#include "core/db_executor.h"
+
+namespace asio = boost::asio;
+
+// 写回的都是增量，和数据库里已有的值相加
+static constexpr const char *upsertPWinRate = ("INSERT INTO pWinRate "
+            "(id, mode, role, win, lose, draw) "
+            "VALUES (?, ?, ?, ?, ?, ?) "
+            "ON CONFLICT(id, mode, role) DO UPDATE SET "
+            "win = win + excluded.win, lose = lose + excluded.lose, "
+            "draw = draw + excluded.draw;");
+
+static constexpr const char *upsertRunRate = ("INSERT INTO runRate "
+            "(id, mode, run) VALUES (?, ?, ?) "
+            "ON CONFLICT(id, mode) DO UPDATE SET run = run + excluded.run;");
+
+void PlayerStats::load(int id) {
+  std::lock_guard<std::mutex> lock { m_mutex };
+  getEntry(id);
+}
+
+PlayerStats::Entry &PlayerStats::getEntry(int id) {
+  if (auto it = m_entries.find(id); it != m_entries.end()) {
+    return it->second;
+  }
+
+  auto &entry = m_entries[id];
+  entry.gen = m_next_gen++;
+
+  auto query = [id](Sqlite3 &db) {
+    LoadResult ret;
+    db.query("SELECT mode, role, win, lose, draw FROM pWinRate WHERE id=?;", { id },
+             [&](const Sqlite3::Row &row) {
+      auto &rec = ret.results[{ std::string(row.getText(0)), std::string(row.getText(1)) }];
+      rec.win = row.getInt(2);
+      rec.lose = row.getInt(3);
+      rec.draw = row.getInt(4);
+    });
+    db.query("SELECT mode, run FROM runRate WHERE id=?;", { id },
+             [&](const Sqlite3::Row &row) {
+      ret.runs[std::string(row.getText(0))] = row.getInt(1);
+    });
+    return ret;
+  };
+
+  // 这个查询一定排在之前所有写回的后面，读到的就是最新的数据
+  Server::instance().dbExecutor().run(query, [this, id, gen = entry.gen](LoadResult result) {
+    onLoaded(id, gen, result);
+  });
+
+  return entry;
+}
+
+void PlayerStats::onLoaded(int id, uint64_t gen, LoadResult &result) {
+  std::vector<std::pair<std::function<void(GameData)>, GameData>> ready;
+  {
+    std::lock_guard<std::mutex> lock { m_mutex };
+    auto it = m_entries.find(id);
+    // 加载期间被清出去又重新加进来了，这个结果已经过时
+    if (it == m_entries.end() || it->second.gen != gen) return;
+    auto entry = &it->second;
+
+    // 加载完成之前的改动都在dirty里，还没写回过，直接加上去
+    for (auto &[key, rec] : result.results) {
+      auto &r = entry->results[key];
+      r.win += rec.win;
+      r.lose += rec.lose;
+      r.draw += rec.draw;
+    }
+    for (auto &[mode, run] : result.runs) {
+      entry->runs[mode] += run;
+    }
+    entry->loaded = true;
+
+    for (auto &[mode, callback] : entry->waiters) {
+      ready.emplace_back(std::move(callback), calcGameData(*entry, mode));
+    }
+    entry->waiters.clear();
+  }
+
+  for (auto &[callback, data] : ready) {
+    callback(data);
+  }
+}
+
+void PlayerStats::addResult(int id, const std::string_view &mode, const std::string_view &role, int result) {
+  Record delta;
+  switch (result) {
+  case 1: delta.win++; break;
+  case 2: delta.lose++; break;
+  case 3: delta.draw++; break;
+  default: break;
+  }
+
+  std::lock_guard<std::mutex> lock { m_mutex };
+  auto &entry = getEntry(id);
+  RoleKey key { std::string(mode), std::string(role) };
+  for (auto map : { &entry.results, &entry.dirty_results }) {
+    auto &r = (*map)[key];
+    r.win += delta.win;
+    r.lose += delta.lose;
+    r.draw += delta.draw;
+  }
+}
+
+void PlayerStats::addRun(int id, const std::string_view &mode) {
+  std::lock_guard<std::mutex> lock { m_mutex };
+  auto &entry = getEntry(id);
+  std::string key { mode };
+  entry.runs[key]++;
+  entry.dirty_runs[key]++;
+}
+
+PlayerStats::GameData PlayerStats::calcGameData(const Entry &entry, const std::string_view &mode) {
+  GameData data;
+  // results按(mode, role)排序，同一模式的记录是连续的
+  for (auto it = entry.results.lower_bound({ std::string(mode), "" });
+       it != entry.results.end() && it->first.first == mode; ++it) {
+    auto &rec = it->second;
+    data.win += rec.win;
+    data.total += rec.win + rec.lose + rec.draw;
+  }
+  if (auto it = entry.runs.find(std::string(mode)); it != entry.runs.end()) {
+    data.run = it->second;
+  }
+  return data;
+}
+
+void PlayerStats::getGameData(int id, const std::string_view &mode, std::function<void(GameData)> callback) {
+  GameData data;
+  {
+    std::lock_guard<std::mutex> lock { m_mutex };
+    auto &entry = getEntry(id);
+    if (!entry.loaded) {
+      entry.waiters.emplace_back(std::string(mode), std::move(callback));
+      return;
+    }
+    data = calcGameData(entry, mode);
+  }
+
+  asio::post(Server::instance().context(), [data, callback = std::move(callback)] {
+    callback(data);
+  });
+}
+
+void PlayerStats::takeDirty(int id, Entry &entry, Batch &batch) {
+  for (auto &[key, rec] : entry.dirty_results) {
+    batch.results.emplace_back(id, key, rec);
+  }
+  for (auto &[mode, run] : entry.dirty_runs) {
+    batch.runs.emplace_back(id, mode, run);
+  }
+  entry.dirty_results.clear();
+  entry.dirty_runs.clear();
+}
+
+void PlayerStats::writeBack(DbExecutor &db, Batch batch) {
+  if (batch.results.empty() && batch.runs.empty()) return;
+
+  db.post([batch = std::move(batch)](Sqlite3 &db) {
+    for (auto &[id, key, rec] : batch.results) {
+      db.execute(upsertPWinRate, { id, key.first, key.second, rec.win, rec.lose, rec.draw });
+    }
+    for (auto &[id, mode, run] : batch.runs) {
+      db.execute(upsertRunRate, { id, mode, run });
+    }
+  });
+}
+
+void PlayerStats::flush() {
+  auto &um = Server::instance().user_manager();
+  Batch batch;
+  {
+    std::lock_guard<std::mutex> lock { m_mutex };
+    for (auto it = m_entries.begin(); it != m_entries.end();) {
+      auto id = it->first;
+      auto &entry = it->second;
+      bool orphan = !um.findPlayer(id).lock();
+
+      // 没加载完的不能写回，否则加载结果里会把这部分算两遍
+      // 已经不在线的反正要扔掉，写回就行
+      if (entry.loaded || orphan) {
+        takeDirty(id, entry, batch);
+      }
+
+      if (orphan) {
+        it = m_entries.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  writeBack(Server::instance().dbExecutor(), std::move(batch));
+}
+
+void PlayerStats::release(int id) {
+  Batch batch;
+  {
+    std::lock_guard<std::mutex> lock { m_mutex };
+    auto it = m_entries.find(id);
+    if (it == m_entries.end()) return;
+    takeDirty(id, it->second, batch);
+    m_entries.erase(it);
+  }
+
+  writeBack(Server::instance().dbExecutor(), std::move(batch));
+}
+
+void PlayerStats::flushAll(DbExecutor &db) {
+  Batch batch;
+  {
+    std::lock_guard<std::mutex> lock { m_mutex };
+    for (auto &[id, entry] : m_entries) {
+      takeDirty(id, entry, batch);
+    }
+    m_entries.clear();
+  }
+
+  writeBack(db, std::move(batch));
+}
@@ -0,0 +1,74 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+class DbExecutor;
+
+// 玩家战绩（pWinRate/runRate）的内存缓存，写回式
+// 登录时整个读进来，游戏结束时只改内存，定时或者下线时攒成一个事务写回去
+// 除flush/release/flushAll外都可能被RoomThread调用，内部有锁
+class PlayerStats {
+public:
+  struct GameData { int total = 0; int win = 0; int run = 0; };
+
+  PlayerStats() = default;
+  PlayerStats(PlayerStats &) = delete;
+  PlayerStats(PlayerStats &&) = delete;
+
+  // 登录时调用，已经在缓存里的话什么都不做
+  void load(int id);
+
+  // result: 1胜 2负 3平
+  void addResult(int id, const std::string_view &mode, const std::string_view &role, int result);
+  void addRun(int id, const std::string_view &mode);
+
+  // callback在主线程执行；还没加载完的话等加载完再调用
+  void getGameData(int id, const std::string_view &mode, std::function<void(GameData)> callback);
+
+  // 以下只能在主线程调用
+  // 写回所有已加载玩家的改动，顺便把已经不在线的玩家清出缓存
+  void flush();
+  // 玩家下线，写回并移出缓存
+  void release(int id);
+  // 关服用，不管加载没加载完全部写回
+  void flushAll(DbExecutor &db);
+
+private:
+  struct Record { int win = 0; int lose = 0; int draw = 0; };
+  using RoleKey = std::pair<std::string, std::string>;  // (mode, role)
+
+  struct Entry {
+    uint64_t gen;
+    bool loaded = false;
+    // 包含尚未写回的部分
+    std::map<RoleKey, Record> results;
+    std::unordered_map<std::string, int> runs;
+    // 尚未写回的增量
+    std::map<RoleKey, Record> dirty_results;
+    std::unordered_map<std::string, int> dirty_runs;
+    std::vector<std::pair<std::string, std::function<void(GameData)>>> waiters;
+  };
+
+  struct LoadResult {
+    std::map<RoleKey, Record> results;
+    std::unordered_map<std::string, int> runs;
+  };
+
+  // 一次写回的内容
+  struct Batch {
+    std::vector<std::tuple<int, RoleKey, Record>> results;
+    std::vector<std::tuple<int, std::string, int>> runs;
+  };
+
+  std::mutex m_mutex;
+  std::unordered_map<int, Entry> m_entries;
+  uint64_t m_next_gen = 1;
+
+  void onLoaded(int id, uint64_t gen, LoadResult &result);
+
+  // 调用者持有m_mutex
+  Entry &getEntry(int id);
+  static GameData calcGameData(const Entry &entry, const std::string_view &mode);
+  static void takeDirty(int id, Entry &entry, Batch &batch);
+  static void writeBack(DbExecutor &db, Batch batch);
+};
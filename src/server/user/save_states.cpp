@@ -0,0 +1,182 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "server/user/save_states.h"
+#include "server/user/user_manager.h"
+#include "server/server.h"
+#include "core/c-wrapper.h"
+#include "core/db_executor.h"
+
+#ifdef FK_USE_ZSTD
+#include <zstd.h>
+#endif
+
+static constexpr const char *upsertSql[2] = {
+  "INSERT INTO gameSaves (uid, mode, data) VALUES (?, ?, ?) "
+  "ON CONFLICT(uid, mode) DO UPDATE SET data = excluded.data;",
+  "INSERT INTO globalSaves (uid, key, data) VALUES (?, ?, ?) "
+  "ON CONFLICT(uid, key) DO UPDATE SET data = excluded.data;",
+};
+
+static constexpr const char *selectSql[2] = {
+  "SELECT data FROM gameSaves WHERE uid = ? AND mode = ?;",
+  "SELECT data FROM globalSaves WHERE uid = ? AND key = ?;",
+};
+
+// 存档本身是JSON，以{或[开头，和zstd帧头（28 B5 2F FD）不会混淆，老数据不用迁移
+static constexpr std::string_view zstdMagic = "\x28\xB5\x2F\xFD";
+// 太小的压缩了也省不了多少
+static constexpr size_t compressThreshold = 512;
+
+std::string SaveStates::encode(std::string_view data) {
+#ifdef FK_USE_ZSTD
+  if (data.size() >= compressThreshold) {
+    std::string out;
+    out.resize(ZSTD_compressBound(data.size()));
+    auto n = ZSTD_compress(out.data(), out.size(), data.data(), data.size(), 3);
+    if (!ZSTD_isError(n) && n < data.size()) {
+      out.resize(n);
+      return out;
+    }
+  }
+#endif
+  return std::string(data);
+}
+
+std::string SaveStates::decode(std::string_view blob) {
+  if (!blob.starts_with(zstdMagic)) return std::string(blob);
+
+#ifdef FK_USE_ZSTD
+  auto size = ZSTD_getFrameContentSize(blob.data(), blob.size());
+  if (size != ZSTD_CONTENTSIZE_ERROR && size != ZSTD_CONTENTSIZE_UNKNOWN) {
+    std::string out;
+    out.resize(size);
+    auto n = ZSTD_decompress(out.data(), out.size(), blob.data(), blob.size());
+    if (!ZSTD_isError(n) && n == size) return out;
+  }
+  spdlog::error("Failed to decompress save state ({} bytes)", blob.size());
+#else
+  spdlog::error("Save state is zstd-compressed but this build has no zstd support");
+#endif
+  return {};
+}
+
+SaveStates::Entry &SaveStates::getEntry(int uid) {
+  auto [it, inserted] = m_entries.try_emplace(uid);
+  if (inserted) it->second.gen = m_next_gen++;
+  return it->second;
+}
+
+void SaveStates::save(int uid, Kind kind, std::string_view key, std::string_view data) {
+  std::lock_guard<std::mutex> lock { m_mutex };
+  auto &item = getEntry(uid).items[kind][std::string(key)];
+  item.data = data;
+  item.dirty = true;
+}
+
+std::string SaveStates::get(int uid, Kind kind, std::string_view key) {
+  uint64_t gen;
+  {
+    std::lock_guard<std::mutex> lock { m_mutex };
+    auto &entry = getEntry(uid);
+    auto &items = entry.items[kind];
+    if (auto it = items.find(std::string(key)); it != items.end()) {
+      return it->second.data;
+    }
+    gen = entry.gen;
+  }
+
+  // RPC处理函数要同步返回，只能在这等；不持锁，别的玩家的存取不受影响
+  auto data = Server::instance().gameDbExecutor().readSync([&](Sqlite3 &db) {
+    std::string ret;
+    db.query(selectSql[kind], { uid, key }, [&](const Sqlite3::Row &row) {
+      if (!row.isNull(0)) ret = decode(row.getBlob(0));
+    });
+    return ret;
+  });
+
+  std::lock_guard<std::mutex> lock { m_mutex };
+  auto it = m_entries.find(uid);
+  // 读库期间被写回并清出缓存了，读到的可能已经过时，这次就不缓存了
+  if (it == m_entries.end() || it->second.gen != gen) return data;
+  // 读库期间又被存了一次的话以新的为准
+  auto [item, _] = it->second.items[kind].try_emplace(std::string(key), Item { data, false });
+  return item->second.data;
+}
+
+void SaveStates::takeDirty(int uid, Entry &entry, Batch &batch) {
+  for (auto kind : { Mode, Global }) {
+    for (auto &[key, item] : entry.items[kind]) {
+      if (!item.dirty) continue;
+      batch.emplace_back(uid, kind, key, item.data);
+      item.dirty = false;
+    }
+  }
+}
+
+void SaveStates::writeBack(DbExecutor &db, Batch batch) {
+  if (batch.empty()) return;
+
+  // 压缩放在DB线程上做，不占RoomThread
+  db.post([batch = std::move(batch)](Sqlite3 &db) {
+    for (auto &[uid, kind, key, data] : batch) {
+      auto blob = encode(data);
+      db.execute(upsertSql[kind], { uid, key, Sqlite3::Blob { blob } });
+    }
+  });
+}
+
+// 写回都在持锁期间post出去：清出缓存之后再来读的，一定排在这次写回后面
+void SaveStates::flush() {
+  auto &um = Server::instance().user_manager();
+  Batch batch;
+  std::lock_guard<std::mutex> lock { m_mutex };
+  for (auto it = m_entries.begin(); it != m_entries.end();) {
+    takeDirty(it->first, it->second, batch);
+    // 人已经不在了的顺手清掉
+    if (!um.findPlayer(it->first).lock()) {
+      it = m_entries.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  writeBack(Server::instance().gameDbExecutor(), std::move(batch));
+}
+
+void SaveStates::release(int uid) {
+  Batch batch;
+  std::lock_guard<std::mutex> lock { m_mutex };
+  auto it = m_entries.find(uid);
+  if (it == m_entries.end()) return;
+  takeDirty(uid, it->second, batch);
+  m_entries.erase(it);
+  writeBack(Server::instance().gameDbExecutor(), std::move(batch));
+}
+
+void SaveStates::flushAll(DbExecutor &db) {
+  Batch batch;
+  std::lock_guard<std::mutex> lock { m_mutex };
+  for (auto &[uid, entry] : m_entries) {
+    takeDirty(uid, entry, batch);
+  }
+  writeBack(db, std::move(batch));
+}
+
+size_t SaveStates::cachedCount() {
+  std::lock_guard<std::mutex> lock { m_mutex };
+  size_t n = 0;
+  for (auto &[_, entry] : m_entries) {
+    n += entry.items[Mode].size() + entry.items[Global].size();
+  }
+  return n;
+}
+
+size_t SaveStates::dirtyCount() {
+  std::lock_guard<std::mutex> lock { m_mutex };
+  size_t n = 0;
+  for (auto &[_, entry] : m_entries) {
+    for (auto &items : entry.items) {
+      for (auto &[_, item] : items) n += item.dirty;
+    }
+  }
+  return n;
+}
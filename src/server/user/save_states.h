@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+class DbExecutor;
+
+// 存档（gameSaves/globalSaves）的写回式缓存
+// Lua一局里经常对同一个key反复存，存档只改内存并标脏，定时或者玩家下线时才写回，
+// 同一个key在这期间存多少次都只写最后一次；读也优先读缓存
+// 写回时绑定成BLOB参数；编译时带了zstd的话，较大的存档压缩后再存
+// save/get会被RoomThread调用，内部有锁
+class SaveStates {
+public:
+  enum Kind { Mode, Global };   // gameSaves按模式，globalSaves按key
+
+  SaveStates() = default;
+  SaveStates(SaveStates &) = delete;
+  SaveStates(SaveStates &&) = delete;
+
+  void save(int uid, Kind kind, std::string_view key, std::string_view data);
+  // 缓存里没有就同步读库，没有存档返回空串
+  std::string get(int uid, Kind kind, std::string_view key);
+
+  // 以下只能在主线程调用
+  void flush();
+  // 玩家下线，写回并移出缓存
+  void release(int uid);
+  // 关服用
+  void flushAll(DbExecutor &db);
+
+  size_t cachedCount();
+  size_t dirtyCount();
+
+private:
+  struct Item {
+    std::string data;
+    bool dirty = false;
+  };
+  struct Entry {
+    uint64_t gen;
+    std::unordered_map<std::string, Item> items[2];
+  };
+  // (uid, kind, key, data)
+  using Batch = std::vector<std::tuple<int, Kind, std::string, std::string>>;
+
+  std::mutex m_mutex;
+  std::unordered_map<int, Entry> m_entries;
+  uint64_t m_next_gen = 1;
+
+  // 调用者持有m_mutex
+  Entry &getEntry(int uid);
+  static void takeDirty(int uid, Entry &entry, Batch &batch);
+  static void writeBack(DbExecutor &db, Batch batch);
+
+  static std::string encode(std::string_view data);
+  static std::string decode(std::string_view blob);
+};
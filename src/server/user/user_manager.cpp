@@ -3,45 +3,54 @@
 #include "server/user/user_manager.h"
 #include "server/user/player.h"
 #include "server/user/auth.h"
+#include "server/user/player_stats.h"
+#include "server/user/save_states.h"
+#include "server/user/access_control.h"
 #include "server/server.h"
 #include "server/room/room_manager.h"
 #include "server/room/lobby.h"
 #include "network/client_socket.h"
 #include "network/router.h"
 #include "core/c-wrapper.h"
+#include "core/db_executor.h"
 
 namespace asio = boost::asio;
 
 UserManager::UserManager() {
   m_auth = std::make_unique<AuthManager>();
+  m_player_stats = std::make_unique<PlayerStats>();
+  m_save_states = std::make_unique<SaveStates>();
 }
 
 std::weak_ptr<Player> UserManager::findPlayer(int id) const {
   if (id < 0) return findRobot(id);
-  try {
-    return online_players_map.at(id);
-  } catch (const std::out_of_range &) {
-    return {};
-  }
+  auto it = online_players_map.find(id);
+  if (it == online_players_map.end()) return {};
+  return it->second;
 }
 
 std::weak_ptr<Player> UserManager::findRobot(int id) const {
-  try {
-    return robots_map.at(id);
-  } catch (const std::out_of_range &) {
-    return {};
-  }
+  auto it = robots_map.find(id);
+  if (it == robots_map.end()) return {};
+  return it->second;
 }
 
 std::weak_ptr<Player> UserManager::findPlayerByConnId(int connId) const {
-  try {
-    return players_map.at(connId);
-  } catch (const std::out_of_range &) {
-    return {};
-  }
+  return players_map.find(connId);
 }
 
-void UserManager::addPlayer(std::shared_ptr<Player> player) {
+bool UserManager::addPlayer(std::shared_ptr<Player> player) {
+  if (!players_map.contains(player->getConnId())) {
+    auto connId = players_map.emplace([&](int connId) {
+      player->setConnId(connId);
+      return player;
+    });
+    if (connId == 0) [[unlikely]] {
+      spdlog::error("Too many connections, failed to allocate connId for player {}", player->getId());
+      return false;
+    }
+  }
+
   int id = player->getId();
   if (id > 0) {
     if (online_players_map[id])
@@ -54,13 +63,20 @@ void UserManager::addPlayer(std::shared_ptr<Player> player) {
 
     robots_map[id] = player;
   }
-
-  players_map[player->getConnId()] = player;
+  return true;
 }
 
 void UserManager::deletePlayer(Player &p) {
-  removePlayer(p, p.getId());
+  auto id = p.getId();
+  removePlayer(p, id);
   removePlayerByConnId(p.getConnId());
+
+  // 跑路的话同一个id还有另一个Player在线，等那个也走了再写回
+  if (!findPlayer(id).lock()) {
+    m_auth->revokeResumeToken(id);
+    m_player_stats->release(id);
+    m_save_states->release(id);
+  }
 }
 
 void UserManager::removePlayer(Player &p, int id) {
@@ -68,15 +84,15 @@ void UserManager::removePlayer(Player &p, int id) {
     online_players_map[id].get() == &p) {
     online_players_map.erase(id);
   }
-  if (robots_map.find(id) != robots_map.end()) {
-    robots_map.erase(id);
+  // 机器人id会回收复用，得确认删的是自己
+  if (auto it = robots_map.find(id); it != robots_map.end() && it->second.get() == &p) {
+    robots_map.erase(it);
+    m_free_robot_ids.push_back(id);
   }
 }
 
 void UserManager::removePlayerByConnId(int connId) {
-  if (players_map.find(connId) != players_map.end()) {
-    players_map.erase(connId);
-  }
+  players_map.erase(connId);
 }
 
 
@@ -89,16 +105,12 @@ void UserManager::processNewConnection(std::shared_ptr<ClientSocket> client) {
   spdlog::info("client {} connected", addr);
 
   auto &server = Server::instance();
-  auto &db = server.database();
-
-  // check ban ip
-  auto result = db.select(fmt::format("SELECT * FROM banip WHERE ip='{}';", addr));
-
   const char *errmsg = nullptr;
 
-  if (!result.empty()) {
+  auto &acl = server.accessControl();
+  if (acl.isIpBanned(addr)) {
     errmsg = "you have been banned!";
-  } else if (server.isTempBanned(addr)) {
+  } else if (acl.isIpTempBanned(addr)) {
     errmsg = "you have been temporarily banned!";
   } else if (online_players_map.size() >= (size_t)server.config().capacity) {
     errmsg = "server is full!";
@@ -130,7 +142,7 @@ void UserManager::processNewConnection(std::shared_ptr<ClientSocket> client) {
   });
 }
 
-void UserManager::createNewPlayer(std::shared_ptr<ClientSocket> client, std::string_view name, std::string_view avatar, int id, std::string_view uuid_str) {
+bool UserManager::createNewPlayer(std::shared_ptr<ClientSocket> client, std::string_view name, std::string_view avatar, int id, std::string_view uuid_str) {
   // create new Player and setup
   auto player = std::make_shared<Player>();
   player->router().setSocket(client);
@@ -141,38 +153,60 @@ void UserManager::createNewPlayer(std::shared_ptr<ClientSocket> client, std::str
   player->setUuid(std::string(uuid_str));
 
   auto &server = Server::instance();
-  if (online_players_map.size() <= 10) {
-    server.broadcast("ServerMessage", fmt::format("{} logged in", player->getScreenName()));
+  bool announce = online_players_map.size() <= 10;
+  if (!addPlayer(player)) {
+    server.sendEarlyPacket(*client, "ErrorDlg", "server is full!");
+    client->disconnectFromHost();
+    return false;
   }
 
-  addPlayer(player);
+  if (announce) {
+    server.room_manager().lobby().lock()->announce(fmt::format("{} logged in", player->getScreenName()));
+  }
 
   setupPlayer(*player);
 
-  auto result = server.database().select(fmt::format(
-    "SELECT totalGameTime FROM usergameinfo WHERE id={};", id
-  ));
-  auto time = atoi(result[0]["totalGameTime"].c_str());
-  player->addTotalGameTime(time);
-  player->doNotify("AddTotalGameTime", Cbor::encodeArray({ id, time }));
-
   auto lobby = Server::instance().room_manager().lobby().lock();
   if (lobby) lobby->addPlayer(*player);
+
+  m_player_stats->load(id);
+
+  auto query = [id](Sqlite3 &db) {
+    int time = 0;
+    db.query("SELECT totalGameTime FROM usergameinfo WHERE id=?;", { id },
+             [&](const Sqlite3::Row &row) { time = row.getInt(0); });
+    return time;
+  };
+  server.dbExecutor().run(query, [weak = player->weak_from_this(), id](int time) {
+    auto player = weak.lock();
+    if (!player) return;
+    player->addTotalGameTime(time);
+    player->doNotify("AddTotalGameTime", Cbor::encodeArray({ id, time }));
+  });
+  return true;
 }
 
-Player &UserManager::createRobot() {
-  static int nextRobotId = -2;
+Player *UserManager::createRobot() {
+  int id;
+  bool exhausted = m_next_robot_id == std::numeric_limits<int>::min();
+  if (m_free_robot_ids.size() >= 64 || (exhausted && !m_free_robot_ids.empty())) {
+    id = m_free_robot_ids.front();
+    m_free_robot_ids.pop_front();
+  } else {
+    id = m_next_robot_id--;
+  }
 
-  auto robot = std::make_shared<Player>();
-  robot->setState(Player::Robot);
-  robot->setId(nextRobotId--);
-  if (nextRobotId < (int)0x800000FF) nextRobotId = -2;
+  auto robot = std::make_shared<Player>(Player::RobotTag {});
+  robot->setId(id);
   robot->setAvatar("guanyu");
   robot->setScreenName(fmt::format("COMP-{}", robot->getId()));
   robot->setReady(true);
 
-  addPlayer(robot);
-  return *robot;
+  if (!addPlayer(robot)) {
+    m_free_robot_ids.push_back(id);
+    return nullptr;
+  }
+  return robot.get();
 }
 
 void UserManager::setupPlayer(Player &player, bool all_info) {
@@ -223,3 +257,15 @@ void UserManager::setupPlayer(Player &player, bool all_info) {
   }
 }
 
+AuthManager &UserManager::auth() {
+  return *m_auth;
+}
+
+PlayerStats &UserManager::playerStats() {
+  return *m_player_stats;
+}
+
+SaveStates &UserManager::saveStates() {
+  return *m_save_states;
+}
+
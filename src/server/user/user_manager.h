@@ -2,9 +2,13 @@
 
 #pragma once
 
+#include "core/slot_map.h"
+
 class ClientSocket;
 class Player;
 class AuthManager;
+class PlayerStats;
+class SaveStates;
 
 class UserManager {
 public:
@@ -14,7 +18,8 @@ public:
 
   std::weak_ptr<Player> findPlayer(int id) const;
   std::weak_ptr<Player> findPlayerByConnId(int connId) const;
-  void addPlayer(std::shared_ptr<Player> player);
+  // connId分配不出来（连接数到上限了）时返回false，这时什么都不登记
+  bool addPlayer(std::shared_ptr<Player> player);
   void deletePlayer(Player &p);
   void removePlayer(Player &p, int id);
   void removePlayerByConnId(int connid);
@@ -23,18 +28,29 @@ public:
 
   void processNewConnection(std::shared_ptr<ClientSocket> client);
 
-  void createNewPlayer(std::shared_ptr<ClientSocket> client, std::string_view name, std::string_view avatar, int id, std::string_view uuid_str);
-  Player &createRobot();
+  // 失败时已经给客户端发了错误并断开
+  bool createNewPlayer(std::shared_ptr<ClientSocket> client, std::string_view name, std::string_view avatar, int id, std::string_view uuid_str);
+  // 分配不到connId时返回nullptr
+  Player *createRobot();
 
   void setupPlayer(Player &player, bool all_info = true);
 
+  AuthManager &auth();
+  PlayerStats &playerStats();
+  SaveStates &saveStates();
+
 private:
   std::unique_ptr<AuthManager> m_auth;
+  std::unique_ptr<PlayerStats> m_player_stats;
+  std::unique_ptr<SaveStates> m_save_states;
 
-  // connId -> Player
-  std::unordered_map<int, std::shared_ptr<Player>> players_map;
+  // connId -> Player，connId就是槽位句柄；RoomThread里的RPC也会来查
+  SlotMap<Player, 20> players_map;
   // Id -> Player
   std::unordered_map<int, std::shared_ptr<Player>> robots_map;
+  // 机器人id从-2往下分配，删掉的id排队回收；攒一些再复用，免得刚走的id马上换了个人
+  int m_next_robot_id = -2;
+  std::deque<int> m_free_robot_ids;
   std::unordered_map<int, std::shared_ptr<Player>> online_players_map;
 
   std::weak_ptr<Player> findRobot(int id) const;